@@ -0,0 +1,189 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <vector>
+
+#define BUFFER_CHUNK_SIZE 16384 /**< Size of the pooled chunks backing a RecvBuffer */
+#define BUFFER_POOL_MAX   1024  /**< Free chunks kept by the pool, the rest are freed */
+#define SEND_IOV_MAX      64    /**< Segments gathered into a single sendmsg() */
+#define SLAB_OBJECTS      64    /**< Objects carved out of each slab of a SlabPool */
+
+/**
+ * @brief Free list of BUFFER_CHUNK_SIZE chunks shared by every session of the process
+ *
+ * Only used from the event loop thread.
+ */
+class BufferPool {
+   public:
+    ~BufferPool();
+
+    char  *acquire();
+    void   release(char *chunk);
+    size_t available() const;
+
+    static BufferPool &instance();
+
+   private:
+    std::vector<char *> free_; // chunks ready to be handed out
+};
+
+/**
+ * @brief Free list of fixed size objects carved out of large slabs
+ *
+ * Slabs are only freed with the pool, a released object goes back on the free list and is handed
+ * out again by the next allocate(). Only used from the event loop thread.
+ */
+class SlabPool {
+   public:
+    SlabPool(size_t object_size, size_t slab_objects = SLAB_OBJECTS);
+    ~SlabPool();
+
+    void  *allocate();
+    void   deallocate(void *object);
+    void   reserve(size_t objects); // preallocate slabs until objects fit without growing
+    size_t objectSize() const;
+    size_t available() const;
+
+   private:
+    SlabPool(const SlabPool &other);
+    SlabPool &operator=(const SlabPool &other);
+
+    struct FreeObject {
+        FreeObject *next;
+    };
+
+    void grow();
+
+    size_t              object_size_;  // size of an object, rounded up for alignment
+    size_t              slab_objects_; // objects per slab
+    size_t              capacity_;     // objects in all the slabs
+    size_t              available_;    // objects on the free list
+    FreeObject         *free_;         // released objects, reused first
+    std::vector<char *> slabs_;        // memory backing the objects
+};
+
+/**
+ * @brief Growable receive buffer, recv() writes into it and the parser reads it in place
+ *
+ * Data lives in [start_, end_) of a single contiguous block. The first block is a pooled chunk,
+ * larger requests move to a bigger block. Consumed space is reclaimed by compacting before the
+ * buffer grows, and an empty buffer hands its block back with release().
+ */
+class RecvBuffer {
+   public:
+    RecvBuffer();
+    ~RecvBuffer();
+
+    /**
+     * @brief Make room for at least min_size more bytes
+     *
+     * @return Pointer to write the received bytes to, follow with commit()
+     */
+    char  *reserve(size_t min_size);
+    size_t writable() const;
+    void   commit(size_t size);
+
+    const char *data() const;
+    size_t      size() const;
+    bool        empty() const;
+    void        consume(size_t size);
+    void        clear();
+
+    // Offset of the first occurrence of needle from the start of data(), -1 if not found
+    ssize_t find(const char *needle, size_t length, size_t from = 0) const;
+
+    // Give the block back to the pool, only when the buffer is empty
+    void release();
+
+   private:
+    RecvBuffer(const RecvBuffer &other);
+    RecvBuffer &operator=(const RecvBuffer &other);
+
+    char  *block_;    // backing storage, NULL while released
+    size_t capacity_; // size of block_
+    size_t start_;    // offset of the first unread byte
+    size_t end_;      // offset past the last received byte
+};
+
+/**
+ * @brief Reference counted block of bytes waiting to be sent
+ *
+ * Either bytes held in memory or a range of an open file, sent with sendfile(2) without going
+ * through user space. Copies share the block, moving a segment around the send queue never copies
+ * its bytes, and the last copy closes the file.
+ */
+class SendSegment {
+   public:
+    SendSegment();
+    explicit SendSegment(std::string &data); // takes the content of data, leaving it empty
+    SendSegment(int fd, off_t offset, size_t size); // takes ownership of fd
+    SendSegment(const SendSegment &other);
+    SendSegment &operator=(const SendSegment &other);
+    ~SendSegment();
+
+    const char *data() const; // NULL for a file segment
+    size_t      size() const;
+    bool        isFile() const;
+    int         fd() const;
+    off_t       offset() const; // file offset of the first byte
+
+    // Grow a file segment by size bytes just written after its range, every copy sees them
+    void extend(size_t size);
+
+   private:
+    struct Block {
+        std::string data;   // bytes to send, empty for a file segment
+        int         fd;     // file to send from, -1 for a memory segment
+        off_t       offset; // first byte of the file range
+        size_t      size;   // length of the file range
+        size_t      refs;   // segments sharing the block, changed atomically
+    };
+
+    void drop();
+
+    Block *block_; // shared block, NULL for an empty segment
+};
+
+/**
+ * @brief Chain of segments waiting to be sent
+ *
+ * A partial send only moves offset_ forward in the first segment, the remaining bytes stay
+ * where they are until the socket takes them.
+ */
+class SendQueue {
+   public:
+    SendQueue();
+
+    void   push(const SendSegment &segment);
+    bool   empty() const;
+    size_t size() const; // bytes left to send
+
+    const SendSegment &front() const;
+    size_t             sent() const; // bytes of front() already sent
+
+    /**
+     * @brief Point iov at the pending bytes, one entry per segment, up to the first file segment
+     *
+     * @param iov [out] Entries to fill
+     * @param max Number of entries in iov
+     * @param count [out] Number of entries filled
+     * @return Bytes covered by the filled entries
+     */
+    size_t gather(struct iovec *iov, int max, int &count) const;
+
+    // Append copies of the first count segments, keeping their bytes alive past consume()
+    void share(std::vector<SendSegment> &segments, int count) const;
+
+    void   consume(size_t size);
+    void   clear();
+
+   private:
+    std::deque<SendSegment> segments_; // segments in sending order
+    size_t                  offset_;   // bytes of the first segment already sent
+    size_t                  size_;     // bytes left in all segments
+};
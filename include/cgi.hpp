@@ -1,5 +1,8 @@
 #include <fcntl.h>
+#include <strings.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <cstring>
 #include <string>
 #include <exception>
 #include <iostream>
@@ -6,6 +6,9 @@
 #include <vector>
 
 #include "http.hpp"
+#include "thread_pool.hpp"
+
+#define DEFAULT_BACKLOG 511 /**< Listen backlog unless `listen ... backlog=N` says otherwise */
 
 /**
  * @brief Configuration options for a single location block
@@ -23,7 +26,10 @@ struct LocationConfig {
           cgi_enabled(false),
           cgi_ext(),
           redirect(0, ""),
-          upload_dir("") {}
+          upload_dir(""),
+          sendfile(false),
+          tcp_nodelay(true),
+          tcp_nopush(false) {}
 
     size_t                     client_max_body_size; /**< Maximum size of a request body */
     bool                       max_body_size;        /**< If set by config */
@@ -36,6 +42,9 @@ struct LocationConfig {
     std::vector<std::string>   cgi_ext;              /**< Supported extensions for the location */
     std::pair<int, std::string> redirect;             /**< Redirect url of the server*/
     std::string                upload_dir;           /**< Set directory for uploads*/
+    bool                       sendfile;             /**< Send static files with sendfile(2) */
+    bool                       tcp_nodelay;          /**< Disable Nagle on the session (TCP_NODELAY) */
+    bool                       tcp_nopush;           /**< Send headers and file in full packets (TCP_CORK) */
 };
 
 /**
@@ -45,6 +54,11 @@ struct ServerConfig {
     ServerConfig()
         : server_names(),
           listen("", 80),
+          backlog(DEFAULT_BACKLOG),
+          deferred(false),
+          fastopen(0),
+          rcvbuf(0),
+          sndbuf(0),
           root("html"),
           error_page(),
           client_max_body_size(1024 * 1024),
@@ -55,6 +69,11 @@ struct ServerConfig {
 
     std::vector<std::string>    server_names;         /**< Server name */
     std::pair<std::string, int> listen;               /**< Address and port to listen on */
+    int                         backlog;              /**< Pending connections queued by the kernel */
+    bool                        deferred;             /**< Wake up on accept only once data arrived */
+    int                         fastopen;             /**< TCP Fast Open queue length, 0 disables it */
+    int                         rcvbuf;               /**< SO_RCVBUF, 0 keeps the system default */
+    int                         sndbuf;               /**< SO_SNDBUF, 0 keeps the system default */
     std::string                 root;                 /**< Root directory for serving files */
     std::map<int, std::string>  error_page;           /**< Default error page */
     size_t                      client_max_body_size; /**< Maximum size of a request body */
@@ -72,7 +91,21 @@ struct HttpConfig {
           error_log("error.log"),
           root("html"),
           client_max_body_size(1024*1024),
-          upload_dir("uploads") {}
+          max_body_size(false),
+          client_body_buffer_size(CLIENT_BODY_BUFFER_SIZE),
+          large_client_header_buffers(LARGE_CLIENT_HEADER_BUFFERS),
+          large_client_header_buffer_size(LARGE_CLIENT_HEADER_BUFFER_SIZE),
+          upload_dir("uploads"),
+          client_header_timeout(60 * 1000),
+          client_body_timeout(60 * 1000),
+          keepalive_timeout(75 * 1000),
+          keepalive_requests(1000),
+          send_timeout(60 * 1000),
+          event_method(""),
+          worker_processes(1),
+          worker_connections(1024),
+          thread_pool_threads(THREAD_POOL_THREADS),
+          thread_pool_max_queue(THREAD_POOL_MAX_QUEUE) {}
 
     std::vector<ServerConfig>  servers;              /**< List of server blocks */
     std::map<int, std::string> error_page;           /**< Default error page */
@@ -80,7 +113,20 @@ struct HttpConfig {
     std::string                root;                 /**< Root directory for serving files */
     size_t                     client_max_body_size; /**< Maximum size of a request body */
     bool                       max_body_size;        /**< If set by config */
+    size_t client_body_buffer_size; /**< Body bytes kept in memory, larger bodies go to a file */
+    size_t large_client_header_buffers;     /**< Buffers the request line and headers may fill */
+    size_t large_client_header_buffer_size; /**< Longest request line or header line */
     std::string                upload_dir;           /**< Set directory for uploads*/
+    size_t client_header_timeout; /**< Milliseconds allowed to receive the request headers */
+    size_t client_body_timeout;   /**< Milliseconds allowed between two body reads */
+    size_t keepalive_timeout;     /**< Milliseconds an idle persistent connection stays open, 0 disables */
+    size_t keepalive_requests;    /**< Requests served on a connection before it is closed */
+    size_t send_timeout;          /**< Milliseconds allowed between two writes to the client */
+    std::string event_method;     /**< Event backend from `use`, empty for the build default */
+    size_t worker_processes;      /**< Number of worker processes, `auto` is one per CPU */
+    size_t worker_connections;    /**< Maximum simultaneous sessions per worker */
+    size_t thread_pool_threads;   /**< Threads doing file I/O per worker, 0 keeps it in the loop */
+    size_t thread_pool_max_queue; /**< File I/O tasks waiting for a thread before running inline */
 };
 
 extern HttpConfig httpConfig;
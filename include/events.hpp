@@ -1,18 +1,44 @@
 #pragma once
 
 #include <fcntl.h>
+#include <signal.h>
 #include <stdint.h>
-#include <sys/event.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
+#include <unistd.h>
+
+// Backend is chosen at build time, define USE_KQUEUE to force kqueue (e.g. libkqueue on Linux)
+#if defined(__linux__) && !defined(USE_KQUEUE)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+// io_uring is an alternative selected in config, define NO_IO_URING to leave it out
+#ifndef NO_IO_URING
+#define USE_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#endif
+#else
+#include <sys/event.h>
+#endif
 
-#include <map>
+#include <cstring>
+#include <deque>
 #include <stdexcept>
+#include <string>
 #include <utility>
+#include <vector>
 
+#include "buffer.hpp"
 #include "logging.hpp"
 
-typedef uint32_t KqueueEvent;
+#define MAX_EVENTS      64   /**< Maximum number of events harvested per listen() */
+#define DEFAULT_MAX_FDS 1024 /**< Initial size of the fd-indexed tables */
+
 typedef uint32_t InternalEvent;
 
 enum EventType : InternalEvent {
@@ -25,19 +51,324 @@ enum EventType : InternalEvent {
     DISCONNECT_EVENT = 32
 };
 
+typedef std::pair<int, InternalEvent> Event; /**< fd (or signal number), event */
+
+/** What an fd attached to an AsyncIo is used for */
+enum AsyncMode {
+    ASYNC_NONE,   /**< Readiness only, the owner of the fd makes its own calls */
+    ASYNC_ACCEPT, /**< Listening socket, READABLE once connections were accepted */
+    ASYNC_STREAM  /**< Session socket, READABLE once data arrived, WRITABLE once a send completed */
+};
+
+/**
+ * @brief Socket calls made by the event backend on behalf of the owner of the fd
+ *
+ * Completion based backends submit the accept, recv and send requests of every socket together
+ * with the event wait. An attached fd is reported READABLE or WRITABLE once a result is waiting,
+ * the calls below take it without blocking.
+ */
+class AsyncIo {
+   public:
+    virtual ~AsyncIo() = 0;
+
+    /** Hand the calls of fd to the backend, until removeEvent(fd) */
+    virtual void attach(int fd, AsyncMode mode) = 0;
+
+    /** Next connection accepted on a listening fd, -1 with errno set if none is waiting */
+    virtual int accept(int fd) = 0;
+
+    /** Append the received bytes to buffer, same results as recv(2) */
+    virtual ssize_t recv(int fd, RecvBuffer &buffer) = 0;
+
+    /**
+     * @brief Take the result of the last send, or submit a send of the front of queue
+     *
+     * @param wanted [out] Bytes the completed send was asked for
+     * @return Bytes sent, 0 if a file ended before its range, -1 with errno set on failure, or
+     *         EAGAIN while a send is in flight (a new one included)
+     */
+    virtual ssize_t send(int fd, const SendQueue &queue, size_t &wanted) = 0;
+};
+
+// Event listener abstract base class
+class EventListener {
+   public:
+    virtual ~EventListener() = 0;
+
+    /**
+     * @brief Wait for up to MAX_EVENTS ready events
+     *
+     * @param events     [out] Ready events, cleared before being filled
+     * @param timeout_ms Milliseconds to block for, -1 blocks until an event is ready
+     * @return Number of events harvested, -1 on error
+     */
+    virtual int  listen(std::vector<Event> &events, int timeout_ms) = 0;
+    virtual bool registerEvent(int fd, InternalEvent events)        = 0;
+    virtual void unregisterEvent(int fd, InternalEvent events)      = 0;
+    virtual void removeEvent(int fd)                                = 0;
+
+    /**
+     * @brief Register the same events for a batch of fds, e.g. the sessions of one accept loop
+     *
+     * Fds have to be non-blocking already. The default registers them one by one, backends that
+     * can submit several changes at once override it.
+     *
+     * @return false if any of the registrations failed
+     */
+    virtual bool registerEvents(const std::vector<int> &fds, InternalEvent events);
+
+    /** Socket calls made by the backend, NULL if it only reports readiness */
+    virtual AsyncIo *asyncIo();
+};
+
+#ifdef USE_EPOLL
+
+// Epoll event handler, signals are delivered through a signalfd
+class EpollEventListener : public EventListener {
+   public:
+    EpollEventListener(size_t max_fds = DEFAULT_MAX_FDS);
+    ~EpollEventListener();
+
+    int  listen(std::vector<Event> &events, int timeout_ms);
+    bool registerEvent(int fd, InternalEvent events);
+    void unregisterEvent(int fd, InternalEvent events);
+    void removeEvent(int fd);
+
+   private:
+    int                   epoll_fd_;              // epoll file descriptor
+    struct epoll_event    eventlist_[MAX_EVENTS]; // events harvested by epoll_wait
+    int                   signal_fd_;             // signalfd for registered signals, -1 if none
+    sigset_t              signal_mask_;           // signals routed to signal_fd_
+    std::vector<uint32_t> events_;                // registered epoll events, indexed by fd
+};
+
+typedef EpollEventListener DefaultEventListener;
+
+#ifdef USE_IO_URING
+
+#define IO_URING_ENTRIES     1024  /**< Submission queue entries */
+#define IO_URING_BUFFERS     256   /**< Receive buffers in the registered ring, a power of two */
+#define IO_URING_BUFFER_SIZE 16384 /**< Size of a receive buffer */
+#define IO_URING_READ_SIZE   65536 /**< File bytes read for each send of a file segment */
+
+/**
+ * @brief io_uring event handler, making the socket calls of the fds attached through AsyncIo
+ *
+ * Registration changes only mark the fd dirty, requests are (re-)armed at the start of listen()
+ * and submitted together with the wait in a single io_uring_enter.
+ *
+ * Attached fds do not wait for readiness. A listening socket keeps a multishot accept armed, a
+ * session a multishot recv filling buffers the kernel takes from a registered ring, and sends go
+ * out as sendmsg requests, a file segment as a read followed by a send. The results wait in the
+ * fd state until they are taken. Other fds (signals, the pool pipe) are driven by one-shot
+ * IORING_OP_POLL_ADD requests re-armed after they fired, which gives the same level-triggered
+ * behaviour as the epoll backend. Without the buffer ring, or on kernels without multishot
+ * requests, attached fds fall back to polls and the calls are made directly.
+ */
+class IoUringEventListener : public EventListener, public AsyncIo {
+   public:
+    IoUringEventListener(size_t max_fds = DEFAULT_MAX_FDS, unsigned entries = IO_URING_ENTRIES);
+    ~IoUringEventListener();
+
+    int      listen(std::vector<Event> &events, int timeout_ms);
+    bool     registerEvent(int fd, InternalEvent events);
+    void     unregisterEvent(int fd, InternalEvent events);
+    void     removeEvent(int fd);
+    AsyncIo *asyncIo();
+
+    void    attach(int fd, AsyncMode mode);
+    int     accept(int fd);
+    ssize_t recv(int fd, RecvBuffer &buffer);
+    ssize_t send(int fd, const SendQueue &queue, size_t &wanted);
+
+   private:
+    // Accepted connection or filled receive buffer
+    struct Completion {
+        int      value; // accepted fd, or id of the receive buffer
+        unsigned size;  // bytes in the receive buffer
+    };
+
+    // Send in flight, owns everything the kernel reads until it completed
+    struct SendOp {
+        SendOp() : fd(-1), offset(0), wanted(0), result(0), reading(false), done(false), orphaned(false) {}
+
+        int                      fd;       // session socket
+        off_t                    offset;   // file offset read from for a file segment
+        size_t                   wanted;   // bytes asked for
+        ssize_t                  result;   // bytes sent, -errno on failure
+        bool                     reading;  // reading the file range, the send follows
+        bool                     done;     // result can be taken
+        bool                     orphaned; // the fd was removed, freed once the kernel is done
+        std::vector<SendSegment> segments; // keep the bytes, and the file, alive
+        std::vector<char>        buffer;   // bytes read for a file segment
+        struct iovec             iov[SEND_IOV_MAX];
+        struct msghdr            msg;
+    };
+
+    struct FdState {
+        FdState()
+            : mask(0), generation(0), session(0), revents(0), mode(ASYNC_NONE), armed(false),
+              dirty(false), ready(false), multishot(false), cancelled(false), no_buffers(false),
+              eof(false), error(0), send(NULL) {}
+
+        uint32_t               mask;       // requested poll events
+        uint32_t               generation; // tags the armed poll, stale completions are dropped
+        uint32_t               session;    // tags accept and recv requests, bumped on removal
+        uint32_t               revents;    // poll events fired and not reported yet
+        AsyncMode              mode;       // calls made for the fd
+        bool                   armed;      // a poll request is in flight
+        bool                   dirty;      // queued for (re-)arming
+        bool                   ready;      // queued for reporting
+        bool                   multishot;  // an accept or recv request is in flight
+        bool                   cancelled;  // and its cancellation was submitted
+        bool                   no_buffers; // the receive buffers ran out, wait with a poll
+        bool                   eof;        // the peer closed its side
+        int                    error;      // errno of a failed accept or recv, 0 if none
+        std::deque<Completion> completed;  // results waiting to be taken, in order
+        SendOp                *send;       // send of the fd, NULL if none
+    };
+
+    void                 release();
+    void                 registerBuffers();
+    void                 drain();
+    struct io_uring_sqe *getSqe();
+    int                  enter(unsigned int min_complete, int timeout_ms);
+    void                 harvest(std::vector<Event> &events);
+    void                 arm(int fd);
+    void                 armRequest(int fd, FdState &state);
+    void                 submit(SendOp *op);
+    void                 complete(const struct io_uring_cqe &cqe, std::vector<Event> &events);
+    void                 completeSend(SendOp *op, int res);
+    bool                 pending(const FdState &state) const;
+    void                 report(int fd, std::vector<Event> &events);
+    void                 setMask(int fd, uint32_t mask);
+    void                 cancelPoll(int fd, FdState &state);
+    void                 cancel(uint64_t user_data);
+    void                 markDirty(int fd);
+    void                 markReady(int fd);
+    void                 recycle(unsigned id);
+
+    int                       ring_fd_;      // io_uring file descriptor
+    void                     *sq_ring_;      // mapped submission ring
+    void                     *cq_ring_;      // mapped completion ring, may alias sq_ring_
+    size_t                    sq_ring_size_; // size of the sq_ring_ mapping
+    size_t                    cq_ring_size_; // size of the cq_ring_ mapping
+    struct io_uring_sqe      *sqes_;         // mapped submission entries
+    unsigned                  sq_entries_;   // number of submission entries
+    unsigned                 *sq_head_;      // submission ring head, advanced by the kernel
+    unsigned                 *sq_tail_;      // submission ring tail
+    unsigned                 *sq_mask_;      // submission ring index mask
+    unsigned                 *sq_array_;     // submission ring, indexes into sqes_
+    unsigned                 *cq_head_;      // completion ring head
+    unsigned                 *cq_tail_;      // completion ring tail, advanced by the kernel
+    unsigned                 *cq_mask_;      // completion ring index mask
+    struct io_uring_cqe      *cqes_;         // mapped completion entries
+    unsigned                  to_submit_;    // entries queued since the last io_uring_enter
+    struct io_uring_buf_ring *buffer_ring_;  // receive buffers handed to the kernel, NULL if none
+    char                     *buffers_;      // IO_URING_BUFFERS receive buffers
+    unsigned short            buffer_tail_;  // tail of buffer_ring_
+    bool                      multishot_;    // the kernel takes multishot accept and recv
+    bool                      draining_;     // shutting down, completions are only collected
+    size_t                    inflight_;     // accept, recv and send requests not completed
+    int                       signal_fd_;    // signalfd for registered signals, -1 if none
+    sigset_t                  signal_mask_;  // signals routed to signal_fd_
+    std::vector<FdState>      polls_;        // fd state, indexed by fd
+    std::vector<int>          dirty_;        // fds to (re-)arm on the next listen()
+    std::vector<int>          ready_;        // fds with results or poll events to report
+    std::vector<uint64_t>     cancels_;      // cancellations that did not fit in the ring
+    std::vector<SendOp *>     deferred_;     // sends that did not fit in the ring
+};
+
+/**
+ * @brief Backend for `use io_uring`, epoll when the ring cannot be set up
+ */
+EventListener *io_uring_listener_generator(size_t   max_fds = DEFAULT_MAX_FDS,
+                                           unsigned entries = IO_URING_ENTRIES);
+
+#endif
+
+#else
+
 // Kqueue event handler
-class KqueueEventListener {
+class KqueueEventListener : public EventListener {
    public:
-    KqueueEventListener();
+    KqueueEventListener(size_t max_fds = DEFAULT_MAX_FDS);
+    ~KqueueEventListener();
 
-    std::pair<int, InternalEvent> listen();
-    bool                          registerEvent(int fd, InternalEvent events);
-    void                          unregisterEvent(int fd, InternalEvent events);
-    void                          removeEvent(int fd);
+    int  listen(std::vector<Event> &events, int timeout_ms);
+    bool registerEvent(int fd, InternalEvent events);
+    void unregisterEvent(int fd, InternalEvent events);
+    void removeEvent(int fd);
+    bool registerEvents(const std::vector<int> &fds, InternalEvent events);
 
    private:
-    int                                  queue_fd_;       // kqueue file descriptor
-    struct timespec                      timeout_;        // timeout for kevent
-    std::map<int, struct kevent>         events_;         // ident, event parameters
-    std::map<KqueueEvent, InternalEvent> KqueueEventMap;  // map for converting events
+    int                        queue_fd_;              // kqueue file descriptor
+    struct timespec            timeout_;               // timeout for kevent
+    struct kevent              eventlist_[MAX_EVENTS]; // events harvested by kevent
+    std::vector<InternalEvent> events_;                // registered events, indexed by ident
 };
+
+typedef KqueueEventListener DefaultEventListener;
+
+#endif
+
+// EventListener generator function, method is the `use` directive, empty for the build default,
+// max_fds sizes the fd-indexed tables up front (they still grow past it)
+EventListener* event_listener_generator(const std::string &method  = "",
+                                        size_t             max_fds = DEFAULT_MAX_FDS);
+
+#define TIMER_TICK_MS      100                     /**< Timer wheel resolution */
+#define TIMER_WHEEL_BITS   6                       /**< log2 of the slots per level */
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS) /**< Slots per level */
+#define TIMER_WHEEL_MASK   (TIMER_WHEEL_SLOTS - 1) /**< Slot index mask */
+#define TIMER_WHEEL_LEVELS 4                       /**< Levels, covers ~19 days of ticks */
+
+/**
+ * @brief Hierarchical timer wheel
+ *
+ * Timers are keyed by a small non-negative id (a session fd) and stored in intrusive lists, so
+ * scheduling, rescheduling and cancelling are O(1). Level 0 holds the next TIMER_WHEEL_SLOTS
+ * ticks, each higher level is cascaded down one slot at a time when the level below wraps.
+ */
+class TimerWheel {
+   public:
+    TimerWheel(unsigned long now_ms);
+
+    void   schedule(int id, unsigned long now_ms, unsigned long timeout_ms);
+    void   cancel(int id);
+    bool   pending(int id) const;
+    size_t size() const;
+
+    /**
+     * @brief Advance the wheel to now_ms
+     *
+     * @param now_ms  Current monotonic time
+     * @param expired [out] Ids of the timers that expired, they are no longer pending
+     */
+    void expire(unsigned long now_ms, std::vector<int> &expired);
+
+    /**
+     * @brief Milliseconds until the wheel needs to be advanced, -1 if no timer is pending
+     */
+    int nextTimeout(unsigned long now_ms) const;
+
+   private:
+    struct TimerNode {
+        int           prev;    // previous node in the slot, -1 if head
+        int           next;    // next node in the slot, -1 if tail
+        int           slot;    // slot the node is linked in, -1 if not pending
+        unsigned long expires; // tick the timer expires on
+    };
+
+    void link(int id);
+    void unlink(int id);
+    void cascade(int level, int index);
+
+    unsigned long          tick_;  // next tick to process
+    size_t                 count_; // pending timers
+    std::vector<TimerNode> nodes_; // indexed by id
+    int slots_[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS]; // head id per slot, -1 if empty
+};
+
+// Milliseconds from a monotonic clock
+unsigned long monotonicMillis();
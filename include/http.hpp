@@ -2,71 +2,316 @@
 
 #include <map>
 #include <string>
+#include <vector>
 #include <iostream>
 #include <sstream>
 #include <iomanip>
+#include "multipart.hpp"
 #include "socket.hpp"
+#include "upload.hpp"
 
 /** HTTP headers */
 #define HTTP_VERSION "HTTP/1.1"
+#define SERVER_NAME  "webserv/0.1"
 #define CRLF         "\r\n"
 
+/** Request bodies */
+#define CLIENT_BODY_BUFFER_SIZE 16384                       /**< Default body bytes kept in memory */
+#define CLIENT_BODY_TEMP_PATH   "/tmp/webserv-body-XXXXXX"  /**< mkstemp() template of spooled bodies */
+
+/** Request headers */
+#define LARGE_CLIENT_HEADER_BUFFERS     4     /**< Default buffers the header block may fill */
+#define LARGE_CLIENT_HEADER_BUFFER_SIZE 8192  /**< Default longest request line or header line */
+
 /** HTTP methods */
 enum HttpMethod {
     UNKNOWN,
     GET,
     POST,
-    DELETE
+    DELETE,
+    HEAD,
+    PUT,
+    OPTIONS,
+    PATCH
 };
 
 /** HTTP status codes */
 enum HttpStatus {
-    OK                    = 200,
-    CREATED               = 201,
-    ACCEPTED              = 202,
-    NO_CONTENT            = 204,
-    MOVED_PERMANENTLY     = 301,
-    FOUND                 = 302,
-    NOT_MODIFIED          = 304,
-    BAD_REQUEST           = 400,
-    FORBIDDEN             = 403,
-    NOT_FOUND             = 404,
-    METHOD_NOT_ALLOWED    = 405,
-    CONTENT_TOO_LARGE     = 413,
-    IM_A_TEAPOT           = 418,
-    INTERNAL_SERVER_ERROR = 500,
-    BAD_GATEWAY           = 502
+    OK                              = 200,
+    CREATED                         = 201,
+    ACCEPTED                        = 202,
+    NO_CONTENT                      = 204,
+    MOVED_PERMANENTLY               = 301,
+    FOUND                           = 302,
+    NOT_MODIFIED                    = 304,
+    BAD_REQUEST                     = 400,
+    FORBIDDEN                       = 403,
+    NOT_FOUND                       = 404,
+    METHOD_NOT_ALLOWED              = 405,
+    CONTENT_TOO_LARGE               = 413,
+    URI_TOO_LONG                    = 414,
+    EXPECTATION_FAILED              = 417,
+    IM_A_TEAPOT                     = 418,
+    REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
+    INTERNAL_SERVER_ERROR           = 500,
+    BAD_GATEWAY                     = 502
+};
+
+/** Header names interned for direct access, anything else is HEADER_OTHER */
+enum HeaderId {
+    HEADER_OTHER,
+    HEADER_ACCEPT,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_DISPOSITION,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_COOKIE,
+    HEADER_EXPECT,
+    HEADER_HOST,
+    HEADER_LOCATION,
+    HEADER_REFERER,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_USER_AGENT,
+    HEADER_COUNT
+};
+
+/**
+ * @brief Header fields of a request or a response, names matched case-insensitively
+ *
+ * Names and values are copied back to back into a single string and fields only keep offsets
+ * into it, so a request with any number of headers costs two allocations. Known names are
+ * interned once when stored, the first field of each HeaderId is found through index_ without
+ * comparing a string.
+ */
+class HttpHeaders {
+   public:
+    HttpHeaders();
+
+    // Store a field as received, a repeated name is kept next to the earlier one
+    void add(const char *name, size_t name_size, const char *value, size_t value_size);
+
+    // Store a field, replacing the earlier ones with the same name
+    void set(HeaderId id, const std::string &value);
+    void set(const std::string &name, const std::string &value);
+
+    bool        has(HeaderId id) const;
+    bool        has(const std::string &name) const;
+    std::string get(HeaderId id) const; // value of the first field, empty if there is none
+    std::string get(const std::string &name) const;
+
+    size_t      size() const;
+    std::string name(size_t index) const;
+    std::string value(size_t index) const;
+    HeaderId    id(size_t index) const;
+
+    // "name: value" CRLF for every field, known names in their usual case
+    void   serialize(std::string &buffer) const;
+    size_t serializedSize() const; // bytes serialize() appends
+
+    static HeaderId    intern(const char *name, size_t size);
+    static const char *canonical(HeaderId id); // usual spelling, NULL for HEADER_OTHER
+
+   private:
+    struct Field {
+        HeaderId id;
+        size_t   name;       // offset of the name in bytes_
+        size_t   name_size;  // length of the name
+        size_t   value;      // offset of the value in bytes_
+        size_t   value_size; // length of the value
+    };
+
+    size_t find(const std::string &name) const; // index of the first field, size() if none
+    void   remove(HeaderId id, const std::string &name);
+    void   reindex();
+
+    std::string        bytes_;               // names and values of every field
+    std::vector<Field> fields_;              // fields in the order they were stored
+    size_t             index_[HEADER_COUNT]; // 1 + index of the first field of each id, 0 if none
+};
+
+/** Part of a multipart/form-data body */
+struct FormPart {
+    std::string name;     /**< Name of the form field */
+    std::string filename; /**< File name sent by the client, empty for a plain field */
+    std::string value;    /**< Content of a plain field */
+    UploadFile  file;     /**< Content of a file, written to the upload directory as it arrives */
+};
+
+/** multipart/form-data body parsed while it is received, see HttpParser::formTo() */
+struct FormData {
+    FormData() : size(0), values_size(0), complete(false) {}
+
+    std::vector<FormPart> parts;       /**< Parts in body order */
+    size_t                size;        /**< Body bytes received */
+    size_t                values_size; /**< Bytes of the plain field values, kept in memory */
+    bool                  complete;    /**< The closing delimiter was received */
 };
 
 /** Represents an HTTP request */
 class HttpRequest {
    public:
-    HttpRequest(const std::string &request, Session *currentSession);
+    HttpRequest();
     std::string printRequest() const;
 
-   private:
-    std::string consumeNextToken(std::string &buffer, const std::string &delimiter);
+    // Whether the client wants the connection kept open, from the version and Connection header
+    bool keepAlive() const;
+
+    size_t bodySize() const; // length of the body, in memory or spooled
+    bool   loadBody();       // read a spooled body back into body_, for handlers needing it whole
+
+    static HttpMethod  method(const char *name, size_t size); // UNKNOWN if not supported
+    static const char *methodName(HttpMethod method);
 
    public:
     HttpMethod                               method_;    /**< HTTP method (GET, POST, etc.) */
     std::string                              uri_;       /**< Request URI */
     std::string                              version_;   /**< HTTP version */
-    std::map<std::string, std::string>       headers_;   /**< Other headers */
+    HttpHeaders                              headers_;   /**< Other headers */
     std::string                              body_;      /**< Request body (if any) */
-    static std::map<std::string, HttpMethod> methodMap_; /**< Map of HTTP methods */
+    SendSegment                              body_file_; /**< Body spooled to a temporary file, body_ is empty then */
+    UploadFile                               upload_;    /**< Upload the body is streamed to instead, see HttpParser::uploadTo() */
+    FormData                                 form_;      /**< Form the body is parsed into instead, see HttpParser::formTo() */
     Session                                 *currentSession;
 };
 
+/**
+ * @brief Resumable request parser, fed the receive buffer of a session after every read
+ *
+ * The buffer holds the request from its first byte until parse() reports it complete, the parser
+ * keeps its offset into it and never looks at a byte twice. Lines, tokens and the request-target
+ * are delimited with the Scanner, which also rejects bytes they may not contain. Headers are
+ * stored as their lines complete. Body bytes, decoded from chunks if needed, are handed to the request as they arrive:
+ * the first body_buffer_size_ bytes stay in memory, a larger body moves to an unlinked temporary
+ * file. Once in the body the caller drops the parsed bytes with discard(), so neither the receive
+ * buffer nor the request grows with the size of the body.
+ *
+ * parse() returns once the headers of a request with a body are complete, bodyPending() is true
+ * until the next call. The caller can then send the body to an upload file with uploadTo(), or
+ * parse a form as it arrives with formTo(), and cap its size with limitBody().
+ *
+ * A line longer than the header buffer size is rejected as soon as that many bytes are buffered,
+ * without waiting for its end, and so is a header block larger than all the buffers together.
+ */
+class HttpParser {
+   public:
+    enum State {
+        REQUEST_LINE,   /**< Waiting for the request line */
+        HEADERS,        /**< Reading header lines */
+        BODY,           /**< Waiting for Content-Length bytes */
+        CHUNK_SIZE,     /**< Reading a chunk size line */
+        CHUNK_DATA,     /**< Copying chunk data */
+        CHUNK_DATA_END, /**< Waiting for the CRLF after chunk data */
+        TRAILERS,       /**< Reading trailer lines after the last chunk */
+        COMPLETE,       /**< request() is ready */
+        INVALID         /**< Malformed request, the connection cannot be reused */
+    };
+
+    HttpParser();
+
+    /**
+     * @brief Continue parsing the buffered request
+     *
+     * @param data Start of the request, the same bytes as the previous call plus new ones
+     * @param size Bytes available
+     * @return State reached, COMPLETE or INVALID end the request
+     */
+    State parse(const char *data, size_t size);
+
+    HttpRequest &request();
+    size_t       length() const; /**< Bytes the complete request took in the buffer */
+    bool         inBody() const; /**< Headers are complete, the body is not */
+    bool         bodyPending() const; /**< parse() stopped right after the headers, see uploadTo() */
+    HttpStatus   error() const;  /**< Status answering an INVALID request */
+    void         reset();        /**< Get ready for the next request */
+
+    void setBodyBuffer(size_t size); /**< Body bytes kept in memory before spooling to a file */
+    void setHeaderBuffers(size_t number, size_t size); /**< Limits of the request line and headers */
+
+    /**
+     * @brief Reject a body larger than max, while bodyPending(). A Content-Length is checked
+     *        right away, a chunked body as soon as a chunk size goes past max
+     *
+     * @return false if the announced Content-Length is already too large
+     */
+    bool limitBody(size_t max);
+
+    /**
+     * @brief Write the whole body to a new UploadFile of directory as it arrives, while bodyPending()
+     *
+     * @return false if the file cannot be created or its Content-Length reserved
+     */
+    bool uploadTo(const std::string &directory);
+
+    /**
+     * @brief Parse a multipart/form-data body into the form of the request as it arrives, while
+     *        bodyPending(). Files go to UploadFiles of directory, plain fields stay in memory
+     *        up to the body buffer size
+     */
+    bool formTo(const std::string &directory, const std::string &boundary);
+
+    /**
+     * @brief Forget the body bytes parsed so far, they are already in the request
+     *
+     * @return Bytes to consume from the front of the buffer before the next parse()
+     */
+    size_t discard();
+
+   private:
+    bool line(const char *data, size_t size, const char *&begin, const char *&end);
+    bool lineTooLong(size_t size);
+    bool requestLine(const char *begin, const char *end);
+    bool headerLine(const char *begin, const char *end);
+    bool headersComplete();
+    bool bodyData(const char *data, size_t size);
+    bool formData(const char *data, size_t size);
+    bool spool();
+
+    State           state_;              // where the parser stands
+    HttpStatus      error_;              // why the request is INVALID
+    size_t          pos_;                // offset of the first byte not parsed yet
+    size_t          scan_;               // offset where the search for the end of the line resumes
+    size_t          content_length_;     // body bytes left from Content-Length
+    size_t          chunk_left_;         // bytes left in the current chunk
+    size_t          body_buffer_size_;   // body bytes kept in memory
+    size_t          header_buffers_;     // lines of the header block fit in this many buffers
+    size_t          header_buffer_size_; // longest request line or header line
+    size_t          body_max_;           // largest body accepted, see limitBody()
+    bool            body_pending_;       // parse() returned after the headers, no body byte parsed yet
+    bool            form_;               // the body goes to multipart_
+    MultipartParser multipart_;          // parser of a form body
+    std::string     upload_directory_;   // where the files of a form go
+    HttpRequest     request_;            // request filled while parsing
+};
+
 /** Represents an HTTP response */
 class HttpResponse {
    public:
-    std::string getMessage() const;
+    HttpResponse() : status_(OK), tcp_nodelay_(true), tcp_nopush_(false) {}
+
+    /**
+     * @brief Serialize the status line and the headers, up to the empty line, into head
+     *
+     * head is sized once to the exact length before anything is written. The body is not part of
+     * it, the caller sends body_ or file_ as a segment of its own.
+     */
+    void writeHead(std::string &head) const;
+
+    std::string getMessage() const; /**< Head and body_ in one string, see writeHead() */
+
+    /**
+     * @brief Preformatted status line of status
+     *
+     * @param size [out] Length of the line
+     * @return "HTTP/1.1 NNN Reason" CRLF, NULL for a code without a known reason
+     */
+    static const char *statusLine(HttpStatus status, size_t &size);
 
    public:
-    std::string                              version_;   /**< HTTP version */
     HttpStatus                               status_;    /**< HTTP status code and message */
     std::string                              server_;    /**< Value of the Server header */
-    std::map<std::string, std::string>       headers_;   /**< Other headers */
+    HttpHeaders                              headers_;   /**< Other headers */
     std::string                              body_;      /**< Response body (if any) */
-    static std::map<HttpStatus, std::string> statusMap_; /**< Map of HTTP status codes */
+    SendSegment                              file_;      /**< File sent as the body instead of body_ */
+    bool                                     tcp_nodelay_; /**< tcp_nodelay of the location */
+    bool                                     tcp_nopush_;  /**< tcp_nopush of the location */
 };
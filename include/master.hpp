@@ -0,0 +1,56 @@
+#pragma once
+
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <map>
+
+#include "config.hpp"
+#include "logging.hpp"
+
+#define WORKER_RESPAWN_DELAY   1 /**< Seconds to wait before respawning a worker that died at once */
+#define WORKER_RESPAWN_LIMIT   3 /**< Workers in a row dying at once before the master gives up */
+#define WORKER_STARTUP_FAILURE 2 /**< Exit status of a worker that could not start serving */
+
+// Body of a worker process, returns its exit status
+typedef int (*WorkerFunction)(const HttpConfig &config);
+
+// Run a single worker process until it is stopped, WORKER_STARTUP_FAILURE if it could not start
+int run_worker(const HttpConfig &config);
+
+/**
+ * @brief Master process, forks and supervises the worker processes
+ *
+ * Every worker builds its own HttpServer, event listener and SO_REUSEPORT listening sockets after
+ * the fork, the kernel spreads new connections over the workers. The master only waits for
+ * signals: crashed workers are respawned, SIGINT/SIGTERM are forwarded to the workers before the
+ * master exits. Workers that keep dying right after the spawn (a port taken, a bad config) are
+ * not respawned past WORKER_RESPAWN_LIMIT. With a single worker the server runs in the calling
+ * process.
+ */
+class MasterProcess {
+   public:
+    MasterProcess(const HttpConfig &config, WorkerFunction worker = run_worker);
+
+    /**
+     * @brief Run the workers until the server is stopped
+     *
+     * @return Exit status of the process
+     */
+    int run();
+
+   private:
+    void spawnWorker();
+    void reapWorkers();
+    void stopWorkers();
+
+    HttpConfig            config_;      /**< Configuration passed to every worker */
+    WorkerFunction        worker_;      /**< Run in every worker process */
+    sigset_t              signal_mask_; /**< Signals the master waits for */
+    sigset_t              saved_mask_;  /**< Signal mask restored in the workers */
+    std::map<pid_t, long> workers_;     /**< Worker pid, time it was spawned */
+    bool                  stopping_;    /**< Workers were asked to stop, do not respawn */
+    size_t                failures_;    /**< Workers in a row that died right after the spawn */
+};
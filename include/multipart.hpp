@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#define MULTIPART_BOUNDARY_MAX 70    /**< Longest boundary allowed by RFC 2046 */
+#define MULTIPART_HEADERS_MAX  8192  /**< Bytes of part headers kept before the part is rejected */
+
+class HttpHeaders;
+
+/** Receives the parts of a multipart body as MultipartParser finds them */
+class MultipartSink {
+   public:
+    virtual ~MultipartSink() {}
+
+    // Header block of the next part is complete, its data follows
+    virtual bool partBegin(const HttpHeaders &headers) = 0;
+
+    // Next slice of the current part, any length, never empty
+    virtual bool partData(const char *data, size_t size) = 0;
+
+    // The current part ended at a delimiter
+    virtual bool partEnd() = 0;
+};
+
+/**
+ * @brief Incremental multipart/form-data (RFC 7578) parser, fed the body as it arrives
+ *
+ * Part data is scanned for the delimiter with Boyer-Moore-Horspool, which mostly looks at one
+ * byte per delimiter length. Data goes to the sink straight from the fed buffer, the parser only
+ * keeps what cannot be decided yet: a tail that may start a delimiter split across two feeds,
+ * and the header block of the part being read. Memory stays bounded whatever the number and the
+ * size of the parts, each byte is handed over once.
+ */
+class MultipartParser {
+   public:
+    enum State {
+        PREAMBLE,      /**< Skipping bytes before the first delimiter */
+        DELIMITER_END, /**< After a delimiter, "--" closes the body, CRLF opens a part */
+        HEADERS,       /**< Reading the header block of a part */
+        DATA,          /**< Handing part data to the sink */
+        DONE,          /**< Closing delimiter seen, the rest is ignored */
+        INVALID        /**< Malformed body or the sink failed */
+    };
+
+    MultipartParser();
+    explicit MultipartParser(const std::string &boundary);
+
+    /**
+     * @brief Parse the next bytes of the body
+     *
+     * @return State reached, DONE once the closing delimiter went by
+     */
+    State feed(const char *data, size_t size, MultipartSink &sink);
+    State state() const;
+
+    /**
+     * @brief Value of a parameter of a header value, like the boundary of a Content-Type
+     *
+     * @return Value without its quotes, empty if the parameter is missing
+     */
+    static std::string parameter(const std::string &value, const std::string &name);
+
+   private:
+    size_t search(const char *data, size_t size) const;
+    size_t partial(const char *data, size_t size) const;
+    bool   scan(const char *&data, size_t &size, MultipartSink &sink);
+    bool   delimiterEnd(const char *&data, size_t &size);
+    bool   headers(const char *&data, size_t &size, MultipartSink &sink);
+    bool   emit(const char *data, size_t size, MultipartSink &sink);
+
+    State       state_;     // where the parser stands
+    std::string delimiter_; // CRLF "--" boundary
+    size_t      skip_[256]; // Horspool shift for each last byte of the window
+    std::string pending_;   // bytes of the body not decided yet, see above
+};
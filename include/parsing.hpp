@@ -1,15 +1,25 @@
 #pragma once
 
 #include <algorithm>
+#include <climits>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <regex>
 #include <stdexcept>
+#include <unistd.h>
 #include <vector>
 
 #include "config.hpp"
 
+// OPEN_MAX is not provided by glibc
+#ifndef OPEN_MAX
+#define OPEN_MAX 65536
+#endif
+
+#define MAX_WORKER_PROCESSES 1024 /**< Upper bound for worker_processes */
+#define MAX_POOL_THREADS     512  /**< Upper bound for thread_pool threads= */
+
 // Context Settings
 #define GLOBAL 0
 #define EVENTS 1
@@ -58,6 +68,7 @@ class Parser {
 
     bool setGlobalSetting();
     bool setWorkerProcesses();
+    bool setThreadPool();
     bool setErrorLog();
 
     bool setPid();
@@ -67,16 +78,22 @@ class Parser {
     bool setErrorPages(std::map<int, std::string> &);
 
     bool setWorkerConnections();
+    bool setEventMethod();
     bool setHttpContext();
     bool setHttpSetting();
     bool setHttpClientBodySize();
     bool setHttpUploadDirectory();
+    bool setTimeout(const std::string &setting, size_t &timeout);
+    bool setKeepaliveRequests();
+    bool setClientBodyBufferSize();
+    bool setLargeClientHeaderBuffers();
 
     bool setIndex();
 
     bool setServerContext();
     bool setServerSetting();
     bool setListen();
+    void setListenParameter(const std::string &param);
     bool setServerRedirect();
     int retrievePort(std::string);
     bool isValidIPAddress(const std::string &ip);
@@ -94,6 +111,7 @@ class Parser {
     bool setLimitExcept(std::string &);
     bool setLocationClientBodySize(std::string &);
     bool setLocationUploadDirectory(std::string &);
+    bool setLocationFlag(const std::string &setting, bool &flag);
 
    private:
     std::vector<std::string>           tokens;
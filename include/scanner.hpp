@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+
+/**
+ * @brief Byte scanners of the request parser, vectorized when the CPU allows it
+ *
+ * Each scan returns a pointer to the first byte of [begin, end) matching the condition, or end if
+ * there is none. The implementation is picked once from CPUID: AVX2 looks at 32 bytes per step,
+ * SSE2 at 16, and the scalar loops handle the tail of the range and other architectures.
+ */
+class Scanner {
+   public:
+    enum Level {
+        SCALAR, /**< One byte at a time */
+        SSE2,   /**< 16 bytes at a time */
+        AVX2    /**< 32 bytes at a time */
+    };
+
+    explicit Scanner(Level level);
+
+    // First LF
+    const char *lineEnd(const char *begin, const char *end) const;
+
+    // First byte that is not a token character (RFC 9110 tchar), ends a method or a field name
+    const char *tokenEnd(const char *begin, const char *end) const;
+
+    // First SP, control character or DEL, ends a request-target
+    const char *targetEnd(const char *begin, const char *end) const;
+
+    Level       level() const;
+    void        setLevel(Level level); // capped to what the CPU supports
+    const char *name() const;
+
+    static Level    detect(); // best level supported by the CPU
+    static Scanner &instance();
+
+   private:
+    typedef const char *(*Scan)(const char *begin, const char *end);
+
+    Level level_;      // implementation in use
+    Scan  line_end_;   // lineEnd() of level_
+    Scan  token_end_;  // tokenEnd() of level_
+    Scan  target_end_; // targetEnd() of level_
+};
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <deque>
 #include <map>
 #include <string>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <dirent.h>
 #include <limits>
 #include <cstdio>
@@ -12,17 +15,76 @@
 #include "http.hpp"
 #include "events.hpp"
 #include "socket.hpp"
+#include "thread_pool.hpp"
+
+#define ACCEPT_BUDGET     64    /**< Connections accepted per readiness event of a listening socket */
+#define ACCEPT_RETRY_MS   500   /**< Accept pause after running out of descriptors or memory */
+#define PIPELINE_MAX      32    /**< Pipelined requests of a session handled ahead of their responses */
+#define LINGERING_TIME    30000 /**< Longest drain of the unread input of a rejected request */
+#define LINGERING_TIMEOUT 5000  /**< Longest wait for more of that input before closing */
 
 class Socket;
 class Session;
+class RequestTask;
 Socket *tcp_socket_generator();
 
+/** Per file descriptor slot of the server tables */
+struct FdSlot {
+    FdSlot()
+        : socket(NULL), session(NULL), closed_batch(0), generation(0), requests(0),
+          keep_alive(false), idle(false), closing(false), paused(false), linger(false),
+          linger_until(0), parser(), pending() {}
+
+    Socket       *socket;       /**< Listening socket bound to the fd, if any */
+    Session      *session;      /**< Client session bound to the fd, if any */
+    unsigned long closed_batch; /**< Event batch the session was last closed in */
+    unsigned long generation;   /**< Bumped for every session accepted on the fd */
+    size_t        requests;     /**< Requests received on the session */
+    bool          keep_alive;   /**< Keep the session open once the current response is sent */
+    bool          idle;         /**< Waiting for the next request on a persistent connection */
+    bool          closing;      /**< A request asked to close, pipelined ones after it are dropped */
+    bool          paused;       /**< Not reading while the pipeline is full */
+    bool          linger;       /**< Input was left unread, drain it before closing */
+    unsigned long linger_until; /**< Lingering close in progress until then, 0 otherwise */
+    HttpParser    parser;       /**< Parser of the request being received */
+    std::deque<RequestTask *> pending; /**< Responses waiting for an earlier one, in request order */
+};
+
+class HttpServer;
+
+/**
+ * @brief Request handled on a pool thread, its response is queued on the session once it completes
+ *
+ * Also holds the response of a request handled inline while earlier pipelined requests of the
+ * session are still running, so responses go out in request order.
+ *
+ * Requests run concurrently on the pool threads, a handler may not check the filesystem and act
+ * on the result later, another thread can change it in between. Uploads take their names with
+ * UploadFile::commit(), which fails instead of replacing a file.
+ */
+class RequestTask : public ThreadTask {
+   public:
+    RequestTask(HttpServer *server, int session_id, unsigned long generation,
+                const HttpRequest &request, bool keep_alive);
+
+    void run();
+
+    HttpServer   *server_;     /**< Server handling the request */
+    int           session_id_; /**< Session the request came from */
+    unsigned long generation_; /**< Generation of the session slot, detects a reused fd */
+    HttpRequest   request_;    /**< Request to handle */
+    HttpResponse  response_;   /**< Response, filled by run() */
+    bool          keep_alive_; /**< Keep the session open after the response */
+    bool          done_;       /**< response_ is ready, set on the event loop thread */
+};
+
 // HTTP server
 class HttpServer {
    public:
     typedef Socket *(*SocketGenerator)(void);
 
-    HttpServer(HttpConfig config, SocketGenerator socket_generator = tcp_socket_generator);
+    HttpServer(HttpConfig config, EventListener *listener = NULL,
+               SocketGenerator socket_generator = tcp_socket_generator);
     ~HttpServer();
 
    private:
@@ -42,18 +104,40 @@ class HttpServer {
     bool signalHandler(int signal);
     void connectHandler(int socket_id);
     void disconnectHandler(int session_id);
+    void timeoutHandler();
+    void completionHandler();
+    void pauseAccepting();
+    void resumeAccepting();
+    void throttleAccepting(int socket_id, unsigned long now);
+    void processRequests(int session_id);
+    void flushPending(int session_id);
+    void queueInOrder(int session_id, const HttpRequest &request, HttpResponse &response,
+                      bool keep_alive);
+    void rejectRequest(int session_id, HttpStatus status);
+    void startLingering(int session_id);
+    void drainLingering(int session_id);
+    void queueResponse(int session_id, HttpResponse &response, bool keep_alive);
+    bool needsEventLoop(HttpRequest &request);
+    HttpStatus prepareBody(int session_id);
+    FdSlot  &slot(int fd);
+    Session *findSession(int fd);
 
-    std::pair<std::string, ssize_t> receiveRequestChunk(int session_id);
-    HttpResponse                    handleRequest(HttpRequest request);
+    void handleRequest(HttpRequest &request, HttpResponse &response);
     bool buildResponse(HttpRequest &, HttpResponse &, ServerConfig &);
     bool getMethod(HttpRequest &, HttpResponse &, ServerConfig &, LocationConfig *);
     bool postMethod(HttpRequest &, HttpResponse &, ServerConfig &, LocationConfig *);
+    bool saveUpload(HttpRequest &, HttpResponse &, ServerConfig &, LocationConfig *);
+    bool saveForm(HttpRequest &, HttpResponse &, ServerConfig &, LocationConfig *);
     bool deleteMethod(HttpRequest &, HttpResponse &, ServerConfig &, LocationConfig *);
     bool readFileToBody(HttpResponse &, std::string &, LocationConfig *);
     bool buildErrorPage(HttpRequest &, HttpResponse &, ServerConfig &, LocationConfig *, HttpStatus);
     bool buildBadRequestBody(HttpResponse &);
     bool isRedirect(HttpRequest &, HttpResponse &, std::pair<int, std::string> &);
     bool validateHost(HttpRequest &, HttpResponse &);
+    ServerConfig   *findServer(HttpRequest &);
+    LocationConfig *findLocation(const std::string &uri, ServerConfig &);
+    LocationConfig *routeLocation(HttpRequest &, HttpResponse &, ServerConfig &);
+    size_t maxBodySize(ServerConfig *, LocationConfig *);
     bool validateRequestBody(HttpRequest &, ServerConfig &, LocationConfig *);
     bool checkUriForExtension(std::string &uri, LocationConfig *location) const;
     void handleForbidden(HttpResponse &response, LocationConfig *location, ServerConfig &server);
@@ -68,15 +152,23 @@ class HttpServer {
     std::string getUploadDirectory(ServerConfig &server, LocationConfig *location);
     bool deleteFile(ServerConfig &server, LocationConfig *location, const std::string &filename);
     void uploadsFileList(ServerConfig &server, LocationConfig *location, std::stringstream &fileList);
-    std::string generateUniqueFileName(ServerConfig &server, LocationConfig *location, std::string &originalFileName);
     bool displayFile(HttpRequest& request, HttpResponse& response, ServerConfig &server, LocationConfig *location);
 
     std::string trimHost(const std::string &uri, ServerConfig &server);
 
    private:
+    friend class RequestTask;
+
     SocketGenerator          socket_generator_; /**< Function ptr to socket generator */
-    std::map<int, Socket *>  server_sockets_;   /**< Map of server IDs to sockets */
-    std::map<int, Session *> sessions_;         /**< Map of session IDs to sessions */
-    KqueueEventListener      listener_;         /**< Event listener for the server */
+    std::vector<FdSlot>      fds_;              /**< Sockets and sessions, indexed by fd */
+    std::vector<int>         listen_fds_;       /**< Listening sockets */
+    size_t                   connections_;      /**< Open sessions, capped by worker_connections */
+    bool                     accepting_;        /**< Listening sockets are registered */
+    bool                     accept_throttled_; /**< accept() ran out of resources, logged once */
+    unsigned long            batch_;            /**< Number of the current event batch */
+    EventListener           *listener_;         /**< Event listener for the server */
+    bool                     owns_listener_;    /**< Listener was generated by the server */
+    TimerWheel               timers_;           /**< Session deadlines and accept retries, keyed by fd */
     HttpConfig               config_;           /**< Configuration for the server */
+    ThreadPool              *pool_;             /**< File I/O threads, NULL to stay in the loop */
 };
@@ -2,43 +2,74 @@
 
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <unistd.h>
 #include <netdb.h>
 
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <deque>
 #include <string>
 #include <vector>
 
+#include "buffer.hpp"
+#include "events.hpp"
 #include "logging.hpp"
 
-#define SO_MAX_QUEUE     25
-#define READ_BUFFER_SIZE 4096
+#define SO_MAX_QUEUE          511
+#define READ_BUFFER_SIZE      4096
+#define SEND_FILE_BUFFER_SIZE 65536 /**< Read size where sendfile(2) is not available */
+
+// Not every platform has it, SIGPIPE is ignored by the server anyway
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
 // Session abstract base class
 class Session {
    public:
-    Session(int sockfd, const struct sockaddr* addr, socklen_t addrlen);
+    Session(int sockfd, const struct sockaddr* addr, socklen_t addrlen); /**< addr is copied */
     virtual ~Session() = 0;
 
-    virtual bool                            send()                 = 0;
-    virtual std::pair<std::string, ssize_t> recv(int client) const = 0;
-    int                                     getSockFd() const;
-    const struct sockaddr*                  getSockaddr() const;
-    void                                    addSendQueue(const std::string& buffer);
-    std::string                            &getRawRequest(void);
-    void                                    appendToRawRequest(std::string &newChunk);
+    /**
+     * @brief Send as much of the send queue as the socket takes
+     *
+     * @return true once nothing is left to send, the queue is dropped on a socket error
+     */
+    virtual bool           send() = 0;
+    /**
+     * @brief Receive up to READ_BUFFER_SIZE bytes straight into the receive buffer
+     *
+     * @return Bytes received, 0 once the peer closed, -1 on error or if nothing is pending
+     */
+    virtual ssize_t        recv() = 0;
+    int                    getSockFd() const;
+    const struct sockaddr* getSockaddr() const;
+    void                   addSendQueue(std::string& buffer); /**< Takes the content of buffer */
+    void                   addSendQueue(const SendSegment& segment);
+    size_t                 sendQueueSize() const; /**< Bytes waiting to be sent */
+    virtual void           setNoDelay(bool on);   /**< tcp_nodelay for the next responses */
+    virtual void           setNoPush(bool on);    /**< tcp_nopush for the next responses */
+    RecvBuffer&            getRecvBuffer();
+    void                   setAsyncIo(AsyncIo* io); /**< Let the event backend make the calls */
 
    protected:
-    std::string             rawRequest_;
+    AsyncIo*                io_;          /**< Makes the socket calls, NULL to make them here */
+    RecvBuffer              recv_buffer_; /**< Received bytes not parsed yet */
     int                     sockfd_;     /**< Session socket file descriptor */
-    const struct sockaddr*  addr_;       /**< Session socket address */
+    struct sockaddr_storage addr_;       /**< Session socket address */
     socklen_t               addrlen_;    /**< Session socket address length */
-    std::deque<std::string> send_queue_; /**< Queue of messages to send */
+    SendQueue               send_queue_; /**< Queue of messages to send */
 };
 
 // TcpSession class
@@ -46,13 +77,45 @@ class TcpSession : public Session {
    public:
     TcpSession(int sockfd, const struct sockaddr* addr, socklen_t addrlen);
 
-    bool                            send();
-    std::pair<std::string, ssize_t> recv(int client) const;
+    // Sessions come from a slab pool, accepting a connection does not go through malloc
+    static void* operator new(size_t size);
+    static void  operator delete(void* session, size_t size);
+    static void  reserve(size_t sessions); /**< Preallocate room for that many sessions */
+
+    bool    send();
+    ssize_t recv();
+    void    setNoDelay(bool on);
+    void    setNoPush(bool on);
+
+   private:
+    // Send the rest of a file segment, wanted is set to the number of bytes attempted
+    ssize_t sendFile(const SendSegment& segment, size_t sent, size_t& wanted);
+    void    setCork(bool on);
+
+    static SlabPool& pool();
+
+    bool nodelay_; /**< TCP_NODELAY is set on the socket */
+    bool nopush_;  /**< Cork the socket while a response is sent */
+    bool corked_;  /**< TCP_CORK is set on the socket */
 };
 
 // TcpSession generator function
 Session* tcp_session_generator(int sockfd, const struct sockaddr* addr, socklen_t addrlen);
 
+/** Options applied to a listening socket before it is bound */
+struct SocketOptions {
+    SocketOptions()
+        : reuseport(false), backlog(SO_MAX_QUEUE), defer_accept(0), fastopen(0), rcvbuf(0),
+          sndbuf(0) {}
+
+    bool reuseport;    /**< SO_REUSEPORT, lets every worker bind its own socket to the address */
+    int  backlog;      /**< Connections the kernel queues until they are accepted */
+    int  defer_accept; /**< Seconds TCP_DEFER_ACCEPT waits for the request, 0 disables it */
+    int  fastopen;     /**< TCP_FASTOPEN queue length, 0 disables it */
+    int  rcvbuf;       /**< SO_RCVBUF, inherited by the sessions, 0 keeps the default */
+    int  sndbuf;       /**< SO_SNDBUF, inherited by the sessions, 0 keeps the default */
+};
+
 // Socket abstract base class
 class Socket {
    public:
@@ -62,14 +125,17 @@ class Socket {
     Socket(SessionGenerator session_generator);
     virtual ~Socket() = 0;
 
-    virtual int      bind(std::string addr, int port) = 0;
+    virtual int      bind(std::string addr, int port) = 0; /**< Throws if it cannot be bound */
     virtual void     listen()                         = 0;
-    virtual Session* accept()                         = 0;
+    virtual Session* accept()                         = 0; /**< NULL with errno set once none is pending */
     virtual void     close()                          = 0;
-    // virtual void setsockopt() = 0;
+    void             setOptions(const SocketOptions& options);
+    void             setAsyncIo(AsyncIo* io); /**< Accept through the event backend, after listen() */
 
    protected:
+    AsyncIo*           io_;                /**< Accepts connections, NULL to accept here */
     int                sockfd_;            /**< Server socket file descriptor */
+    SocketOptions      options_;           /**< Options applied in bind() */
     struct sockaddr_in addr_in_;           /**< Server address */
     SessionGenerator   session_generator_; /**< Session generator function */
 };
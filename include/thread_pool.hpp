@@ -0,0 +1,73 @@
+#pragma once
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <deque>
+#include <stdexcept>
+#include <vector>
+
+#include "logging.hpp"
+
+#define THREAD_POOL_THREADS   32    /**< Default number of pool threads */
+#define THREAD_POOL_MAX_QUEUE 65536 /**< Default number of tasks waiting for a thread */
+
+// Unit of work run on a pool thread and handed back to the event loop once done
+class ThreadTask {
+   public:
+    ThreadTask();
+    virtual ~ThreadTask();
+
+    virtual void run() = 0;
+
+   private:
+    friend class ThreadPool;
+
+    ThreadTask *next_; // next task in the completion queue
+};
+
+/**
+ * @brief Fixed set of threads running blocking work (file I/O) off the event loop
+ *
+ * Tasks are posted to a bounded queue guarded by a mutex. Finished tasks are pushed onto a
+ * lock-free completion stack, the first push after the loop emptied it writes a byte to a pipe
+ * so the loop wakes up on notifyFd() and collects the whole batch at once.
+ */
+class ThreadPool {
+   public:
+    ThreadPool(size_t threads, size_t max_queue);
+    ~ThreadPool();
+
+    /**
+     * @brief Queue a task for a pool thread
+     *
+     * @return false if the queue is full, the caller keeps ownership of the task
+     */
+    bool post(ThreadTask *task);
+
+    // Read end of the wakeup pipe, readable when completed tasks are waiting
+    int notifyFd() const;
+
+    /**
+     * @brief Take every completed task, in completion order
+     *
+     * @param completed [out] Completed tasks, the caller takes ownership
+     */
+    void collect(std::vector<ThreadTask *> &completed);
+
+   private:
+    static void *worker(void *pool);
+    void         complete(ThreadTask *task);
+    void         release();
+
+    pthread_mutex_t          mutex_;          // guards queue_ and stopping_
+    pthread_cond_t           cond_;           // signalled when a task is queued or on shutdown
+    std::deque<ThreadTask *> queue_;          // tasks waiting for a thread
+    size_t                   max_queue_;      // maximum size of queue_
+    bool                     stopping_;       // threads exit once set
+    std::vector<pthread_t>   threads_;        // running threads
+    ThreadTask              *completed_;      // completed tasks, newest first
+    int                      notify_pipe_[2]; // wakes the event loop on completions
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#define UPLOAD_TEMP_NAME     ".upload-XXXXXX" /**< mkstemp() template of uploads being received */
+#define UPLOAD_NAME_ATTEMPTS 1000             /**< Names tried by commit() before giving up */
+
+/**
+ * @brief File received into the upload directory under a temporary name
+ *
+ * The file only shows up under its real name once complete: commit() links it there, which is
+ * atomic within the directory, so nobody sees a half-written upload. Unlike rename(), link() never
+ * replaces a file, two uploads racing for one name on different threads cannot overwrite each
+ * other: the loser gets EEXIST and tries the next name. Copies share the file, the last one
+ * closes it and removes the temporary name if commit() never ran, an aborted upload leaves
+ * nothing behind.
+ */
+class UploadFile {
+   public:
+    UploadFile();
+    UploadFile(const UploadFile &other);
+    UploadFile &operator=(const UploadFile &other);
+    ~UploadFile();
+
+    /**
+     * @brief Create the temporary file in directory
+     *
+     * @param size Expected length, 0 if unknown. The disk space is reserved up front so a full
+     *             disk fails the upload before its body is received
+     */
+    bool open(const std::string &directory, size_t size);
+
+    bool   write(const char *data, size_t size); // append after the bytes written so far
+    bool   commit(const std::string &path);      // move the complete file to path, EEXIST if taken
+
+    /**
+     * @brief Move the complete file to name in directory, or to the first free one of name_2.ext,
+     *        name_3.ext... when taken
+     */
+    bool commit(const std::string &directory, const std::string &name);
+
+    const std::string &path() const; // temporary name, then the committed one
+    bool   isOpen() const;
+    int    fd() const;
+    size_t size() const; // bytes written
+
+   private:
+    struct File {
+        int         fd;        // descriptor, open until the last copy goes away
+        std::string path;      // temporary name, then the committed one
+        size_t      size;      // bytes written
+        bool        committed; // moved into place, keep it
+        int         refs;      // copies sharing the file, changed atomically
+    };
+
+    void drop();
+
+    File *file_; // shared file, NULL until open()
+};
@@ -0,0 +1,331 @@
+#include "../include/buffer.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+BufferPool::~BufferPool() {
+    for (std::vector<char *>::iterator it = free_.begin(); it != free_.end(); ++it) {
+        delete[] *it;
+    }
+}
+
+char *BufferPool::acquire() {
+    if (free_.empty()) {
+        return new char[BUFFER_CHUNK_SIZE];
+    }
+    char *chunk = free_.back();
+    free_.pop_back();
+    return chunk;
+}
+
+void BufferPool::release(char *chunk) {
+    if (free_.size() >= BUFFER_POOL_MAX) {
+        delete[] chunk;
+        return;
+    }
+    free_.push_back(chunk);
+}
+
+size_t BufferPool::available() const {
+    return free_.size();
+}
+
+BufferPool &BufferPool::instance() {
+    static BufferPool pool_instance;
+    return pool_instance;
+}
+
+SlabPool::SlabPool(size_t object_size, size_t slab_objects)
+    : object_size_(object_size),
+      slab_objects_(slab_objects ? slab_objects : 1),
+      capacity_(0),
+      available_(0),
+      free_(NULL) {
+    // Every object has to hold a free list link and stay aligned for any type
+    const size_t alignment = sizeof(long double);
+    object_size_           = std::max(object_size_, sizeof(FreeObject));
+    object_size_           = (object_size_ + alignment - 1) / alignment * alignment;
+}
+
+SlabPool::~SlabPool() {
+    for (std::vector<char *>::iterator it = slabs_.begin(); it != slabs_.end(); ++it) {
+        ::operator delete(*it);
+    }
+}
+
+void SlabPool::grow() {
+    char *slab = static_cast<char *>(::operator new(object_size_ * slab_objects_));
+    slabs_.push_back(slab);
+    for (size_t i = slab_objects_; i > 0; --i) {
+        deallocate(slab + (i - 1) * object_size_);
+    }
+    capacity_ += slab_objects_;
+}
+
+void *SlabPool::allocate() {
+    if (!free_) {
+        grow();
+    }
+    FreeObject *object = free_;
+    free_              = object->next;
+    --available_;
+    return object;
+}
+
+void SlabPool::deallocate(void *object) {
+    FreeObject *link = static_cast<FreeObject *>(object);
+    link->next       = free_;
+    free_            = link;
+    ++available_;
+}
+
+void SlabPool::reserve(size_t objects) {
+    while (capacity_ < objects) {
+        grow();
+    }
+}
+
+size_t SlabPool::objectSize() const {
+    return object_size_;
+}
+
+size_t SlabPool::available() const {
+    return available_;
+}
+
+RecvBuffer::RecvBuffer() : block_(NULL), capacity_(0), start_(0), end_(0) {}
+
+RecvBuffer::~RecvBuffer() {
+    clear();
+    release();
+}
+
+char *RecvBuffer::reserve(size_t min_size) {
+    if (!block_) {
+        block_    = BufferPool::instance().acquire();
+        capacity_ = BUFFER_CHUNK_SIZE;
+    }
+    if (capacity_ - end_ >= min_size) {
+        return block_ + end_;
+    }
+
+    // Reclaim the consumed bytes first, grow only if that is not enough
+    size_t used = end_ - start_;
+    if (capacity_ - used >= min_size) {
+        memmove(block_, block_ + start_, used);
+    } else {
+        size_t capacity = capacity_;
+        while (capacity - used < min_size) {
+            capacity *= 2;
+        }
+        char *block = new char[capacity];
+        memcpy(block, block_ + start_, used);
+        clear();
+        release();
+        block_    = block;
+        capacity_ = capacity;
+    }
+    start_ = 0;
+    end_   = used;
+    return block_ + end_;
+}
+
+size_t RecvBuffer::writable() const {
+    return capacity_ - end_;
+}
+
+void RecvBuffer::commit(size_t size) {
+    end_ += std::min(size, writable());
+}
+
+const char *RecvBuffer::data() const {
+    return block_ + start_;
+}
+
+size_t RecvBuffer::size() const {
+    return end_ - start_;
+}
+
+bool RecvBuffer::empty() const {
+    return start_ == end_;
+}
+
+void RecvBuffer::consume(size_t size) {
+    start_ += std::min(size, this->size());
+    if (start_ == end_) {
+        start_ = end_ = 0;
+    }
+}
+
+void RecvBuffer::clear() {
+    start_ = end_ = 0;
+}
+
+ssize_t RecvBuffer::find(const char *needle, size_t length, size_t from) const {
+    if (from >= size()) {
+        return -1;
+    }
+    const char *begin = data() + from;
+    const char *end   = data() + size();
+    const char *found = std::search(begin, end, needle, needle + length);
+    return found == end ? -1 : found - data();
+}
+
+void RecvBuffer::release() {
+    if (!block_ || !empty()) {
+        return;
+    }
+    if (capacity_ == BUFFER_CHUNK_SIZE) {
+        BufferPool::instance().release(block_);
+    } else {
+        delete[] block_;
+    }
+    block_    = NULL;
+    capacity_ = 0;
+}
+
+SendSegment::SendSegment() : block_(NULL) {}
+
+SendSegment::SendSegment(std::string &data) : block_(new Block) {
+    block_->data.swap(data);
+    block_->fd     = -1;
+    block_->offset = 0;
+    block_->size   = block_->data.size();
+    block_->refs   = 1;
+}
+
+SendSegment::SendSegment(int fd, off_t offset, size_t size) : block_(new Block) {
+    block_->fd     = fd;
+    block_->offset = offset;
+    block_->size   = size;
+    block_->refs   = 1;
+}
+
+SendSegment::SendSegment(const SendSegment &other) : block_(other.block_) {
+    if (block_) {
+        __sync_add_and_fetch(&block_->refs, 1);
+    }
+}
+
+SendSegment &SendSegment::operator=(const SendSegment &other) {
+    if (block_ != other.block_) {
+        drop();
+        block_ = other.block_;
+        if (block_) {
+            __sync_add_and_fetch(&block_->refs, 1);
+        }
+    }
+    return *this;
+}
+
+SendSegment::~SendSegment() {
+    drop();
+}
+
+// A request body is copied to a pool thread while the event loop drops its own copy
+void SendSegment::drop() {
+    if (block_ && __sync_sub_and_fetch(&block_->refs, 1) == 0) {
+        if (block_->fd != -1) {
+            close(block_->fd);
+        }
+        delete block_;
+    }
+    block_ = NULL;
+}
+
+const char *SendSegment::data() const {
+    return block_ && block_->fd == -1 ? block_->data.data() : NULL;
+}
+
+size_t SendSegment::size() const {
+    return block_ ? block_->size : 0;
+}
+
+bool SendSegment::isFile() const {
+    return block_ && block_->fd != -1;
+}
+
+int SendSegment::fd() const {
+    return block_ ? block_->fd : -1;
+}
+
+off_t SendSegment::offset() const {
+    return block_ ? block_->offset : 0;
+}
+
+void SendSegment::extend(size_t size) {
+    if (isFile()) {
+        block_->size += size;
+    }
+}
+
+SendQueue::SendQueue() : offset_(0), size_(0) {}
+
+void SendQueue::push(const SendSegment &segment) {
+    if (segment.size() == 0) {
+        return;
+    }
+    segments_.push_back(segment);
+    size_ += segment.size();
+}
+
+bool SendQueue::empty() const {
+    return segments_.empty();
+}
+
+size_t SendQueue::size() const {
+    return size_;
+}
+
+const SendSegment &SendQueue::front() const {
+    return segments_.front();
+}
+
+size_t SendQueue::sent() const {
+    return offset_;
+}
+
+size_t SendQueue::gather(struct iovec *iov, int max, int &count) const {
+    size_t total = 0;
+    size_t skip  = offset_;
+    count        = 0;
+    for (std::deque<SendSegment>::const_iterator it = segments_.begin();
+         it != segments_.end() && count < max && !it->isFile(); ++it) {
+        iov[count].iov_base = const_cast<char *>(it->data() + skip);
+        iov[count].iov_len  = it->size() - skip;
+        total += iov[count].iov_len;
+        skip = 0;
+        ++count;
+    }
+    return total;
+}
+
+void SendQueue::share(std::vector<SendSegment> &segments, int count) const {
+    std::deque<SendSegment>::const_iterator it = segments_.begin();
+    for (; it != segments_.end() && count > 0; ++it, --count) {
+        segments.push_back(*it);
+    }
+}
+
+void SendQueue::consume(size_t size) {
+    size = std::min(size, size_);
+    size_ -= size;
+    while (size > 0) {
+        size_t left = segments_.front().size() - offset_;
+        if (size < left) {
+            offset_ += size;
+            return;
+        }
+        size -= left;
+        segments_.pop_front();
+        offset_ = 0;
+    }
+}
+
+void SendQueue::clear() {
+    segments_.clear();
+    offset_ = 0;
+    size_   = 0;
+}
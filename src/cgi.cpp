@@ -89,16 +89,15 @@ void Cgi::setEnv() { // A lot of stuff happens here. The beginning of great thin
 
 	std::string uri = request_.uri_;
 	std::string var;
-	if (request_.body_.size() > 0) {
+	if (request_.bodySize() > 0) {
 		var.append("CONTENT_LENGTH=");
-		var.append(std::to_string(request_.body_.size()));
+		var.append(std::to_string(request_.bodySize()));
 		meta_variables_.push_back(var);
 		var.clear();
 	}
-	std::map<std::string, std::string>::iterator it = request_.headers_.find("Content-Type");
-	if (it != request_.headers_.end()) {
+	if (request_.headers_.has(HEADER_CONTENT_TYPE)) {
 		var.append("CONTENT_TYPE=");
-		var.append(it->second);
+		var.append(request_.headers_.get(HEADER_CONTENT_TYPE));
 		meta_variables_.push_back(var);
 		var.clear();
 	}
@@ -121,22 +120,7 @@ void Cgi::setEnv() { // A lot of stuff happens here. The beginning of great thin
 	meta_variables_.push_back(var);
 	var.clear();
 	var.append("REQUEST_METHOD=");
-	switch(request_.method_) {
-		case 0:
-			var.append("UNKNOWN");
-			break;
-		case 1:
-			var.append("GET");
-			break;
-		case 2:
-			var.append("POST");
-			break;
-		case 3:
-			var.append("DELETE");
-			break;
-		default:
-			throw InternalServerError();
-	}
+	var.append(HttpRequest::methodName(request_.method_));
 	meta_variables_.push_back(var);
 	var.clear();
 	var.append("SCRIPT_NAME=");
@@ -249,8 +233,8 @@ bool Cgi::performCgiGet() {
 			throw InternalServerError();
 		}
 		else {
-			if (response_->headers_.find("Status") == response_->headers_.end()) {
-				response_->headers_["Status"] = std::to_string(OK);
+			if (!response_->headers_.has("Status")) {
+				response_->headers_.set("Status", std::to_string(OK));
 			}
 		}
 	}
@@ -312,8 +296,14 @@ bool Cgi::performCgiPost() {
 			exit(-1);
 		}
 		close(fdIn[1]);
-		dup2(fdIn[0], STDIN_FILENO);
-		close(fdIn[1]);
+		// A spooled body is read by the script straight from its file
+		if (request_.body_file_.isFile()) {
+			lseek(request_.body_file_.fd(), 0, SEEK_SET);
+			dup2(request_.body_file_.fd(), STDIN_FILENO);
+		} else {
+			dup2(fdIn[0], STDIN_FILENO);
+		}
+		close(fdIn[0]);
 
 		close(fdOut[0]);
 		dup2(fdOut[1], STDOUT_FILENO);
@@ -352,8 +342,8 @@ bool Cgi::performCgiPost() {
 			throw InternalServerError();
 		}
 		else {
-			if (response_->headers_.find("Status") == response_->headers_.end()) {
-				response_->headers_["Status"] = std::to_string(OK);
+			if (!response_->headers_.has("Status")) {
+				response_->headers_.set("Status", std::to_string(OK));
 			}
 		}
 	}
@@ -394,7 +384,7 @@ void Cgi::extractHeaders(std::string scriptOutput) {
 			}
 		}
 		for (std::size_t i = 0; i < headers.size(); ++i) {
-			response_->headers_[headers[i].first] = headers[i].second;
+			response_->headers_.set(headers[i].first, headers[i].second);
 		}
 	}
 }
@@ -415,7 +405,7 @@ void Cgi::extractBody(std::string scriptOutput) {
 }
 
 void Cgi::handleError(exceptionType type) {
-	response_->headers_["Content-Type"] = "text/html";
+	response_->headers_.set(HEADER_CONTENT_TYPE, "text/html");
 	std::string root;
 
 	if (location_.root.size()) {
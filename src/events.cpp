@@ -1,16 +1,1023 @@
 #include "../include/events.hpp"
 
-KqueueEventListener::KqueueEventListener() {
+#include <algorithm>
+#include <cerrno>
+
+EventListener::~EventListener() {}
+
+bool EventListener::registerEvents(const std::vector<int> &fds, InternalEvent events) {
+    bool registered = true;
+    for (std::vector<int>::const_iterator it = fds.begin(); it != fds.end(); ++it) {
+        registered = registerEvent(*it, events) && registered;
+    }
+    return registered;
+}
+
+AsyncIo *EventListener::asyncIo() {
+    return NULL;
+}
+
+AsyncIo::~AsyncIo() {}
+
+EventListener* event_listener_generator(const std::string &method, size_t max_fds) {
+#ifdef USE_IO_URING
+    if (method == "io_uring") {
+        return io_uring_listener_generator(max_fds);
+    }
+#endif
+#ifdef USE_EPOLL
+    if (method == "kqueue") {
+        Logger::instance().log("kqueue is not available in this build, using epoll");
+    }
+#else
+    if (method == "epoll" || method == "io_uring") {
+        Logger::instance().log(method + " is not available in this build, using kqueue");
+    }
+#endif
+    return new DefaultEventListener(max_fds);
+}
+
+// Entry of an fd-indexed table, the table doubles when fd is past its end
+template <typename T>
+static T &fdEntry(std::vector<T> &table, int fd) {
+    if (static_cast<size_t>(fd) >= table.size()) {
+        table.resize(std::max(static_cast<size_t>(fd) + 1, table.size() * 2));
+    }
+    return table[fd];
+}
+
+// Whether fd indexes an existing entry of an fd-indexed table
+template <typename T>
+static bool hasEntry(const std::vector<T> &table, int fd) {
+    return fd >= 0 && static_cast<size_t>(fd) < table.size();
+}
+
+#ifdef USE_EPOLL
+
+// Block a signal and add it to the mask of signal_fd, creating it if it is -1
+static int addSignal(int signal_fd, sigset_t &signal_mask, int signal) {
+    // Signals have to be blocked to be read from a signalfd
+    sigaddset(&signal_mask, signal);
+    if (sigprocmask(SIG_BLOCK, &signal_mask, NULL) == -1) {
+        Logger::instance().log("Error: Failed to block signal");
+        return -1;
+    }
+
+    // Passing an existing signalfd updates its mask
+    int fd = signalfd(signal_fd, &signal_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd == -1) {
+        Logger::instance().log("Error: Failed to create signalfd");
+    }
+    return fd;
+}
+
+// Read every pending signal, signals are reported by signal number
+static void readSignals(int signal_fd, std::vector<Event> &events) {
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        events.push_back(
+            std::make_pair(static_cast<int>(info.ssi_signo), static_cast<InternalEvent>(SIGNAL_EVENT)));
+    }
+}
+
+EpollEventListener::EpollEventListener(size_t max_fds) : signal_fd_(-1), events_(max_fds, 0) {
+    sigemptyset(&signal_mask_);
+
+    // Create a new epoll instance
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+
+    // Check if epoll was created successfully
+    if (epoll_fd_ == -1) {
+        throw std::runtime_error("Failed to create epoll");
+    }
+}
+
+EpollEventListener::~EpollEventListener() {
+    if (signal_fd_ != -1) {
+        close(signal_fd_);
+    }
+    close(epoll_fd_);
+}
+
+int EpollEventListener::listen(std::vector<Event> &events, int timeout_ms) {
+    events.clear();
+
+    // Wait for events on the epoll instance.
+    int ret = epoll_wait(epoll_fd_, eventlist_, MAX_EVENTS, timeout_ms);
+
+    // Check if events were received successfully
+    if (ret == -1) {
+        Logger::instance().log("Error: Failed to receive event from epoll");
+        return -1;
+    }
+
+    for (int i = 0; i < ret; ++i) {
+        struct epoll_event &event = eventlist_[i];
+
+        // Signals are read from the signalfd and reported by signal number
+        if (event.data.fd == signal_fd_) {
+            readSignals(signal_fd_, events);
+            continue;
+        }
+
+        // Handle conversion from epoll events to internal events, one entry per event type
+        int fd = event.data.fd;
+        if (event.events & EPOLLIN) {
+            events.push_back(std::make_pair(fd, static_cast<InternalEvent>(READABLE)));
+        } else if (event.events & (EPOLLERR | EPOLLHUP)) {
+            events.push_back(std::make_pair(fd, static_cast<InternalEvent>(ERROR_EVENT)));
+            continue;
+        }
+        if (event.events & EPOLLOUT) {
+            events.push_back(std::make_pair(fd, static_cast<InternalEvent>(WRITABLE)));
+        }
+    }
+    return events.size();
+}
+
+bool EpollEventListener::registerEvent(int fd, InternalEvent events) {
+    if (events == 0) {
+        Logger::instance().log("Error: No events specified during registerEvent()");
+        return false;
+    }
+    if (events & SIGNAL_EVENT) {
+        int signal_fd = addSignal(signal_fd_, signal_mask_, fd);
+        if (signal_fd == -1 || signal_fd_ != -1) {
+            return signal_fd != -1;
+        }
+        signal_fd_ = signal_fd;
+        fd         = signal_fd_;
+        events     = READABLE;
+    }
+
+    // Handle conversion from internal events to epoll events
+    uint32_t mask = 0;
+    if (events & READABLE) mask |= EPOLLIN;
+    if (events & WRITABLE) mask |= EPOLLOUT;
+
+    // Merge with the events already registered for this fd
+    int       op         = EPOLL_CTL_ADD;
+    uint32_t &registered = fdEntry(events_, fd);
+    if (registered != 0) {
+        op = EPOLL_CTL_MOD;
+        mask |= registered;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events  = mask;
+    event.data.fd = fd;
+
+    // Add event to the epoll instance.
+    if (epoll_ctl(epoll_fd_, op, fd, &event) == -1) {
+        Logger::instance().log("Error: Failed to add event to epoll");
+        return false;
+    }
+
+    // Add event to the table of events.
+    registered = mask;
+
+    return true;
+}
+
+void EpollEventListener::unregisterEvent(int fd, InternalEvent events) {
+    // Check if event exists.
+    if (!hasEntry(events_, fd) || events_[fd] == 0) {
+        Logger::instance().log("Error: Event does not exist during unregisterEvent()");
+        return;
+    }
+
+    uint32_t mask = events_[fd];
+    if (events & READABLE) mask &= ~EPOLLIN;
+    if (events & WRITABLE) mask &= ~EPOLLOUT;
+    if (mask == events_[fd]) {
+        return;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events  = mask;
+    event.data.fd = fd;
+
+    // Edit or delete event from the epoll instance.
+    if (epoll_ctl(epoll_fd_, mask ? EPOLL_CTL_MOD : EPOLL_CTL_DEL, fd, &event) == -1) {
+        Logger::instance().log("Error: Failed to remove event from epoll");
+    }
+    events_[fd] = mask;
+}
+
+void EpollEventListener::removeEvent(int fd) {
+    if (hasEntry(events_, fd)) {
+        events_[fd] = 0;
+    }
+}
+
+#ifdef USE_IO_URING
+
+// Kind of request a completion belongs to, kept in the low bits of its user_data
+#define IO_URING_IGNORE 0 /**< Removals and cancellations */
+#define IO_URING_POLL   1 /**< Poll, tagged with the poll generation and the fd */
+#define IO_URING_ACCEPT 2 /**< Multishot accept, tagged with the session generation and the fd */
+#define IO_URING_RECV   3 /**< Multishot recv, tagged like an accept */
+#define IO_URING_SEND   4 /**< Send or file read, the rest of user_data points to the SendOp */
+#define IO_URING_KIND   7 /**< Mask of the kind bits */
+
+#define IO_URING_BUFFER_GROUP 0 /**< Group id of the registered receive buffers */
+
+static uint64_t requestData(uint32_t generation, int fd, int kind) {
+    return (static_cast<uint64_t>(generation) << 32) | (static_cast<uint64_t>(fd) << 3) | kind;
+}
+
+EventListener *io_uring_listener_generator(size_t max_fds, unsigned entries) {
+    try {
+        return new IoUringEventListener(max_fds, entries);
+    } catch (std::exception &e) {
+        Logger::instance().log(std::string(e.what()) + ", falling back to epoll");
+    }
+    return new EpollEventListener(max_fds);
+}
+
+IoUringEventListener::IoUringEventListener(size_t max_fds, unsigned entries)
+    : ring_fd_(-1),
+      sq_ring_(MAP_FAILED),
+      cq_ring_(MAP_FAILED),
+      sq_ring_size_(0),
+      cq_ring_size_(0),
+      sqes_(static_cast<struct io_uring_sqe *>(MAP_FAILED)),
+      sq_entries_(0),
+      to_submit_(0),
+      buffer_ring_(NULL),
+      buffers_(NULL),
+      buffer_tail_(0),
+      multishot_(true),
+      draining_(false),
+      inflight_(0),
+      signal_fd_(-1),
+      polls_(max_fds) {
+    sigemptyset(&signal_mask_);
+
+    // Create a new io_uring instance
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd_ == -1) {
+        throw std::runtime_error("Failed to create io_uring");
+    }
+
+    // Timed waits are passed to io_uring_enter directly
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        close(ring_fd_);
+        throw std::runtime_error("io_uring does not support timed waits");
+    }
+
+    // Map the submission and completion rings, a single mapping when the kernel allows it
+    sq_entries_   = params.sq_entries;
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        cq_ring_size_ = 0;
+    }
+    sq_ring_ = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ != MAP_FAILED && cq_ring_size_ == 0) {
+        cq_ring_ = sq_ring_;
+    } else if (sq_ring_ != MAP_FAILED) {
+        cq_ring_ = mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd_, IORING_OFF_CQ_RING);
+    }
+    if (cq_ring_ != MAP_FAILED) {
+        sqes_ = static_cast<struct io_uring_sqe *>(
+            mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+    }
+    if (sqes_ == MAP_FAILED) {
+        release();
+        throw std::runtime_error("Failed to map io_uring");
+    }
+
+    char *sq = static_cast<char *>(sq_ring_);
+    char *cq = static_cast<char *>(cq_ring_);
+    sq_head_  = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail_  = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask_  = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    cq_head_  = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail_  = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask_  = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_     = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    registerBuffers();
+}
+
+IoUringEventListener::~IoUringEventListener() {
+    drain();
+    release();
+}
+
+void IoUringEventListener::release() {
+    if (sqes_ != MAP_FAILED) {
+        munmap(sqes_, sq_entries_ * sizeof(struct io_uring_sqe));
+    }
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+        munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != MAP_FAILED) {
+        munmap(sq_ring_, sq_ring_size_);
+    }
+    if (signal_fd_ != -1) {
+        close(signal_fd_);
+    }
+    close(ring_fd_);
+    sqes_    = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+    sq_ring_ = MAP_FAILED;
+    cq_ring_ = MAP_FAILED;
+
+    // The ring is gone, the kernel no longer writes to the receive buffers
+    if (buffer_ring_) {
+        munmap(buffer_ring_, IO_URING_BUFFERS * sizeof(struct io_uring_buf));
+        delete[] buffers_;
+        buffer_ring_ = NULL;
+        buffers_     = NULL;
+    }
+}
+
+void IoUringEventListener::registerBuffers() {
+    // The ring has to be page aligned, an anonymous mapping is
+    void *ring = mmap(NULL, IO_URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        Logger::instance().log("Error: Failed to map the io_uring buffer ring");
+        return;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = reinterpret_cast<uintptr_t>(ring);
+    reg.ring_entries = IO_URING_BUFFERS;
+    reg.bgid         = IO_URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        Logger::instance().log("io_uring cannot register receive buffers, sockets wait for readiness");
+        munmap(ring, IO_URING_BUFFERS * sizeof(struct io_uring_buf));
+        return;
+    }
+
+    buffer_ring_ = static_cast<struct io_uring_buf_ring *>(ring);
+    buffers_     = new char[IO_URING_BUFFERS * IO_URING_BUFFER_SIZE];
+    for (unsigned id = 0; id < IO_URING_BUFFERS; ++id) {
+        recycle(id);
+    }
+}
+
+void IoUringEventListener::drain() {
+    // Cancel everything in flight, the kernel may still write to the receive buffers and read
+    // from the send requests until their completion arrived
+    draining_ = true;
+    if (inflight_ > 0) {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe) {
+            sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+            sqe->user_data    = IO_URING_IGNORE;
+        }
+    }
+    std::vector<Event> events;
+    for (int i = 0; i < 100 && (inflight_ > 0 || to_submit_ > 0); ++i) {
+        enter(1, 10);
+        harvest(events);
+    }
+
+    // Sends never submitted, and the results nobody took
+    for (std::vector<SendOp *>::iterator it = deferred_.begin(); it != deferred_.end(); ++it) {
+        if ((*it)->orphaned) {
+            delete *it;
+        }
+    }
+    for (std::vector<FdState>::iterator it = polls_.begin(); it != polls_.end(); ++it) {
+        for (std::deque<Completion>::iterator completion = it->completed.begin();
+             completion != it->completed.end() && it->mode == ASYNC_ACCEPT; ++completion) {
+            close(completion->value);
+        }
+        delete it->send;
+    }
+}
+
+struct io_uring_sqe *IoUringEventListener::getSqe() {
+    // Flush queued entries when the submission ring is full
+    unsigned tail = *sq_tail_;
+    if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+        int ret;
+        do {
+            ret = enter(0, 0);
+        } while (ret == -1 && errno == EINTR);
+
+        // Nothing was consumed (EBUSY, EAGAIN), the entry would overwrite one not submitted yet
+        if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+            Logger::instance().log("Error: io_uring submission queue is full");
+            return NULL;
+        }
+    }
+
+    unsigned             index = tail & *sq_mask_;
+    struct io_uring_sqe *sqe   = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++to_submit_;
+    return sqe;
+}
+
+int IoUringEventListener::enter(unsigned int min_complete, int timeout_ms) {
+    unsigned int flags = IORING_ENTER_EXT_ARG;
+    if (min_complete > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+
+    // A null timespec blocks until min_complete entries completed
+    struct __kernel_timespec      ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout_ms >= 0) {
+        ts.tv_sec  = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        arg.ts     = reinterpret_cast<uintptr_t>(&ts);
+    }
+
+    int ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit_, min_complete, flags, &arg,
+                      sizeof(arg));
+    if (ret > 0) {
+        to_submit_ -= std::min(static_cast<unsigned>(ret), to_submit_);
+    }
+    return ret;
+}
+
+int IoUringEventListener::listen(std::vector<Event> &events, int timeout_ms) {
+    events.clear();
+
+    // Retry what did not fit in the submission ring last time
+    std::vector<uint64_t> cancels;
+    cancels.swap(cancels_);
+    for (std::vector<uint64_t>::iterator it = cancels.begin(); it != cancels.end(); ++it) {
+        cancel(*it);
+    }
+    std::vector<SendOp *> deferred;
+    deferred.swap(deferred_);
+    for (std::vector<SendOp *>::iterator it = deferred.begin(); it != deferred.end(); ++it) {
+        if ((*it)->orphaned) {
+            --inflight_;
+            delete *it;
+        } else {
+            submit(*it);
+        }
+    }
+
+    // Arm a request for every fd that changed or fired since the last call, the ones that do not
+    // fit in the submission ring stay dirty for the next call
+    std::vector<int> dirty;
+    dirty.swap(dirty_);
+    for (std::vector<int>::iterator it = dirty.begin(); it != dirty.end(); ++it) {
+        polls_[*it].dirty = false;
+        arm(*it);
+    }
+
+    // Keep the fds whose results were not all taken yet, they are reported again without waiting
+    size_t kept = 0;
+    for (size_t i = 0; i < ready_.size(); ++i) {
+        FdState &state = polls_[ready_[i]];
+        state.ready    = pending(state);
+        if (state.ready) {
+            ready_[kept++] = ready_[i];
+        }
+    }
+    ready_.resize(kept);
+
+    // Submit everything and wait in a single call, unless results are already waiting
+    bool waiting = !ready_.empty() || *cq_head_ != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    if (!waiting || to_submit_ > 0) {
+        enter(waiting ? 0 : 1, timeout_ms);
+    }
+    harvest(events);
+
+    // Report the fds with something waiting, leftovers are reported by the next call
+    for (size_t i = 0; i < ready_.size() && events.size() < MAX_EVENTS; ++i) {
+        report(ready_[i], events);
+    }
+    return events.size();
+}
+
+void IoUringEventListener::harvest(std::vector<Event> &events) {
+    // Every completion is taken, its result waits in the fd state until it is reported
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        complete(cqes_[head & *cq_mask_], events);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+void IoUringEventListener::arm(int fd) {
+    FdState &state = polls_[fd];
+    uint32_t mask  = state.mask;
+
+    // Attached fds get their results without waiting for readiness
+    if (state.mode != ASYNC_NONE) {
+        if (state.mode == ASYNC_STREAM) {
+            mask &= ~POLLOUT;
+        }
+        bool direct = !multishot_ || state.no_buffers;
+        if ((mask & POLLIN) && (state.eof || state.error)) {
+            mask &= ~POLLIN;
+        } else if ((mask & POLLIN) && !direct) {
+            mask &= ~POLLIN;
+            if (!state.multishot) {
+                armRequest(fd, state);
+            }
+        }
+        if (pending(state)) {
+            markReady(fd);
+        }
+    }
+    if (state.armed || mask == 0) {
+        return;
+    }
+
+    struct io_uring_sqe *sqe = getSqe();
+    if (!sqe) {
+        markDirty(fd);
+        return;
+    }
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = fd;
+    sqe->poll32_events = mask;
+    sqe->user_data     = requestData(state.generation, fd, IO_URING_POLL);
+    state.armed        = true;
+}
+
+void IoUringEventListener::armRequest(int fd, FdState &state) {
+    struct io_uring_sqe *sqe = getSqe();
+    if (!sqe) {
+        markDirty(fd);
+        return;
+    }
+    sqe->fd = fd;
+    if (state.mode == ASYNC_ACCEPT) {
+        // Accepts until cancelled, the address is fetched from the socket when it is needed
+        sqe->opcode       = IORING_OP_ACCEPT;
+        sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data    = requestData(state.session, fd, IO_URING_ACCEPT);
+    } else {
+        // Receives until cancelled, each completion filling a buffer picked from the ring
+        sqe->opcode    = IORING_OP_RECV;
+        sqe->ioprio    = IORING_RECV_MULTISHOT;
+        sqe->flags     = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = IO_URING_BUFFER_GROUP;
+        sqe->user_data = requestData(state.session, fd, IO_URING_RECV);
+    }
+    state.multishot = true;
+    state.cancelled = false;
+    ++inflight_;
+}
+
+void IoUringEventListener::submit(SendOp *op) {
+    struct io_uring_sqe *sqe = getSqe();
+    if (!sqe) {
+        deferred_.push_back(op);
+        return;
+    }
+    if (op->reading) {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd     = op->segments[0].fd();
+        sqe->addr   = reinterpret_cast<uintptr_t>(&op->buffer[0]);
+        sqe->len    = op->wanted;
+        sqe->off    = op->offset;
+    } else if (!op->buffer.empty()) {
+        sqe->opcode    = IORING_OP_SEND;
+        sqe->fd        = op->fd;
+        sqe->addr      = reinterpret_cast<uintptr_t>(&op->buffer[0]);
+        sqe->len       = op->wanted;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    } else {
+        sqe->opcode    = IORING_OP_SENDMSG;
+        sqe->fd        = op->fd;
+        sqe->addr      = reinterpret_cast<uintptr_t>(&op->msg);
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    sqe->user_data = reinterpret_cast<uintptr_t>(op) | IO_URING_SEND;
+}
+
+void IoUringEventListener::complete(const struct io_uring_cqe &cqe, std::vector<Event> &events) {
+    int kind = cqe.user_data & IO_URING_KIND;
+    if (kind == IO_URING_IGNORE) {
+        return;
+    }
+    if (kind == IO_URING_SEND) {
+        completeSend(reinterpret_cast<SendOp *>(cqe.user_data & ~static_cast<uint64_t>(IO_URING_KIND)),
+                     cqe.res);
+        return;
+    }
+
+    int      fd         = static_cast<int>((cqe.user_data & 0xffffffff) >> 3);
+    uint32_t generation = static_cast<uint32_t>(cqe.user_data >> 32);
+    if (kind == IO_URING_POLL) {
+        // Drop completions of polls that were cancelled or replaced
+        if (!hasEntry(polls_, fd)) {
+            return;
+        }
+        FdState &poll = polls_[fd];
+        if (!poll.armed || poll.generation != generation) {
+            return;
+        }
+        poll.armed = false;
+        markDirty(fd);
+
+        // Signals are read from the signalfd and reported by signal number
+        if (fd == signal_fd_) {
+            readSignals(signal_fd_, events);
+            return;
+        }
+        poll.revents |= cqe.res < 0 ? POLLERR : static_cast<uint32_t>(cqe.res);
+        markReady(fd);
+        return;
+    }
+
+    // Accept and recv requests, the last completion of one has no IORING_CQE_F_MORE
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    if (!more) {
+        --inflight_;
+    }
+    bool     buffer = cqe.flags & IORING_CQE_F_BUFFER;
+    unsigned id     = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    if (!hasEntry(polls_, fd) || polls_[fd].session != generation || draining_) {
+        // The fd was removed meanwhile, what the request got goes back
+        if (kind == IO_URING_ACCEPT && cqe.res >= 0) {
+            close(cqe.res);
+        }
+        if (buffer) {
+            recycle(id);
+        }
+        return;
+    }
+
+    FdState &state = polls_[fd];
+    if (cqe.res > 0 && kind == IO_URING_RECV && buffer) {
+        Completion completion = {static_cast<int>(id), static_cast<unsigned>(cqe.res)};
+        state.completed.push_back(completion);
+    } else if (cqe.res >= 0 && kind == IO_URING_ACCEPT) {
+        Completion completion = {cqe.res, 0};
+        state.completed.push_back(completion);
+    } else {
+        if (buffer) {
+            recycle(id);
+        }
+        if (cqe.res == 0) {
+            state.eof = true;
+        } else if (cqe.res == -ENOBUFS) {
+            // Every buffer is waiting to be taken, read directly once the socket is readable
+            state.no_buffers = true;
+        } else if (cqe.res == -EINVAL) {
+            // Kernels before multishot requests, every attached fd waits with polls from now on
+            Logger::instance().log("io_uring does not take multishot requests, sockets wait for readiness");
+            multishot_ = false;
+        } else if (cqe.res != -ECANCELED) {
+            state.error = -cqe.res;
+        }
+    }
+    if (!more) {
+        state.multishot = false;
+        state.cancelled = false;
+        markDirty(fd);
+    }
+    markReady(fd);
+}
+
+void IoUringEventListener::completeSend(SendOp *op, int res) {
+    if (op->orphaned) {
+        --inflight_;
+        delete op;
+        return;
+    }
+
+    // The file bytes are in, send them with the same request
+    if (op->reading && res > 0 && !draining_) {
+        op->reading = false;
+        op->wanted  = res;
+        op->buffer.resize(res);
+        submit(op);
+        return;
+    }
+    --inflight_;
+    op->reading = false;
+    op->done    = true;
+    op->result  = res;
+    markReady(op->fd);
+}
+
+bool IoUringEventListener::pending(const FdState &state) const {
+    if (state.revents) {
+        return true;
+    }
+    if ((state.mask & POLLIN) && (!state.completed.empty() || state.eof || state.error)) {
+        return true;
+    }
+    return state.mode == ASYNC_STREAM && (state.mask & POLLOUT) && (!state.send || state.send->done);
+}
+
+void IoUringEventListener::report(int fd, std::vector<Event> &events) {
+    FdState &state   = polls_[fd];
+    uint32_t revents = state.revents;
+    state.revents    = 0;
+    if ((state.mask & POLLIN) && (!state.completed.empty() || state.eof || state.error)) {
+        revents |= POLLIN;
+    }
+    if (state.mode == ASYNC_STREAM && (state.mask & POLLOUT) && (!state.send || state.send->done)) {
+        revents |= POLLOUT;
+    }
+
+    // Handle conversion from poll events to internal events, one entry per event type
+    if (revents & POLLIN) {
+        events.push_back(std::make_pair(fd, static_cast<InternalEvent>(READABLE)));
+    } else if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        events.push_back(std::make_pair(fd, static_cast<InternalEvent>(ERROR_EVENT)));
+        return;
+    }
+    if (revents & POLLOUT) {
+        events.push_back(std::make_pair(fd, static_cast<InternalEvent>(WRITABLE)));
+    }
+}
+
+bool IoUringEventListener::registerEvent(int fd, InternalEvent events) {
+    if (events == 0) {
+        Logger::instance().log("Error: No events specified during registerEvent()");
+        return false;
+    }
+    if (events & SIGNAL_EVENT) {
+        int signal_fd = addSignal(signal_fd_, signal_mask_, fd);
+        if (signal_fd == -1 || signal_fd_ != -1) {
+            return signal_fd != -1;
+        }
+        signal_fd_ = signal_fd;
+        fd         = signal_fd_;
+        events     = READABLE;
+    }
+
+    // Handle conversion from internal events to poll events
+    uint32_t mask = 0;
+    if (events & READABLE) mask |= POLLIN;
+    if (events & WRITABLE) mask |= POLLOUT;
+
+    setMask(fd, mask | fdEntry(polls_, fd).mask);
+    return true;
+}
+
+void IoUringEventListener::unregisterEvent(int fd, InternalEvent events) {
+    // Check if event exists.
+    if (!hasEntry(polls_, fd) || polls_[fd].mask == 0) {
+        Logger::instance().log("Error: Event does not exist during unregisterEvent()");
+        return;
+    }
+
+    uint32_t mask = polls_[fd].mask;
+    if (events & READABLE) mask &= ~POLLIN;
+    if (events & WRITABLE) mask &= ~POLLOUT;
+    setMask(fd, mask);
+}
+
+void IoUringEventListener::removeEvent(int fd) {
+    if (!hasEntry(polls_, fd)) {
+        return;
+    }
+
+    // The generations survive so completions of the cancelled requests stay stale if fd is reused
+    FdState &state = polls_[fd];
+    cancelPoll(fd, state);
+    if (state.multishot && !state.cancelled) {
+        cancel(requestData(state.session, fd, state.mode == ASYNC_ACCEPT ? IO_URING_ACCEPT : IO_URING_RECV));
+    }
+    ++state.session;
+    state.multishot = false;
+    state.cancelled = false;
+
+    // Hand back what completed and was not taken
+    for (std::deque<Completion>::iterator it = state.completed.begin(); it != state.completed.end();
+         ++it) {
+        if (state.mode == ASYNC_ACCEPT) {
+            close(it->value);
+        } else {
+            recycle(it->value);
+        }
+    }
+    state.completed.clear();
+
+    // A send still in flight keeps its bytes until the kernel is done with them
+    if (state.send && !state.send->done) {
+        state.send->orphaned = true;
+        cancel(reinterpret_cast<uintptr_t>(state.send) | IO_URING_SEND);
+    } else {
+        delete state.send;
+    }
+    state.send       = NULL;
+    state.mask       = 0;
+    state.revents    = 0;
+    state.mode       = ASYNC_NONE;
+    state.no_buffers = false;
+    state.eof        = false;
+    state.error      = 0;
+}
+
+AsyncIo *IoUringEventListener::asyncIo() {
+    return buffer_ring_ ? this : NULL;
+}
+
+void IoUringEventListener::attach(int fd, AsyncMode mode) {
+    fdEntry(polls_, fd).mode = mode;
+}
+
+int IoUringEventListener::accept(int fd) {
+    FdState &state = fdEntry(polls_, fd);
+    if (!state.completed.empty()) {
+        int client = state.completed.front().value;
+        state.completed.pop_front();
+        return client;
+    }
+    if (state.error) {
+        // The accept request ended on the error, it is armed again once it was reported
+        errno       = state.error;
+        state.error = 0;
+        markDirty(fd);
+        return -1;
+    }
+    if (!state.multishot) {
+        // No request armed, the poll reported the socket readable
+        return ::accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+ssize_t IoUringEventListener::recv(int fd, RecvBuffer &buffer) {
+    FdState &state = fdEntry(polls_, fd);
+    if (!state.completed.empty()) {
+        Completion completion = state.completed.front();
+        state.completed.pop_front();
+        memcpy(buffer.reserve(completion.size), buffers_ + completion.value * IO_URING_BUFFER_SIZE,
+               completion.size);
+        buffer.commit(completion.size);
+        recycle(completion.value);
+        return completion.size;
+    }
+    if (state.error) {
+        errno = state.error;
+        return -1;
+    }
+    if (state.eof) {
+        return 0;
+    }
+    if (state.multishot) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // No request armed, the poll reported the socket readable: read straight into the buffer, the
+    // next listen() arms a request again
+    if (state.no_buffers) {
+        state.no_buffers = false;
+        markDirty(fd);
+    }
+    ssize_t bytes = ::recv(fd, buffer.reserve(IO_URING_BUFFER_SIZE), IO_URING_BUFFER_SIZE, 0);
+    if (bytes > 0) {
+        buffer.commit(bytes);
+    }
+    return bytes;
+}
+
+ssize_t IoUringEventListener::send(int fd, const SendQueue &queue, size_t &wanted) {
+    FdState &state = fdEntry(polls_, fd);
+
+    // Take the result of the last send
+    if (state.send) {
+        if (!state.send->done) {
+            errno = EAGAIN;
+            return -1;
+        }
+        ssize_t result = state.send->result;
+        wanted         = state.send->wanted;
+        delete state.send;
+        state.send = NULL;
+        if (result < 0) {
+            errno = -result;
+            return -1;
+        }
+        return result;
+    }
+
+    // Submit the next one, it completes while the other sessions are served
+    SendOp *op = new SendOp();
+    op->fd     = fd;
+    if (queue.front().isFile()) {
+        op->reading = true;
+        op->offset  = queue.front().offset() + queue.sent();
+        op->wanted  = std::min<size_t>(queue.front().size() - queue.sent(), IO_URING_READ_SIZE);
+        op->buffer.resize(op->wanted);
+        queue.share(op->segments, 1);
+    } else {
+        int count;
+        op->wanted = queue.gather(op->iov, SEND_IOV_MAX, count);
+        queue.share(op->segments, count);
+        memset(&op->msg, 0, sizeof(op->msg));
+        op->msg.msg_iov    = op->iov;
+        op->msg.msg_iovlen = count;
+    }
+    state.send = op;
+    ++inflight_;
+    submit(op);
+    errno = EAGAIN;
+    return -1;
+}
+
+void IoUringEventListener::setMask(int fd, uint32_t mask) {
+    FdState &state = fdEntry(polls_, fd);
+    if (state.mask == mask) {
+        return;
+    }
+
+    // An armed poll waits on the old mask, replace it
+    cancelPoll(fd, state);
+
+    // Stop accepting or receiving without READABLE, what already completed is kept
+    if (state.multishot && !state.cancelled && !(mask & POLLIN)) {
+        cancel(requestData(state.session, fd, state.mode == ASYNC_ACCEPT ? IO_URING_ACCEPT : IO_URING_RECV));
+        state.cancelled = true;
+    }
+    state.mask = mask;
+    markDirty(fd);
+}
+
+void IoUringEventListener::cancelPoll(int fd, FdState &state) {
+    if (!state.armed) {
+        return;
+    }
+
+    // Without room for the removal the poll fires once more, its completion is stale by then
+    struct io_uring_sqe *sqe = getSqe();
+    if (sqe) {
+        sqe->opcode    = IORING_OP_POLL_REMOVE;
+        sqe->addr      = requestData(state.generation, fd, IO_URING_POLL);
+        sqe->user_data = IO_URING_IGNORE;
+    }
+    state.armed = false;
+    ++state.generation;
+}
+
+void IoUringEventListener::cancel(uint64_t user_data) {
+    struct io_uring_sqe *sqe = getSqe();
+    if (!sqe) {
+        cancels_.push_back(user_data);
+        return;
+    }
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->addr      = user_data;
+    sqe->user_data = IO_URING_IGNORE;
+}
+
+void IoUringEventListener::markDirty(int fd) {
+    FdState &state = polls_[fd];
+    if (!state.dirty) {
+        state.dirty = true;
+        dirty_.push_back(fd);
+    }
+}
+
+void IoUringEventListener::markReady(int fd) {
+    FdState &state = polls_[fd];
+    if (!state.ready) {
+        state.ready = true;
+        ready_.push_back(fd);
+    }
+}
+
+void IoUringEventListener::recycle(unsigned id) {
+    // Hand the buffer back to the kernel at the tail of the ring. The entries start at the ring
+    // itself, the tail overlapping the first one (bufs is not at offset 0 in C++ builds)
+    struct io_uring_buf *bufs = reinterpret_cast<struct io_uring_buf *>(buffer_ring_);
+    struct io_uring_buf *buf  = &bufs[buffer_tail_ & (IO_URING_BUFFERS - 1)];
+    buf->addr                = reinterpret_cast<uintptr_t>(buffers_ + id * IO_URING_BUFFER_SIZE);
+    buf->len                 = IO_URING_BUFFER_SIZE;
+    buf->bid                 = id;
+    ++buffer_tail_;
+    __atomic_store_n(&buffer_ring_->tail, buffer_tail_, __ATOMIC_RELEASE);
+}
+
+#endif
+
+#else
+
+KqueueEventListener::KqueueEventListener(size_t max_fds) : events_(max_fds, NONE) {
     // Initialize timeout
     timeout_.tv_sec  = 0;
     timeout_.tv_nsec = 0;
 
     // Create a new kqueue
-    KqueueEventMap[EVFILT_READ]   = READABLE;
-    KqueueEventMap[EVFILT_WRITE]  = WRITABLE;
-    KqueueEventMap[EVFILT_EXCEPT] = ERROR_EVENT;
-    KqueueEventMap[EVFILT_SIGNAL] = SIGNAL_EVENT;
-
     queue_fd_ = kqueue();
 
     // Check if kqueue was created successfully
@@ -19,118 +1026,309 @@ KqueueEventListener::KqueueEventListener() {
     }
 }
 
-std::pair<int, InternalEvent> KqueueEventListener::listen() {
+KqueueEventListener::~KqueueEventListener() {
+    close(queue_fd_);
+}
+
+int KqueueEventListener::listen(std::vector<Event> &events, int timeout_ms) {
+    events.clear();
+
+    // A NULL timeout blocks until an event is ready
+    struct timespec *timeout = NULL;
+    if (timeout_ms >= 0) {
+        timeout_.tv_sec  = timeout_ms / 1000;
+        timeout_.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        timeout          = &timeout_;
+    }
+
     // Wait for events on the kqueue.
-    struct kevent eventlist;
-    KqueueEvent   filter = 0;
-    memset(&eventlist,0, sizeof(eventlist));
-    int           ret    = kevent(queue_fd_, NULL, 0, &eventlist, 1, &timeout_);
+    int ret = kevent(queue_fd_, NULL, 0, eventlist_, MAX_EVENTS, timeout);
 
-    // Check if event was received successfully
+    // Check if events were received successfully
     if (ret == -1) {
         Logger::instance().log("Error: Failed to receive event from kqueue");
-        return std::make_pair(-1, NONE);
+        return -1;
     }
-    filter = static_cast<KqueueEvent>(eventlist.filter);
 
-    // Handle conversion from kqueue events to internal events
-    InternalEvent event = NONE;
-    for (std::map<KqueueEvent, InternalEvent>::const_iterator it = KqueueEventMap.begin();
-        it != KqueueEventMap.end(); ++it) {
-        if (!(filter ^ it->first)) {
-            event = it->second;
-            break;
+    for (int i = 0; i < ret; ++i) {
+        // Handle conversion from kqueue filters to internal events
+        InternalEvent event = NONE;
+        switch (eventlist_[i].filter) {
+            case EVFILT_READ:
+                event = READABLE;
+                break;
+            case EVFILT_WRITE:
+                event = WRITABLE;
+                break;
+            case EVFILT_SIGNAL:
+                event = SIGNAL_EVENT;
+                break;
+        }
+        if (eventlist_[i].flags & EV_ERROR) {
+            event = ERROR_EVENT;
+        }
+        if (event != NONE) {
+            events.push_back(std::make_pair(static_cast<int>(eventlist_[i].ident), event));
         }
     }
-
-    // Return fd and event
-    return std::make_pair(eventlist.ident, event);
+    return events.size();
 }
 
 bool KqueueEventListener::registerEvent(int fd, InternalEvent events) {
-    // if (events == SIGNAL_EVENT) {
-        // Logger::instance().log("Registering signal event");
-    // } else {
-        // Logger::instance().log("Registering event: " + std::to_string(events) +
-                            //    " on fd: " + std::to_string(fd));
-    // }
-
-    // Handle conversion from internal events to kqueue filter
-    KqueueEvent filter = NONE;
-    for (std::map<KqueueEvent, InternalEvent>::const_iterator it = KqueueEventMap.begin();
-         it != KqueueEventMap.end(); ++it) {
-        if (events & it->second) {
-            filter |= it->first;
-        }
-    }
-
-    if (events != SIGNAL_EVENT && fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
-        Logger::instance().log("Error: Failed to set socket to non-blocking");
-        return false;
-    }
-
-    // Set flags and fflags
-    struct kevent event;
-    u_short       flags  = EV_ADD | EV_CLEAR;
-    u_int         fflags = 0;  /** @todo check if we need EVFILT_VNODE */
-    int64_t       data   = 0;  // Shouldn't be needed
-
-    // Initialize kevent structure.
     if (events == 0) {
         Logger::instance().log("Error: No events specified during registerEvent()");
         return false;
     }
+
+    // Read and write are separate filters, each needs its own change
+    struct kevent changes[2];
+    int           nchanges = 0;
     if (events & SIGNAL_EVENT) {
-        EV_SET(&event, fd, EVFILT_SIGNAL, flags, fflags, data, NULL);
+        EV_SET(&changes[nchanges++], fd, EVFILT_SIGNAL, EV_ADD | EV_CLEAR, 0, 0, NULL);
     } else {
-        EV_SET(&event, fd, filter, flags, fflags, data, NULL);
+        InternalEvent added = events & ~fdEntry(events_, fd);
+        if (added & READABLE) {
+            EV_SET(&changes[nchanges++], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+        }
+        if (added & WRITABLE) {
+            EV_SET(&changes[nchanges++], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, NULL);
+        }
+    }
+    if (nchanges == 0) {
+        return true;
     }
 
-    // Add event to the kqueue.
-    if (kevent(queue_fd_, &event, 1, NULL, 0, NULL) == -1) {
+    // Add events to the kqueue.
+    if (kevent(queue_fd_, changes, nchanges, NULL, 0, NULL) == -1) {
         Logger::instance().log("Error: Failed to add event to kqueue");
         return false;
     }
 
-    // Add event to the map of events.
-    events_[fd] = event;
+    // Add events to the table of events, signals are not fds and are not tracked.
+    if (!(events & SIGNAL_EVENT)) {
+        events_[fd] |= events & (READABLE | WRITABLE);
+    }
 
     return true;
 }
 
-void KqueueEventListener::unregisterEvent(int fd, InternalEvent events) {
-    // Logger::instance().log("Unregistering events on fd: " + std::to_string(fd));
+bool KqueueEventListener::registerEvents(const std::vector<int> &fds, InternalEvent events) {
+    if (events == 0 || (events & SIGNAL_EVENT)) {
+        return EventListener::registerEvents(fds, events);
+    }
+
+    // One kevent call submits the whole batch
+    std::vector<struct kevent> changes;
+    changes.reserve(fds.size() * 2);
+    for (std::vector<int>::const_iterator it = fds.begin(); it != fds.end(); ++it) {
+        InternalEvent added = events & ~fdEntry(events_, *it);
+        struct kevent change;
+        if (added & READABLE) {
+            EV_SET(&change, *it, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+            changes.push_back(change);
+        }
+        if (added & WRITABLE) {
+            EV_SET(&change, *it, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, NULL);
+            changes.push_back(change);
+        }
+    }
+    if (changes.empty()) {
+        return true;
+    }
+    if (kevent(queue_fd_, &changes[0], changes.size(), NULL, 0, NULL) == -1) {
+        Logger::instance().log("Error: Failed to add events to kqueue");
+        return false;
+    }
+    for (std::vector<int>::const_iterator it = fds.begin(); it != fds.end(); ++it) {
+        events_[*it] |= events & (READABLE | WRITABLE);
+    }
+    return true;
+}
 
+void KqueueEventListener::unregisterEvent(int fd, InternalEvent events) {
     // Check if event exists.
-    if (events_.find(fd) == events_.end()) {
+    if (!hasEntry(events_, fd) || events_[fd] == NONE) {
         Logger::instance().log("Error: Event does not exist during unregisterEvent()");
         return;
     }
 
-    // Handle conversion from internal events to kqueue filter
-    KqueueEvent filter = NONE;
-    for (std::map<KqueueEvent, InternalEvent>::const_iterator it = KqueueEventMap.begin();
-         it != KqueueEventMap.end(); ++it) {
-        if (events & it->second) {
-            filter |= it->first;
+    // Only delete the filters that are registered, kevent fails on unknown ones
+    struct kevent changes[2];
+    int           nchanges = 0;
+    InternalEvent removed  = events & events_[fd];
+    if (removed & READABLE) {
+        EV_SET(&changes[nchanges++], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    }
+    if (removed & WRITABLE) {
+        EV_SET(&changes[nchanges++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+    }
+    if (nchanges == 0) {
+        return;
+    }
+
+    // Delete events from the kqueue.
+    if (kevent(queue_fd_, changes, nchanges, NULL, 0, NULL) == -1) {
+        Logger::instance().log("Error: Failed to remove event from kqueue");
+    }
+    events_[fd] &= ~removed;
+}
+
+void KqueueEventListener::removeEvent(int fd) {
+    if (hasEntry(events_, fd)) {
+        events_[fd] = NONE;
+    }
+}
+#endif
+
+TimerWheel::TimerWheel(unsigned long now_ms) : tick_(now_ms / TIMER_TICK_MS), count_(0) {
+    for (int i = 0; i < TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS; ++i) {
+        slots_[i] = -1;
+    }
+}
+
+void TimerWheel::schedule(int id, unsigned long now_ms, unsigned long timeout_ms) {
+    if (id < 0) {
+        return;
+    }
+    if (static_cast<size_t>(id) >= nodes_.size()) {
+        TimerNode node = {-1, -1, -1, 0};
+        nodes_.resize(id + 1, node);
+    }
+    cancel(id);
+
+    // Round up so a timer never fires early
+    nodes_[id].expires = (now_ms + timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    link(id);
+    ++count_;
+}
+
+void TimerWheel::cancel(int id) {
+    if (!pending(id)) {
+        return;
+    }
+    unlink(id);
+    --count_;
+}
+
+bool TimerWheel::pending(int id) const {
+    return id >= 0 && static_cast<size_t>(id) < nodes_.size() && nodes_[id].slot != -1;
+}
+
+size_t TimerWheel::size() const {
+    return count_;
+}
+
+void TimerWheel::expire(unsigned long now_ms, std::vector<int> &expired) {
+    unsigned long now_tick = now_ms / TIMER_TICK_MS;
+
+    while (tick_ <= now_tick) {
+        // Nothing to walk through, jump straight to the current tick
+        if (count_ == 0) {
+            tick_ = now_tick + 1;
+            break;
         }
+
+        // Cascade the higher levels each time the level below wraps around
+        int index = tick_ & TIMER_WHEEL_MASK;
+        if (index == 0) {
+            for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+                int level_index = (tick_ >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+                cascade(level, level_index);
+                if (level_index != 0) {
+                    break;
+                }
+            }
+        }
+
+        // Everything left in the level 0 slot expires on this tick
+        while (slots_[index] != -1) {
+            int id = slots_[index];
+            unlink(id);
+            --count_;
+            expired.push_back(id);
+        }
+        ++tick_;
     }
+}
 
-    // Get event from the map of events.
-    struct kevent event  = events_[fd];
-    u_short       flags  = EV_DELETE;
-    u_int         fflags = 0;
-    int64_t       data   = 0;
+int TimerWheel::nextTimeout(unsigned long now_ms) const {
+    if (count_ == 0) {
+        return -1;
+    }
 
-    // Edit event.
-    EV_SET(&event, fd, filter, flags, fflags, data, NULL);
+    // Wake up on the first non-empty level 0 slot, or on the next cascade
+    unsigned long tick = tick_;
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; ++i, ++tick) {
+        if (slots_[tick & TIMER_WHEEL_MASK] != -1 || (i > 0 && (tick & TIMER_WHEEL_MASK) == 0)) {
+            break;
+        }
+    }
+    unsigned long deadline = tick * TIMER_TICK_MS;
+    return deadline > now_ms ? static_cast<int>(deadline - now_ms) : 0;
+}
 
-    // Delete event from the kqueue.
-    if (kevent(queue_fd_, &event, 1, NULL, 0, NULL) == -1) {
-        Logger::instance().log("Error: Failed to remove event from kqueue");
+void TimerWheel::link(int id) {
+    TimerNode    &node  = nodes_[id];
+    unsigned long delta = node.expires - tick_;
+
+    // Timers already due go in the slot processed next
+    if (node.expires < tick_) {
+        node.expires = tick_;
+        delta        = 0;
+    }
+
+    // Find the lowest level whose range covers the timer, clamping to the last level
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >= (1UL << (TIMER_WHEEL_BITS * (level + 1)))) {
+        ++level;
+    }
+    unsigned long max_delta = (1UL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    if (delta > max_delta) {
+        node.expires = tick_ + max_delta;
     }
+    int index = (node.expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+    // Push at the head of the slot
+    node.slot = level * TIMER_WHEEL_SLOTS + index;
+    node.prev = -1;
+    node.next = slots_[node.slot];
+    if (node.next != -1) {
+        nodes_[node.next].prev = id;
+    }
+    slots_[node.slot] = id;
 }
 
-void KqueueEventListener::removeEvent(int fd) {
-    events_.erase(fd);
-}
\ No newline at end of file
+void TimerWheel::unlink(int id) {
+    TimerNode &node = nodes_[id];
+    if (node.prev != -1) {
+        nodes_[node.prev].next = node.next;
+    } else {
+        slots_[node.slot] = node.next;
+    }
+    if (node.next != -1) {
+        nodes_[node.next].prev = node.prev;
+    }
+    node.prev = -1;
+    node.next = -1;
+    node.slot = -1;
+}
+
+void TimerWheel::cascade(int level, int index) {
+    int id = slots_[level * TIMER_WHEEL_SLOTS + index];
+    slots_[level * TIMER_WHEEL_SLOTS + index] = -1;
+
+    // Relink every timer of the slot, they all land on a lower level
+    while (id != -1) {
+        int next        = nodes_[id].next;
+        nodes_[id].slot = -1;
+        link(id);
+        id = next;
+    }
+}
+
+unsigned long monotonicMillis() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<unsigned long>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
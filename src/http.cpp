@@ -1,97 +1,780 @@
 #include "../include/http.hpp"
+#include "../include/scanner.hpp"
+#include <strings.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 
-std::map<std::string, HttpMethod> initMethodMap() {
-    std::map<std::string, HttpMethod> methodMap;
-    methodMap["GET"]    = GET;
-    methodMap["POST"]   = POST;
-    methodMap["DELETE"] = DELETE;
-    return methodMap;
+HttpRequest::HttpRequest() : method_(UNKNOWN), currentSession(NULL) {}
+
+// Methods are case-sensitive, the length alone leaves at most two candidates
+HttpMethod HttpRequest::method(const char *name, size_t size) {
+    switch (size) {
+        case 3:
+            if (memcmp(name, "GET", 3) == 0) {
+                return GET;
+            }
+            return memcmp(name, "PUT", 3) == 0 ? PUT : UNKNOWN;
+        case 4:
+            if (memcmp(name, "POST", 4) == 0) {
+                return POST;
+            }
+            return memcmp(name, "HEAD", 4) == 0 ? HEAD : UNKNOWN;
+        case 5:
+            return memcmp(name, "PATCH", 5) == 0 ? PATCH : UNKNOWN;
+        case 6:
+            return memcmp(name, "DELETE", 6) == 0 ? DELETE : UNKNOWN;
+        case 7:
+            return memcmp(name, "OPTIONS", 7) == 0 ? OPTIONS : UNKNOWN;
+        default:
+            return UNKNOWN;
+    }
+}
+
+const char *HttpRequest::methodName(HttpMethod method) {
+    switch (method) {
+        case GET:
+            return "GET";
+        case POST:
+            return "POST";
+        case DELETE:
+            return "DELETE";
+        case HEAD:
+            return "HEAD";
+        case PUT:
+            return "PUT";
+        case OPTIONS:
+            return "OPTIONS";
+        case PATCH:
+            return "PATCH";
+        default:
+            return "UNKNOWN";
+    }
+}
+
+struct HeaderName {
+    const char *name;
+    size_t      size;
+};
+
+// Indexed by HeaderId
+static const HeaderName HEADER_NAMES[HEADER_COUNT] = {
+    {"", 0},
+    {"Accept", 6},
+    {"Connection", 10},
+    {"Content-Disposition", 19},
+    {"Content-Length", 14},
+    {"Content-Type", 12},
+    {"Cookie", 6},
+    {"Expect", 6},
+    {"Host", 4},
+    {"Location", 8},
+    {"Referer", 7},
+    {"Transfer-Encoding", 17},
+    {"User-Agent", 10},
+};
+
+HttpHeaders::HttpHeaders() {
+    std::fill(index_, index_ + HEADER_COUNT, 0);
+}
+
+HeaderId HttpHeaders::intern(const char *name, size_t size) {
+    for (int id = HEADER_OTHER + 1; id < HEADER_COUNT; ++id) {
+        if (HEADER_NAMES[id].size == size && strncasecmp(HEADER_NAMES[id].name, name, size) == 0) {
+            return static_cast<HeaderId>(id);
+        }
+    }
+    return HEADER_OTHER;
+}
+
+const char *HttpHeaders::canonical(HeaderId id) {
+    return id == HEADER_OTHER ? NULL : HEADER_NAMES[id].name;
+}
+
+void HttpHeaders::add(const char *name, size_t name_size, const char *value, size_t value_size) {
+    Field field;
+    field.id         = intern(name, name_size);
+    field.name       = bytes_.size();
+    field.name_size  = name_size;
+    field.value      = field.name + name_size;
+    field.value_size = value_size;
+    bytes_.append(name, name_size);
+    bytes_.append(value, value_size);
+    fields_.push_back(field);
+    if (field.id != HEADER_OTHER && !index_[field.id]) {
+        index_[field.id] = fields_.size();
+    }
+}
+
+void HttpHeaders::set(HeaderId id, const std::string &value) {
+    remove(id, "");
+    add(HEADER_NAMES[id].name, HEADER_NAMES[id].size, value.data(), value.size());
+}
+
+void HttpHeaders::set(const std::string &name, const std::string &value) {
+    remove(intern(name.data(), name.size()), name);
+    add(name.data(), name.size(), value.data(), value.size());
+}
+
+bool HttpHeaders::has(HeaderId id) const {
+    return index_[id] != 0;
+}
+
+bool HttpHeaders::has(const std::string &name) const {
+    return find(name) != fields_.size();
+}
+
+std::string HttpHeaders::get(HeaderId id) const {
+    return index_[id] ? value(index_[id] - 1) : std::string();
+}
+
+std::string HttpHeaders::get(const std::string &name) const {
+    size_t index = find(name);
+    return index != fields_.size() ? value(index) : std::string();
+}
+
+size_t HttpHeaders::size() const {
+    return fields_.size();
+}
+
+std::string HttpHeaders::name(size_t index) const {
+    return bytes_.substr(fields_[index].name, fields_[index].name_size);
+}
+
+std::string HttpHeaders::value(size_t index) const {
+    return bytes_.substr(fields_[index].value, fields_[index].value_size);
 }
 
-std::map<std::string, HttpMethod> HttpRequest::methodMap_ = initMethodMap();
+HeaderId HttpHeaders::id(size_t index) const {
+    return fields_[index].id;
+}
+
+void HttpHeaders::serialize(std::string &buffer) const {
+    for (std::vector<Field>::const_iterator it = fields_.begin(); it != fields_.end(); ++it) {
+        if (it->id != HEADER_OTHER) {
+            buffer.append(HEADER_NAMES[it->id].name, HEADER_NAMES[it->id].size);
+        } else {
+            buffer.append(bytes_, it->name, it->name_size);
+        }
+        buffer.append(": ");
+        buffer.append(bytes_, it->value, it->value_size);
+        buffer.append(CRLF);
+    }
+}
+
+size_t HttpHeaders::serializedSize() const {
+    size_t size = 0;
+    for (std::vector<Field>::const_iterator it = fields_.begin(); it != fields_.end(); ++it) {
+        size += it->name_size + sizeof(": " CRLF) - 1 + it->value_size;
+    }
+    return size;
+}
+
+size_t HttpHeaders::find(const std::string &name) const {
+    HeaderId id = intern(name.data(), name.size());
+    if (id != HEADER_OTHER) {
+        return index_[id] ? index_[id] - 1 : fields_.size();
+    }
+    for (size_t i = 0; i < fields_.size(); ++i) {
+        if (fields_[i].name_size == name.size() &&
+            strncasecmp(bytes_.data() + fields_[i].name, name.data(), name.size()) == 0) {
+            return i;
+        }
+    }
+    return fields_.size();
+}
 
-std::string HttpRequest::consumeNextToken(std::string &buffer, const std::string &delimiter) {
-    if (buffer.find(delimiter) == std::string::npos) {
-        return "";
+// Drop the fields of id, or named name for HEADER_OTHER. Their bytes are left in bytes_
+void HttpHeaders::remove(HeaderId id, const std::string &name) {
+    if (id != HEADER_OTHER && !index_[id]) {
+        return;
+    }
+    std::vector<Field>::iterator kept = fields_.begin();
+    for (std::vector<Field>::iterator it = fields_.begin(); it != fields_.end(); ++it) {
+        bool match = id != HEADER_OTHER
+                         ? it->id == id
+                         : it->id == HEADER_OTHER && it->name_size == name.size() &&
+                               strncasecmp(bytes_.data() + it->name, name.data(), name.size()) == 0;
+        if (!match) {
+            *kept++ = *it;
+        }
     }
+    fields_.erase(kept, fields_.end());
+    reindex();
+}
 
-    std::string token = buffer.substr(0, buffer.find(delimiter));
-    buffer.erase(0, buffer.find(delimiter) + delimiter.size());
-    return token;
+void HttpHeaders::reindex() {
+    std::fill(index_, index_ + HEADER_COUNT, 0);
+    for (size_t i = fields_.size(); i > 0; --i) {
+        index_[fields_[i - 1].id] = i;
+    }
+    index_[HEADER_OTHER] = 0;
 }
 
-HttpRequest::HttpRequest(const std::string &request, Session *currentSession): currentSession(currentSession) {
-    const size_t BUFFER_SIZE = 2048;
-    std::string buffer = request;
-    std::string method = consumeNextToken(buffer, " ");
+HttpParser::HttpParser()
+    : state_(REQUEST_LINE),
+      error_(BAD_REQUEST),
+      pos_(0),
+      scan_(0),
+      content_length_(0),
+      chunk_left_(0),
+      body_buffer_size_(CLIENT_BODY_BUFFER_SIZE),
+      header_buffers_(LARGE_CLIENT_HEADER_BUFFERS),
+      header_buffer_size_(LARGE_CLIENT_HEADER_BUFFER_SIZE),
+      body_max_(static_cast<size_t>(-1)),
+      body_pending_(false),
+      form_(false) {}
 
-    
-    method_ = methodMap_.find(method) != methodMap_.end() ? methodMap_[method] : UNKNOWN;
+HttpRequest &HttpParser::request() {
+    return request_;
+}
+
+size_t HttpParser::length() const {
+    return pos_;
+}
 
-    uri_     = consumeNextToken(buffer, " ");
-    version_ = consumeNextToken(buffer, CRLF);
+bool HttpParser::inBody() const {
+    return state_ >= BODY && state_ <= TRAILERS;
+}
 
-    std::string headers = consumeNextToken(buffer, "\r\n\r\n");
-    while (headers.find(CRLF) != std::string::npos) {
-        std::string key = consumeNextToken(headers, ":");
-        consumeNextToken(headers, " ");
-        std::string value = consumeNextToken(headers, CRLF);
-        headers_[key]     = value;
+bool HttpParser::bodyPending() const {
+    return body_pending_;
+}
+
+HttpStatus HttpParser::error() const {
+    return error_;
+}
+
+void HttpParser::setBodyBuffer(size_t size) {
+    body_buffer_size_ = size;
+}
+
+void HttpParser::setHeaderBuffers(size_t number, size_t size) {
+    header_buffers_     = number;
+    header_buffer_size_ = size;
+}
+
+bool HttpParser::limitBody(size_t max) {
+    if (!body_pending_) {
+        return false;
     }
-    size_t prevLength = 0;
-    size_t index = 0;
-    while (index < buffer.length()) {
-        prevLength = body_.length();
-        body_.append(buffer, index, std::min(BUFFER_SIZE, (buffer.length() - index)));
-        index += (body_.length() - prevLength);
+    body_max_ = max;
+    if (state_ == BODY && content_length_ > max) {
+        error_ = CONTENT_TOO_LARGE;
+        state_ = INVALID;
+        return false;
     }
+    return true;
 }
 
-std::map<HttpStatus, std::string> initStatusMap() {
-    std::map<HttpStatus, std::string> statusMap;
-    statusMap[OK]                    = "200 OK";
-    statusMap[CREATED]               = "201 Created";
-    statusMap[ACCEPTED]              = "202 Accepted";
-    statusMap[NO_CONTENT]            = "204 No Content";
-    statusMap[MOVED_PERMANENTLY]     = "301 Moved Permanently";
-    statusMap[FOUND]                 = "302 Found";
-    statusMap[NOT_MODIFIED]          = "304 Not Modified";
-    statusMap[BAD_REQUEST]           = "400 Bad Request";
-    statusMap[NOT_FOUND]             = "404 Not Found";
-    statusMap[METHOD_NOT_ALLOWED]    = "405 Method Not Allowed";
-    statusMap[CONTENT_TOO_LARGE]     = "413 Content Too Large";
-    statusMap[IM_A_TEAPOT]           = "418 I'm a teapot";
-    statusMap[INTERNAL_SERVER_ERROR] = "500 Internal Server Error";
-    statusMap[BAD_GATEWAY]           = "502 Bad Gateway";
-    return statusMap;
+bool HttpParser::uploadTo(const std::string &directory) {
+    if (!body_pending_) {
+        return false;
+    }
+    // A chunked body has no announced length to reserve
+    std::string().swap(request_.body_);
+    return request_.upload_.open(directory, state_ == BODY ? content_length_ : 0);
 }
 
-std::map<HttpStatus, std::string> HttpResponse::statusMap_ = initStatusMap();
+bool HttpParser::formTo(const std::string &directory, const std::string &boundary) {
+    if (!body_pending_) {
+        return false;
+    }
+    std::string().swap(request_.body_);
+    multipart_        = MultipartParser(boundary);
+    upload_directory_ = directory;
+    form_             = true;
+    return multipart_.state() != MultipartParser::INVALID;
+}
 
-std::string HttpResponse::getMessage() const {
-    std::string buffer;
+size_t HttpParser::discard() {
+    if (!inBody()) {
+        return 0;
+    }
+    size_t parsed = pos_;
+    pos_          = 0;
+    scan_ -= parsed;
+    return parsed;
+}
+
+void HttpParser::reset() {
+    state_          = REQUEST_LINE;
+    error_          = BAD_REQUEST;
+    pos_            = 0;
+    scan_           = 0;
+    content_length_ = 0;
+    chunk_left_     = 0;
+    body_max_       = static_cast<size_t>(-1);
+    body_pending_   = false;
+    form_           = false;
+    multipart_      = MultipartParser();
+    upload_directory_.clear();
+    request_        = HttpRequest();
+}
+
+// Next complete line from pos_, without its CRLF (or bare LF). Resumes the search where it stopped
+bool HttpParser::line(const char *data, size_t size, const char *&begin, const char *&end) {
+    const char *newline = Scanner::instance().lineEnd(data + scan_, data + size);
+    if (newline == data + size) {
+        scan_ = size;
+        lineTooLong(size);
+        return false;
+    }
+    if (lineTooLong(newline - data)) {
+        return false;
+    }
+    begin = data + pos_;
+    end   = newline > begin && newline[-1] == '\r' ? newline - 1 : newline;
+    pos_ = scan_ = newline + 1 - data;
+    return true;
+}
+
+// Reject the line ending at end, complete or not, once it outgrows a header buffer or the header
+// block outgrows all of them
+bool HttpParser::lineTooLong(size_t end) {
+    if (end - pos_ > header_buffer_size_) {
+        if (state_ == REQUEST_LINE) {
+            error_ = URI_TOO_LONG;
+        } else if (state_ == HEADERS || state_ == TRAILERS) {
+            error_ = REQUEST_HEADER_FIELDS_TOO_LARGE;
+        } else {
+            error_ = BAD_REQUEST;
+        }
+    } else if (state_ == HEADERS && end > header_buffers_ * header_buffer_size_) {
+        error_ = REQUEST_HEADER_FIELDS_TOO_LARGE;
+    } else {
+        return false;
+    }
+    state_ = INVALID;
+    return true;
+}
+
+// "METHOD SP request-target SP HTTP-version", the method a token and the target free of controls
+bool HttpParser::requestLine(const char *begin, const char *end) {
+    const Scanner &scanner    = Scanner::instance();
+    const char    *method_end = scanner.tokenEnd(begin, end);
+    if (method_end == begin || method_end == end || *method_end != ' ') {
+        return false;
+    }
+    const char *uri_end = scanner.targetEnd(method_end + 1, end);
+    if (uri_end == method_end + 1 || uri_end == end || *uri_end != ' ') {
+        return false;
+    }
+
+    request_.method_ = HttpRequest::method(begin, method_end - begin);
+    request_.uri_.assign(method_end + 1, uri_end);
+    request_.version_.assign(uri_end + 1, end);
+    return request_.version_.compare(0, 5, "HTTP/") == 0;
+}
+
+// "field-name: value", the name a token right before the colon, the value without surrounding
+// whitespace
+bool HttpParser::headerLine(const char *begin, const char *end) {
+    const char *colon = Scanner::instance().tokenEnd(begin, end);
+    if (colon == begin || colon == end || *colon != ':') {
+        return false;
+    }
+    const char *value = colon + 1;
+    while (value < end && (*value == ' ' || *value == '\t')) {
+        ++value;
+    }
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+        --end;
+    }
+    // A body framed twice could be read two ways, repeating its framing is an error
+    HeaderId id = HttpHeaders::intern(begin, colon - begin);
+    if ((id == HEADER_CONTENT_LENGTH || id == HEADER_TRANSFER_ENCODING) &&
+        request_.headers_.has(id)) {
+        return false;
+    }
+    request_.headers_.add(begin, colon - begin, value, end - value);
+    return true;
+}
+
+// Pick the body framing once the empty line ends the headers
+bool HttpParser::headersComplete() {
+    // A request framed both ways is read one way here and the other way by a proxy in front,
+    // which lets a second request hide in the body: reject it. Without either it has no body
+    if (request_.headers_.has(HEADER_TRANSFER_ENCODING) &&
+        request_.headers_.has(HEADER_CONTENT_LENGTH)) {
+        return false;
+    }
+    if (request_.headers_.has(HEADER_TRANSFER_ENCODING)) {
+        if (strcasecmp(request_.headers_.get(HEADER_TRANSFER_ENCODING).c_str(), "chunked") != 0) {
+            return false;
+        }
+        state_ = CHUNK_SIZE;
+    } else if (request_.headers_.has(HEADER_CONTENT_LENGTH)) {
+        std::string length = request_.headers_.get(HEADER_CONTENT_LENGTH);
+        if (length.empty() || length.size() > 18 ||
+            length.find_first_not_of("0123456789") != std::string::npos) {
+            return false;
+        }
+        content_length_ = std::strtoull(length.c_str(), NULL, 10);
+        state_          = content_length_ ? BODY : COMPLETE;
+        if (content_length_ <= body_buffer_size_) {
+            request_.body_.reserve(content_length_);
+        }
+    } else {
+        state_ = COMPLETE;
+    }
+    return true;
+}
+
+static bool writeAll(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Move the body from memory to an unlinked temporary file, it goes away with its last descriptor
+bool HttpParser::spool() {
+    char path[] = CLIENT_BODY_TEMP_PATH;
+    int  fd     = mkstemp(path);
+    if (fd == -1) {
+        Logger::instance().log("Error: Failed to create a request body file -> " +
+                               std::string(strerror(errno)));
+        return false;
+    }
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    request_.body_file_ = SendSegment(fd, 0, 0);
+    if (!bodyData(request_.body_.data(), request_.body_.size())) {
+        return false;
+    }
+    std::string().swap(request_.body_);
+    return true;
+}
+
+// Hand decoded body bytes to the request, in memory up to body_buffer_size_ and to a file past it,
+// or all of them to the upload file or the form. Sets error_ when they cannot be stored
+bool HttpParser::bodyData(const char *data, size_t size) {
+    if (form_) {
+        return formData(data, size);
+    }
+    if (request_.upload_.isOpen()) {
+        if (!request_.upload_.write(data, size)) {
+            error_ = INTERNAL_SERVER_ERROR;
+            return false;
+        }
+        return true;
+    }
+    if (!request_.body_file_.isFile()) {
+        if (request_.body_.size() + size <= body_buffer_size_) {
+            request_.body_.append(data, size);
+            return true;
+        }
+        if (!spool()) {
+            error_ = INTERNAL_SERVER_ERROR;
+            return false;
+        }
+        return bodyData(data, size);
+    }
+    if (!writeAll(request_.body_file_.fd(), data, size)) {
+        Logger::instance().log("Error: Failed to write a request body file -> " +
+                               std::string(strerror(errno)));
+        error_ = INTERNAL_SERVER_ERROR;
+        return false;
+    }
+    request_.body_file_.extend(size);
+    return true;
+}
+
+/** Stores the parts of a form in FormData: files in the upload directory, plain fields in memory */
+class FormSink : public MultipartSink {
+   public:
+    FormSink(FormData &form, const std::string &directory, size_t values_max)
+        : form_(form), directory_(directory), values_max_(values_max), error_(BAD_REQUEST) {}
 
-    // status-line
-    buffer.append(version_ + " ");
+    bool partBegin(const HttpHeaders &headers) {
+        std::string disposition = headers.get(HEADER_CONTENT_DISPOSITION);
+        form_.parts.push_back(FormPart());
+        FormPart &part = form_.parts.back();
+        part.name      = MultipartParser::parameter(disposition, "name");
+        part.filename  = MultipartParser::parameter(disposition, "filename");
+        if (!part.filename.empty() && !part.file.open(directory_, 0)) {
+            error_ = INTERNAL_SERVER_ERROR;
+            return false;
+        }
+        return true;
+    }
+
+    bool partData(const char *data, size_t size) {
+        FormPart &part = form_.parts.back();
+        if (part.file.isOpen()) {
+            if (!part.file.write(data, size)) {
+                error_ = INTERNAL_SERVER_ERROR;
+                return false;
+            }
+            return true;
+        }
+        if (form_.values_size + size > values_max_) {
+            error_ = CONTENT_TOO_LARGE;
+            return false;
+        }
+        part.value.append(data, size);
+        form_.values_size += size;
+        return true;
+    }
+
+    bool partEnd() {
+        return true;
+    }
+
+    HttpStatus error() const {
+        return error_;
+    }
+
+   private:
+    FormData          &form_;       // form of the request
+    const std::string &directory_;  // upload directory of the files
+    size_t             values_max_; // bytes of plain field values allowed in memory
+    HttpStatus         error_;      // why the form was rejected, a malformed body by default
+};
+
+bool HttpParser::formData(const char *data, size_t size) {
+    FormSink sink(request_.form_, upload_directory_, body_buffer_size_);
+    request_.form_.size += size;
+    if (multipart_.feed(data, size, sink) == MultipartParser::INVALID) {
+        error_ = sink.error();
+        return false;
+    }
+    request_.form_.complete = multipart_.state() == MultipartParser::DONE;
+    return true;
+}
+
+HttpParser::State HttpParser::parse(const char *data, size_t size) {
+    const char *begin;
+    const char *end;
 
-    // Find the status string from the map using the enum value.
-    buffer.append(statusMap_[status_] + CRLF);
+    body_pending_ = false;
+    while (state_ != COMPLETE && state_ != INVALID) {
+        switch (state_) {
+            case REQUEST_LINE:
+                if (!line(data, size, begin, end)) {
+                    return state_;
+                }
+                // Empty lines before the request line are ignored
+                if (begin != end) {
+                    state_ = requestLine(begin, end) ? HEADERS : INVALID;
+                }
+                break;
+            case HEADERS:
+                if (!line(data, size, begin, end)) {
+                    return state_;
+                }
+                if (begin == end) {
+                    if (!headersComplete()) {
+                        state_ = INVALID;
+                    } else if (state_ != COMPLETE) {
+                        // Let the caller pick where the body goes before any of it is parsed
+                        body_pending_ = true;
+                        return state_;
+                    }
+                } else if (!headerLine(begin, end)) {
+                    state_ = INVALID;
+                }
+                break;
+            case BODY: {
+                size_t available = std::min(size - pos_, content_length_);
+                if (available == 0) {
+                    return state_;
+                }
+                if (!bodyData(data + pos_, available)) {
+                    state_ = INVALID;
+                    break;
+                }
+                pos_ = scan_ = pos_ + available;
+                content_length_ -= available;
+                if (content_length_ == 0) {
+                    state_ = COMPLETE;
+                }
+                break;
+            }
+            case CHUNK_SIZE: {
+                if (!line(data, size, begin, end)) {
+                    return state_;
+                }
+                // Hex size, optionally followed by ";extensions"
+                const char *digits_end = begin;
+                while (digits_end < end && isxdigit(static_cast<unsigned char>(*digits_end))) {
+                    ++digits_end;
+                }
+                if (digits_end == begin || digits_end - begin > 15 ||
+                    (digits_end != end && *digits_end != ';' && *digits_end != ' ')) {
+                    state_ = INVALID;
+                    break;
+                }
+                chunk_left_ = std::strtoull(std::string(begin, digits_end).c_str(), NULL, 16);
+                if (chunk_left_ > body_max_ - request_.bodySize()) {
+                    // No need to read a chunk that takes the body past its limit
+                    error_ = CONTENT_TOO_LARGE;
+                    state_ = INVALID;
+                    break;
+                }
+                state_ = chunk_left_ ? CHUNK_DATA : TRAILERS;
+                break;
+            }
+            case CHUNK_DATA: {
+                size_t available = std::min(size - pos_, chunk_left_);
+                if (available == 0) {
+                    return state_;
+                }
+                if (!bodyData(data + pos_, available)) {
+                    state_ = INVALID;
+                    break;
+                }
+                pos_ = scan_ = pos_ + available;
+                chunk_left_ -= available;
+                if (chunk_left_ == 0) {
+                    state_ = CHUNK_DATA_END;
+                }
+                break;
+            }
+            case CHUNK_DATA_END:
+                if (!line(data, size, begin, end)) {
+                    return state_;
+                }
+                state_ = begin == end ? CHUNK_SIZE : INVALID;
+                break;
+            case TRAILERS:
+                // Trailer fields are not used, the empty line ends the request
+                if (!line(data, size, begin, end)) {
+                    return state_;
+                }
+                if (begin == end) {
+                    state_ = COMPLETE;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return state_;
+}
 
-    // Append the server name
-    buffer.append(server_ + CRLF);
+#define STATUS_LINE(code, reason)                                              \
+    case code:                                                                 \
+        size = sizeof(HTTP_VERSION " " #code " " reason CRLF) - 1;             \
+        return HTTP_VERSION " " #code " " reason CRLF
 
-    // headers
-    for (std::map<std::string, std::string>::const_iterator it = headers_.begin();
-         it != headers_.end(); ++it) {
-        buffer.append(it->first + ": " + it->second + CRLF);
+const char *HttpResponse::statusLine(HttpStatus status, size_t &size) {
+    switch (status) {
+        STATUS_LINE(200, "OK");
+        STATUS_LINE(201, "Created");
+        STATUS_LINE(202, "Accepted");
+        STATUS_LINE(204, "No Content");
+        STATUS_LINE(301, "Moved Permanently");
+        STATUS_LINE(302, "Found");
+        STATUS_LINE(304, "Not Modified");
+        STATUS_LINE(400, "Bad Request");
+        STATUS_LINE(403, "Forbidden");
+        STATUS_LINE(404, "Not Found");
+        STATUS_LINE(405, "Method Not Allowed");
+        STATUS_LINE(413, "Content Too Large");
+        STATUS_LINE(414, "URI Too Long");
+        STATUS_LINE(417, "Expectation Failed");
+        STATUS_LINE(418, "I'm a teapot");
+        STATUS_LINE(431, "Request Header Fields Too Large");
+        STATUS_LINE(500, "Internal Server Error");
+        STATUS_LINE(502, "Bad Gateway");
+        default:
+            size = 0;
+            return NULL;
     }
+}
+
+#undef STATUS_LINE
 
-    // body
-    buffer.append(CRLF + body_);
+void HttpResponse::writeHead(std::string &head) const {
+    // status-line, a code from the configuration may have no known reason
+    size_t      line_size;
+    const char *line = statusLine(status_, line_size);
+    std::string code;
+    if (!line) {
+        code      = std::to_string(status_);
+        line_size = sizeof(HTTP_VERSION "  " CRLF) - 1 + code.size();
+    }
 
-    return buffer;
+    head.clear();
+    head.reserve(line_size + sizeof("Server: " CRLF) - 1 + server_.size() +
+                 headers_.serializedSize() + sizeof(CRLF) - 1);
+    if (line) {
+        head.append(line, line_size);
+    } else {
+        head.append(HTTP_VERSION " ").append(code).append(" " CRLF);
+    }
+    head.append("Server: ").append(server_).append(CRLF);
+    headers_.serialize(head);
+    head.append(CRLF);
+}
+
+std::string HttpResponse::getMessage() const {
+    std::string message;
+    writeHead(message);
+    message.append(body_);
+    return message;
+}
+
+bool HttpRequest::keepAlive() const {
+    std::string connection = headers_.get(HEADER_CONNECTION);
+    for (std::string::iterator it = connection.begin(); it != connection.end(); ++it) {
+        *it = std::tolower(static_cast<unsigned char>(*it));
+    }
+
+    // HTTP/1.1 connections persist unless closed, HTTP/1.0 ones only when asked for
+    if (connection.find("close") != std::string::npos) {
+        return false;
+    }
+    if (version_ == "HTTP/1.0") {
+        return connection.find("keep-alive") != std::string::npos;
+    }
+    return true;
+}
+
+size_t HttpRequest::bodySize() const {
+    if (upload_.isOpen()) {
+        return upload_.size();
+    }
+    if (form_.size) {
+        return form_.size;
+    }
+    return body_file_.isFile() ? body_file_.size() : body_.size();
+}
+
+bool HttpRequest::loadBody() {
+    if (!body_file_.isFile()) {
+        return true;
+    }
+    std::string body(body_file_.size(), '\0');
+    size_t      loaded = 0;
+    while (loaded < body.size()) {
+        ssize_t got = pread(body_file_.fd(), &body[loaded], body.size() - loaded, loaded);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            Logger::instance().log("Error: Failed to read a request body file -> " +
+                                   std::string(strerror(errno)));
+            return false;
+        }
+        loaded += got;
+    }
+    body_.swap(body);
+    body_file_ = SendSegment();
+    return true;
 }
 
 std::string HttpRequest::printRequest() const {
@@ -101,8 +784,8 @@ std::string HttpRequest::printRequest() const {
     oss << "URI: " << uri_ << "\n";
     oss << "Version: " << version_ << "\n";
     oss << "Headers:\n";
-    for (std::map<std::string, std::string>::const_iterator it = headers_.begin(); it != headers_.end(); ++it) {
-        oss << "  " << it->first << ": " << it->second << "\n";
+    for (size_t i = 0; i < headers_.size(); ++i) {
+        oss << "  " << headers_.name(i) << ": " << headers_.value(i) << "\n";
     }
     if (!body_.empty()) {
         oss << "Body:\n" << body_ << "\n";
@@ -1,5 +1,10 @@
 #include "../include/logging.hpp"
 
+#include <pthread.h>
+
+// Pool threads log too, lines are written whole
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 Logger::~Logger() {}
 
 Logger &Logger::instance() {
@@ -9,7 +14,9 @@ Logger &Logger::instance() {
 }
 
 void ConsoleLogger::log(const std::string &message) {
+    pthread_mutex_lock(&log_mutex);
     std::cout << "[" << getTime() << "] " << message << std::endl;
+    pthread_mutex_unlock(&log_mutex);
 }
 
 FileLogger::FileLogger(const std::string &filename) {
@@ -26,15 +33,18 @@ FileLogger::~FileLogger() {
 }
 
 void FileLogger::log(const std::string &message) {
+    pthread_mutex_lock(&log_mutex);
     if (log_file_.is_open()) {
         log_file_ << "[" << getTime() << "] " << message << std::endl;
     }
     std::cout << "[" << getTime() << "] " <<  message << std::endl;
+    pthread_mutex_unlock(&log_mutex);
 }
 
 std::string getTime() {
     std::time_t      t   = std::time(0);
-    std::tm         *now = std::localtime(&t);
+    std::tm          tm;
+    std::tm         *now = localtime_r(&t, &tm);
     std::stringstream ss;
 
     if (!now) {
@@ -47,7 +57,8 @@ std::string getTime() {
 
 std::string getCurrentTimestamp() {
     std::time_t       t   = std::time(0);
-    std::tm          *now = std::localtime(&t);
+    std::tm           tm;
+    std::tm          *now = localtime_r(&t, &tm);
     std::stringstream ss;
 
     if (!now) {
@@ -2,7 +2,7 @@
 #include "../include/parsing.hpp"
 #include "../include/config.hpp"
 #include "../include/logging.hpp"
-#include "../include/server.hpp"
+#include "../include/master.hpp"
 
 #ifndef CONFIG_FILE
 #define CONFIG_FILE "config/webserv.conf"
@@ -26,12 +26,8 @@ int main(int argc, char *argv[]) {
         std::cerr << e.what() << std::endl;
         return (EXIT_FAILURE);
     }
-        // Initialize server
-        HttpServer httpServer(httpConfig);
 
-        // Start the server
-        httpServer.start();
-    
-
-    return (EXIT_SUCCESS);
+    // Fork the workers, or serve from this process when there is only one
+    MasterProcess master(httpConfig);
+    return (master.run());
 }
@@ -0,0 +1,132 @@
+#include "../include/master.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "../include/server.hpp"
+
+MasterProcess::MasterProcess(const HttpConfig &config, WorkerFunction worker)
+    : config_(config), worker_(worker), stopping_(false), failures_(0) {
+    sigemptyset(&signal_mask_);
+    sigaddset(&signal_mask_, SIGCHLD);
+    sigaddset(&signal_mask_, SIGINT);
+    sigaddset(&signal_mask_, SIGTERM);
+    sigemptyset(&saved_mask_);
+}
+
+int MasterProcess::run() {
+    if (config_.worker_processes <= 1) {
+        return worker_(config_) == EXIT_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Block the signals before forking so none is lost, sigwait() picks them up
+    if (sigprocmask(SIG_BLOCK, &signal_mask_, &saved_mask_) == -1) {
+        Logger::instance().log("Error: Failed to block master signals");
+        return EXIT_FAILURE;
+    }
+
+    Logger::instance().log("Starting " + std::to_string(config_.worker_processes) +
+                           " worker processes");
+    for (size_t i = 0; i < config_.worker_processes; ++i) {
+        spawnWorker();
+    }
+
+    // Supervise the workers until all of them exited
+    while (!workers_.empty()) {
+        int signal = 0;
+        if (sigwait(&signal_mask_, &signal) != 0) {
+            continue;
+        }
+        if (signal == SIGCHLD) {
+            reapWorkers();
+        } else {
+            stopWorkers();
+        }
+    }
+
+    Logger::instance().log("All workers stopped");
+    return failures_ >= WORKER_RESPAWN_LIMIT ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void MasterProcess::spawnWorker() {
+    pid_t pid = fork();
+    if (pid == -1) {
+        Logger::instance().log("Error: Failed to fork worker -> " + std::string(strerror(errno)));
+        return;
+    }
+    if (pid == 0) {
+        // The worker sets up its own signal handling in HttpServer::start()
+        sigprocmask(SIG_SETMASK, &saved_mask_, NULL);
+        exit(worker_(config_));
+    }
+    workers_[pid] = std::time(NULL);
+}
+
+void MasterProcess::reapWorkers() {
+    int   status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        std::map<pid_t, long>::iterator worker = workers_.find(pid);
+        if (worker == workers_.end()) {
+            continue;
+        }
+        long spawned = worker->second;
+        workers_.erase(worker);
+
+        // A clean exit means the worker was stopped, anything else is a crash
+        if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+            continue;
+        }
+        if (WIFSIGNALED(status)) {
+            Logger::instance().log("Worker " + std::to_string(pid) + " killed by signal " +
+                                   std::to_string(WTERMSIG(status)));
+        } else {
+            Logger::instance().log("Worker " + std::to_string(pid) + " exited with status " +
+                                   std::to_string(WEXITSTATUS(status)));
+        }
+        if (stopping_) {
+            continue;
+        }
+
+        // Do not spin on a worker that fails during startup, and give up once it keeps failing
+        bool immediate = std::time(NULL) - spawned < WORKER_RESPAWN_DELAY ||
+                         (WIFEXITED(status) && WEXITSTATUS(status) == WORKER_STARTUP_FAILURE);
+        failures_      = immediate ? failures_ + 1 : 0;
+        if (failures_ >= WORKER_RESPAWN_LIMIT) {
+            Logger::instance().log("Error: Workers keep failing at startup, not respawning");
+            stopWorkers();
+            continue;
+        }
+        if (immediate) {
+            sleep(WORKER_RESPAWN_DELAY);
+        }
+        spawnWorker();
+    }
+}
+
+void MasterProcess::stopWorkers() {
+    if (!stopping_) {
+        Logger::instance().log("Stopping workers");
+    }
+    stopping_ = true;
+    for (std::map<pid_t, long>::iterator it = workers_.begin(); it != workers_.end(); ++it) {
+        kill(it->first, SIGTERM);
+    }
+}
+
+int run_worker(const HttpConfig &config) {
+    try {
+        // Initialize server
+        HttpServer httpServer(config);
+
+        // Start the server
+        httpServer.start();
+    } catch (std::exception &e) {
+        // No listener, pool or listening socket: the master must not take it for a clean stop
+        Logger::instance().log("Error: Worker failed to start -> " + std::string(e.what()));
+        return WORKER_STARTUP_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,243 @@
+#include "../include/multipart.hpp"
+
+#include <strings.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "../include/http.hpp"
+#include "../include/scanner.hpp"
+
+MultipartParser::MultipartParser() : state_(INVALID) {
+    std::fill(skip_, skip_ + 256, 1);
+}
+
+// The body is parsed as if it started with CRLF, so the first delimiter needs no special case
+MultipartParser::MultipartParser(const std::string &boundary)
+    : state_(boundary.empty() || boundary.size() > MULTIPART_BOUNDARY_MAX ? INVALID : PREAMBLE),
+      delimiter_(CRLF "--" + boundary),
+      pending_(CRLF) {
+    size_t size = delimiter_.size();
+    std::fill(skip_, skip_ + 256, size);
+    for (size_t i = 0; i + 1 < size; ++i) {
+        skip_[static_cast<unsigned char>(delimiter_[i])] = size - 1 - i;
+    }
+}
+
+MultipartParser::State MultipartParser::state() const {
+    return state_;
+}
+
+MultipartParser::State MultipartParser::feed(const char *data, size_t size, MultipartSink &sink) {
+    while (size > 0 && state_ != DONE && state_ != INVALID) {
+        bool parsed = true;
+        switch (state_) {
+            case PREAMBLE:
+            case DATA:
+                parsed = scan(data, size, sink);
+                break;
+            case DELIMITER_END:
+                parsed = delimiterEnd(data, size);
+                break;
+            case HEADERS:
+                parsed = headers(data, size, sink);
+                break;
+            default:
+                break;
+        }
+        if (!parsed) {
+            state_ = INVALID;
+        }
+    }
+    return state_;
+}
+
+// Boyer-Moore-Horspool: compare the last byte of the window first, shift by the table on a miss
+size_t MultipartParser::search(const char *data, size_t size) const {
+    size_t      length = delimiter_.size();
+    const char *last   = delimiter_.data() + length - 1;
+    for (size_t pos = 0; pos + length <= size;) {
+        unsigned char byte = data[pos + length - 1];
+        if (byte == static_cast<unsigned char>(*last) &&
+            memcmp(data + pos, delimiter_.data(), length - 1) == 0) {
+            return pos;
+        }
+        pos += skip_[byte];
+    }
+    return std::string::npos;
+}
+
+// Length of the longest tail of [data, data + size) that starts a delimiter
+size_t MultipartParser::partial(const char *data, size_t size) const {
+    const char *end   = data + size;
+    const char *begin = size >= delimiter_.size() ? end - delimiter_.size() + 1 : data;
+    while ((begin = static_cast<const char *>(memchr(begin, '\r', end - begin)))) {
+        if (memcmp(begin, delimiter_.data(), end - begin) == 0) {
+            return end - begin;
+        }
+        ++begin;
+    }
+    return 0;
+}
+
+bool MultipartParser::emit(const char *data, size_t size, MultipartSink &sink) {
+    return state_ != DATA || size == 0 || sink.partData(data, size);
+}
+
+/*
+ * Part data, or the preamble which is dropped. Bytes that cannot start a delimiter go to the sink
+ * right from the fed buffer, a tail that might is held back in pending_ until the next feed shows
+ * whether it was a delimiter or data.
+ */
+bool MultipartParser::scan(const char *&data, size_t &size, MultipartSink &sink) {
+    size_t      length = delimiter_.size();
+    size_t      taken  = size;
+    const char *window = data;
+    size_t      held   = 0;
+    if (!pending_.empty()) {
+        // A delimiter starting in the tail ends within the next length bytes
+        taken  = std::min(size, length);
+        held   = pending_.size();
+        pending_.append(data, taken);
+        window = pending_.data();
+    }
+    size_t window_size = held + taken;
+
+    size_t found = search(window, window_size);
+    if (found != std::string::npos) {
+        size_t used = found + length - held;
+        if (!emit(window, found, sink) || (state_ == DATA && !sink.partEnd())) {
+            return false;
+        }
+        pending_.clear();
+        data += used;
+        size -= used;
+        state_ = DELIMITER_END;
+        return true;
+    }
+    size_t keep = partial(window, window_size);
+    if (!emit(window, window_size - keep, sink)) {
+        return false;
+    }
+    pending_.assign(window + window_size - keep, keep);
+    data += taken;
+    size -= taken;
+    return true;
+}
+
+// "--" after a delimiter closes the body, otherwise optional whitespace and CRLF open a part
+bool MultipartParser::delimiterEnd(const char *&data, size_t &size) {
+    while (size > 0) {
+        char byte = *data++;
+        --size;
+        pending_ += byte;
+        if (pending_ == "-") {
+            continue;
+        }
+        if (pending_ == "--") {
+            pending_.clear();
+            state_ = DONE;
+            return true;
+        }
+        if (byte == '\n') {
+            // Only whitespace may come before the CRLF
+            size_t end = pending_.size() - 2;
+            if (pending_.size() < 2 || pending_[end] != '\r' ||
+                pending_.find_first_not_of(" \t") < end) {
+                return false;
+            }
+            pending_ = CRLF;
+            state_   = HEADERS;
+            return true;
+        }
+        if (byte != ' ' && byte != '\t' && byte != '\r') {
+            return false;
+        }
+        if (pending_.size() > MULTIPART_HEADERS_MAX) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Header block of a part, kept in pending_ after the CRLF ending the delimiter line until the
+// empty line
+bool MultipartParser::headers(const char *&data, size_t &size, MultipartSink &sink) {
+    size_t max   = MULTIPART_HEADERS_MAX;
+    size_t held  = pending_.size();
+    size_t taken = std::min(size, held < max + 4 ? max + 4 - held : 0);
+    pending_.append(data, taken);
+
+    size_t end = pending_.find(CRLF CRLF, held > 3 ? held - 3 : 0);
+    if (end == std::string::npos) {
+        data += taken;
+        size -= taken;
+        return pending_.size() <= max;
+    }
+    size_t used = end + 4 - held;
+    data += used;
+    size -= used;
+
+    // "name: value" lines, the name a token right before the colon
+    HttpHeaders fields;
+    for (size_t pos = 2; pos < end;) {
+        size_t      eol   = pending_.find(CRLF, pos);
+        const char *begin = pending_.data() + pos;
+        const char *colon = Scanner::instance().tokenEnd(begin, pending_.data() + eol);
+        if (colon == begin || colon == pending_.data() + eol || *colon != ':') {
+            return false;
+        }
+        const char *value     = colon + 1;
+        const char *value_end = pending_.data() + eol;
+        while (value < value_end && (*value == ' ' || *value == '\t')) {
+            ++value;
+        }
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+            --value_end;
+        }
+        fields.add(begin, colon - begin, value, value_end - value);
+        pos = eol + 2;
+    }
+    pending_.clear();
+    state_ = DATA;
+    return sink.partBegin(fields);
+}
+
+std::string MultipartParser::parameter(const std::string &value, const std::string &name) {
+    // Parameters follow the first ';', as "name=token" or "name="quoted-string""
+    size_t pos = value.find(';');
+    while (pos != std::string::npos) {
+        size_t start  = value.find_first_not_of(" \t", pos + 1);
+        size_t equals = value.find_first_of("=;", start);
+        if (start == std::string::npos || equals == std::string::npos || value[equals] == ';') {
+            pos = equals;
+            continue;
+        }
+        size_t key_end = value.find_last_not_of(" \t", equals - 1) + 1;
+        bool   match   = key_end - start == name.size() &&
+                     strncasecmp(value.c_str() + start, name.c_str(), name.size()) == 0;
+
+        std::string result;
+        size_t      begin = value.find_first_not_of(" \t", equals + 1);
+        if (begin != std::string::npos && value[begin] == '"') {
+            size_t i = begin + 1;
+            for (; i < value.size() && value[i] != '"'; ++i) {
+                if (value[i] == '\\' && i + 1 < value.size()) {
+                    ++i;
+                }
+                result += value[i];
+            }
+            pos = value.find(';', i);
+        } else {
+            pos = value.find(';', equals);
+            if (begin != std::string::npos && begin < pos) {
+                size_t end = value.find_last_not_of(" \t", pos == std::string::npos ? pos : pos - 1);
+                result     = value.substr(begin, end + 1 - begin);
+            }
+        }
+        if (match) {
+            return result;
+        }
+    }
+    return "";
+}
@@ -152,20 +152,56 @@ bool Parser::setPid() {
 bool Parser::setWorkerProcesses() {
     validateFirstToken("worker_processes");
     std::string num = *it;
+    if (num == "auto") {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        httpConfig.worker_processes = cpus > 0 ? cpus : 1;
+        validateLastToken("worker_processes");
+        return true;
+    }
     for (size_t i = 0; i < num.length(); i++) {
         if (!isdigit(num[i]) || num.length() > 10) {
             throw std::invalid_argument("Invalid worker_processes: " + num);
         }
     }
-    if (stoi(num) != 1) {
-        throw std::invalid_argument("Invalid worker_processes: this webserv is not multi threaded");
+    int workers = stoi(num);
+    if (workers < 1 || workers > MAX_WORKER_PROCESSES) {
+        throw std::invalid_argument("Invalid worker_processes: " + num);
     }
+    httpConfig.worker_processes = workers;
     validateLastToken("worker_processes");
     return true;
 }
 
+// thread_pool default [threads=N] [max_queue=N];
+bool Parser::setThreadPool() {
+    validateFirstToken("thread_pool");
+    if (*it != "default") {
+        throw std::invalid_argument("Invalid thread_pool: only the default pool is supported");
+    }
+    while (++it != tokens.end() && *it != ";") {
+        size_t      eq    = (*it).find('=');
+        std::string name  = (*it).substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : (*it).substr(eq + 1);
+        if (value.empty() || value.size() > 9 || value.find_first_not_of("0123456789") != value.npos) {
+            throw std::invalid_argument("Invalid thread_pool parameter: " + *it);
+        }
+        size_t num = std::strtoul(value.c_str(), NULL, 10);
+        if (name == "threads" && num <= MAX_POOL_THREADS) {
+            httpConfig.thread_pool_threads = num;
+        } else if (name == "max_queue") {
+            httpConfig.thread_pool_max_queue = num;
+        } else {
+            throw std::invalid_argument("Invalid thread_pool parameter: " + *it);
+        }
+    }
+    if (it == tokens.end()) {
+        throw std::invalid_argument("Error: missing ; after thread_pool");
+    }
+    return true;
+}
+
 bool Parser::setGlobalSetting() {
-    std::string List[] = {"error_log", "pid", "worker_processes"};
+    std::string List[] = {"error_log", "pid", "worker_processes", "thread_pool"};
     switch (getSetting(List, sizeof(List) / sizeof(List[0]))) {
         case 0:
             return setErrorLog();
@@ -173,6 +209,8 @@ bool Parser::setGlobalSetting() {
             return setPid();
         case 2:
             return setWorkerProcesses();
+        case 3:
+            return setThreadPool();
         default:
             throw std::invalid_argument("Invalid setting in global context: " + *it);
     }
@@ -188,10 +226,12 @@ bool Parser::setEventsContext() {
 }
 
 bool Parser::setEventsSetting() {
-    std::string List[] = {"worker_connections"};
+    std::string List[] = {"worker_connections", "use"};
     switch (getSetting(List, sizeof(List) / sizeof(List[0]))) {
         case 0:
             return setWorkerConnections();
+        case 1:
+            return setEventMethod();
         default:
             throw std::invalid_argument("Invalid setting: " + *it);
     }
@@ -209,10 +249,24 @@ bool Parser::setWorkerConnections() {
     if (num > OPEN_MAX) {
         throw std::invalid_argument("worker_connections value over limit: " + *it);
     }
+    if (num < 1) {
+        throw std::invalid_argument("Invalid worker_connections: " + *it);
+    }
+    httpConfig.worker_connections = num;
     validateLastToken("worker_connections");
     return true;
 }
 
+bool Parser::setEventMethod() {
+    validateFirstToken("use");
+    if (*it != "epoll" && *it != "kqueue" && *it != "io_uring") {
+        throw std::invalid_argument("Invalid event method: " + *it);
+    }
+    httpConfig.event_method = *it;
+    validateLastToken("use");
+    return true;
+}
+
 bool Parser::setHttpContext() {
     if (context.back() != 0) {
         throw std::logic_error("Http context needs to be global.");
@@ -257,7 +311,9 @@ bool Parser::setHttpUploadDirectory() {
 }
 
 bool Parser::setHttpSetting() {
-    std::string List[] = {"index", "error_page", "client_max_body_size", "upload_dir"};
+    std::string List[] = {"index", "error_page", "client_max_body_size", "upload_dir",
+        "client_header_timeout", "client_body_timeout", "keepalive_timeout", "send_timeout",
+        "keepalive_requests", "client_body_buffer_size", "large_client_header_buffers"};
     switch (getSetting(List, sizeof(List) / sizeof(List[0]))) {
         case 0:
             return setIndex();
@@ -267,11 +323,120 @@ bool Parser::setHttpSetting() {
             return setHttpClientBodySize();
         case 3:
             return setHttpUploadDirectory();
+        case 4:
+            return setTimeout("client_header_timeout", httpConfig.client_header_timeout);
+        case 5:
+            return setTimeout("client_body_timeout", httpConfig.client_body_timeout);
+        case 6:
+            return setTimeout("keepalive_timeout", httpConfig.keepalive_timeout);
+        case 7:
+            return setTimeout("send_timeout", httpConfig.send_timeout);
+        case 8:
+            return setKeepaliveRequests();
+        case 9:
+            return setClientBodyBufferSize();
+        case 10:
+            return setLargeClientHeaderBuffers();
         default:
             throw std::invalid_argument("Invalid setting in Http context: " + *it);
     }
 }
 
+bool Parser::setTimeout(const std::string &setting, size_t &timeout) {
+    validateFirstToken(setting);
+    std::string value  = *it;
+    size_t      end    = value.find_first_not_of("0123456789");
+    size_t      digits = end == value.npos ? value.size() : end;
+    // At most 10 digits like keepalive_requests, strtoul() would saturate past that
+    if (digits == 0 || digits > 10) {
+        throw std::logic_error("Invalid " + setting + ": " + value);
+    }
+    size_t      num  = std::strtoul(value.substr(0, end).c_str(), NULL, 10);
+    std::string unit = end == value.npos ? "s" : value.substr(end);
+    size_t      multiplier;
+    if (unit == "ms") {
+        multiplier = 1;
+    } else if (unit == "s") {
+        multiplier = 1000;
+    } else if (unit == "m") {
+        multiplier = 60 * 1000;
+    } else if (unit == "h") {
+        multiplier = 60 * 60 * 1000;
+    } else {
+        throw std::logic_error("Invalid " + setting + ": " + value);
+    }
+    // In milliseconds the timeout has to fit an int, about 24 days
+    if (num > INT_MAX / multiplier) {
+        throw std::logic_error("Invalid " + setting + ": " + value);
+    }
+    timeout = num * multiplier;
+    validateLastToken(setting);
+    return true;
+}
+
+bool Parser::setKeepaliveRequests() {
+    validateFirstToken("keepalive_requests");
+    int size = (*it).length();
+    for (int i = 0; i < size; i++) {
+        if (!isdigit((*it)[i]) || size > 10) {
+            throw std::invalid_argument("Invalid keepalive_requests: " + *it);
+        }
+    }
+    size_t num = std::strtoul((*it).c_str(), NULL, 10);
+    if (num < 1) {
+        throw std::invalid_argument("Invalid keepalive_requests: " + *it);
+    }
+    httpConfig.keepalive_requests = num;
+    validateLastToken("keepalive_requests");
+    return true;
+}
+
+// Byte count with an optional k or m suffix, as in "16k"
+static bool parseSize(std::string value, size_t &size) {
+    size_t multiplier = 1;
+    if (!value.empty() && (value[value.size() - 1] == 'k' || value[value.size() - 1] == 'K')) {
+        multiplier = 1024;
+    } else if (!value.empty() && (value[value.size() - 1] == 'm' || value[value.size() - 1] == 'M')) {
+        multiplier = 1024 * 1024;
+    }
+    if (multiplier != 1) {
+        value.erase(value.size() - 1);
+    }
+    if (value.empty() || value.size() > 6 || value.find_first_not_of("0123456789") != value.npos) {
+        return false;
+    }
+    size = std::strtoul(value.c_str(), NULL, 10) * multiplier;
+    return true;
+}
+
+bool Parser::setClientBodyBufferSize() {
+    validateFirstToken("client_body_buffer_size");
+    if (!parseSize(*it, httpConfig.client_body_buffer_size)) {
+        throw std::invalid_argument("Invalid client_body_buffer_size: " + *it);
+    }
+    validateLastToken("client_body_buffer_size");
+    return true;
+}
+
+// "large_client_header_buffers number size", no request line or header line may exceed size
+// and the whole header block has to fit in number * size
+bool Parser::setLargeClientHeaderBuffers() {
+    validateFirstToken("large_client_header_buffers");
+    std::string number = *it;
+    if (number.empty() || number.size() > 4 || number.find_first_not_of("0123456789") != number.npos ||
+        std::strtoul(number.c_str(), NULL, 10) < 1) {
+        throw std::invalid_argument("Invalid large_client_header_buffers: " + number);
+    }
+    httpConfig.large_client_header_buffers = std::strtoul(number.c_str(), NULL, 10);
+    validateFirstToken("large_client_header_buffers");
+    if (!parseSize(*it, httpConfig.large_client_header_buffer_size) ||
+        httpConfig.large_client_header_buffer_size < 1) {
+        throw std::invalid_argument("Invalid large_client_header_buffers: " + *it);
+    }
+    validateLastToken("large_client_header_buffers");
+    return true;
+}
+
 bool Parser::setErrorPages(std::map<int, std::string> &context_map) {
     validateFirstToken("error_page");
     std::vector<int> errors;
@@ -424,10 +589,55 @@ bool Parser::setListen() {
         num                                = num.substr(num.find(":") + 1);
         (httpConfig.servers.back()).listen = std::make_pair(address, retrievePort(num));
     }
-    validateLastToken("listen");
+    while (++it != tokens.end() && *it != ";") {
+        setListenParameter(*it);
+    }
+    if (it == tokens.end()) {
+        throw std::invalid_argument("Error: missing ; after listen");
+    }
     return (true);
 }
 
+// Value of a "name=N" listen parameter within [1, max], sizes may end with k or m
+static int listenValue(const std::string &param, size_t name_length, long max, bool size) {
+    std::string value      = param.substr(name_length);
+    long        multiplier = 1;
+    if (size && !value.empty()) {
+        char unit = value[value.size() - 1];
+        if (unit == 'k' || unit == 'K') {
+            multiplier = 1024;
+        } else if (unit == 'm' || unit == 'M') {
+            multiplier = 1024 * 1024;
+        }
+        if (multiplier != 1) {
+            value.erase(value.size() - 1);
+        }
+    }
+    if (value.empty() || value.size() > 9 || value.find_first_not_of("0123456789") != value.npos ||
+        std::atol(value.c_str()) < 1 || std::atol(value.c_str()) * multiplier > max) {
+        throw std::logic_error("Error: invalid value for listen: " + param);
+    }
+    return std::atol(value.c_str()) * multiplier;
+}
+
+// Parameters following the address of a listen directive
+void Parser::setListenParameter(const std::string &param) {
+    ServerConfig &server = httpConfig.servers.back();
+    if (param.compare(0, 8, "backlog=") == 0) {
+        server.backlog = listenValue(param, 8, 65535, false);
+    } else if (param == "deferred") {
+        server.deferred = true;
+    } else if (param.compare(0, 9, "fastopen=") == 0) {
+        server.fastopen = listenValue(param, 9, 65535, false);
+    } else if (param.compare(0, 7, "rcvbuf=") == 0) {
+        server.rcvbuf = listenValue(param, 7, INT_MAX, true);
+    } else if (param.compare(0, 7, "sndbuf=") == 0) {
+        server.sndbuf = listenValue(param, 7, INT_MAX, true);
+    } else {
+        throw std::logic_error("Error: invalid parameter for listen: " + param);
+    }
+}
+
 bool Parser::isValidIPAddress(const std::string &ip) {
     std::regex pattern(
         "^([01]?\\d\\d?|2[0-4]\\d|25[0-5])\\."
@@ -498,7 +708,7 @@ bool Parser::setLocationUploadDirectory(std::string &uri) {
 
 bool Parser::setLocationSetting(std::string uri) {
     std::string List[] = {"root", "cgi:", "autoindex", "error_page", "limit_except",
-        "client_max_body_size","return", "upload_dir"};
+        "client_max_body_size","return", "upload_dir", "sendfile", "tcp_nodelay", "tcp_nopush"};
     switch (getSetting(List, sizeof(List) / sizeof(List[0]))) {
         case 0:
             return setLocationRoot(uri);
@@ -516,6 +726,12 @@ bool Parser::setLocationSetting(std::string uri) {
             return setLocationRedirect(uri);
         case 7:
             return setLocationUploadDirectory(uri);
+        case 8:
+            return setLocationFlag("sendfile", httpConfig.servers.back().locations[uri].sendfile);
+        case 9:
+            return setLocationFlag("tcp_nodelay", httpConfig.servers.back().locations[uri].tcp_nodelay);
+        case 10:
+            return setLocationFlag("tcp_nopush", httpConfig.servers.back().locations[uri].tcp_nopush);
         default:
             throw std::logic_error("Invalid setting for location: " + *it);
     }
@@ -552,9 +768,10 @@ bool Parser::setLocationUri() {
         throw std::logic_error("Invalid syntax for location: " + *it);
     }
     (httpConfig.servers.back()).locations[uri] = LocationConfig();
-    (httpConfig.servers.back()).locations[uri].limit_except.push_back(1);
-    (httpConfig.servers.back()).locations[uri].limit_except.push_back(2);
-    (httpConfig.servers.back()).locations[uri].limit_except.push_back(3);
+    (httpConfig.servers.back()).locations[uri].limit_except.push_back(GET);
+    (httpConfig.servers.back()).locations[uri].limit_except.push_back(POST);
+    (httpConfig.servers.back()).locations[uri].limit_except.push_back(DELETE);
+    (httpConfig.servers.back()).locations[uri].limit_except.push_back(HEAD);
     while (*++it != "}") {
         setLocationSetting(uri);
     }
@@ -586,18 +803,27 @@ bool Parser::setAutoIndex(std::string &uri) {
     return true;
 }
 
+// "setting on|off;"
+bool Parser::setLocationFlag(const std::string &setting, bool &flag) {
+    validateFirstToken(setting);
+    if (*it != "on" && *it != "off")
+        throw std::logic_error("Error: wrong value for " + setting + ": " + *it);
+    flag = (*it == "on");
+    validateLastToken(setting);
+    return true;
+}
+
 bool Parser::setLimitExcept(std::string &uri) {
     validateFirstToken("limit_except");
     (httpConfig.servers.back()).locations[uri].limit_except.clear();
     while (it != tokens.end() &&  *it != ";") {
-        if (*it == "GET")
-            (httpConfig.servers.back()).locations[uri].limit_except.push_back(1);
-        else if (*it == "POST")
-            (httpConfig.servers.back()).locations[uri].limit_except.push_back(2);
-        else if (*it == "DELETE")
-            (httpConfig.servers.back()).locations[uri].limit_except.push_back(3);
-        else
+        HttpMethod method = HttpRequest::method((*it).data(), (*it).size());
+        if (method == UNKNOWN)
             throw std::logic_error("Error: wrong method (" +*it + ") for location " + uri);
+        (httpConfig.servers.back()).locations[uri].limit_except.push_back(method);
+        // Like GET, HEAD only reads
+        if (method == GET)
+            (httpConfig.servers.back()).locations[uri].limit_except.push_back(HEAD);
         *it++;
     }
     return true;
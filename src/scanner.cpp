@@ -0,0 +1,240 @@
+#include "../include/scanner.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCANNER_X86
+#include <immintrin.h>
+#endif
+
+// RFC 9110 tchar: ALPHA, DIGIT and "!#$%&'*+-.^_`|~"
+struct TokenTable {
+    TokenTable() {
+        for (int c = 0; c < 256; ++c) {
+            chars[c] = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+        }
+        for (const char *special = "!#$%&'*+-.^_`|~"; *special; ++special) {
+            chars[static_cast<unsigned char>(*special)] = true;
+        }
+    }
+
+    bool chars[256];
+};
+
+static const TokenTable tokens;
+
+static const char *lineEndScalar(const char *begin, const char *end) {
+    while (begin < end && *begin != '\n') {
+        ++begin;
+    }
+    return begin;
+}
+
+static const char *tokenEndScalar(const char *begin, const char *end) {
+    while (begin < end && tokens.chars[static_cast<unsigned char>(*begin)]) {
+        ++begin;
+    }
+    return begin;
+}
+
+static const char *targetEndScalar(const char *begin, const char *end) {
+    while (begin < end && static_cast<unsigned char>(*begin) > ' ' && *begin != 0x7f) {
+        ++begin;
+    }
+    return begin;
+}
+
+#ifdef SCANNER_X86
+
+/*
+ * The vector loops only load whole blocks inside [begin, end). When less than a block is left
+ * and the range holds at least one, the last block is loaded ending at end and the bits of the
+ * bytes already scanned are shifted out, only ranges shorter than a block go to the scalar loops.
+ * Token scans test the common characters (letters, digits and '-') in bulk and look the first
+ * other byte up in the table, a rare token character like '_' resumes the scan right after it.
+ */
+
+// Block of [begin, end) to load next, NULL once the scalar loop has to finish the range
+static const char *nextBlock(const char *start, const char *begin, const char *end, long width) {
+    if (end - begin >= width) {
+        return begin;
+    }
+    return end - start >= width ? end - width : NULL;
+}
+
+__attribute__((target("sse2"))) static unsigned lineMask(const char *block) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')));
+}
+
+__attribute__((target("sse2"))) static unsigned tokenMask(const char *block) {
+    __m128i bytes  = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block));
+    __m128i folded = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)),
+                                   _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), folded));
+    __m128i digit  = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)),
+                                   _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), bytes));
+    __m128i common = _mm_or_si128(_mm_or_si128(letter, digit),
+                                  _mm_cmpeq_epi8(bytes, _mm_set1_epi8('-')));
+    return ~_mm_movemask_epi8(common) & 0xffff;
+}
+
+__attribute__((target("sse2"))) static unsigned targetMask(const char *block) {
+    __m128i bytes   = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block));
+    // Unsigned bytes <= ' ' are left unchanged by the minimum with ' '
+    __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(bytes, _mm_set1_epi8(' ')), bytes);
+    return _mm_movemask_epi8(_mm_or_si128(control, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(0x7f))));
+}
+
+__attribute__((target("avx2"))) static unsigned lineMaskAvx2(const char *block) {
+    __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n')));
+}
+
+__attribute__((target("avx2"))) static unsigned tokenMaskAvx2(const char *block) {
+    __m256i bytes  = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+    __m256i folded = _mm256_or_si256(bytes, _mm256_set1_epi8(0x20));
+    __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(folded, _mm256_set1_epi8('a' - 1)),
+                                      _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), folded));
+    __m256i digit  = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('0' - 1)),
+                                      _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), bytes));
+    __m256i common = _mm256_or_si256(_mm256_or_si256(letter, digit),
+                                     _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('-')));
+    return ~static_cast<unsigned>(_mm256_movemask_epi8(common));
+}
+
+__attribute__((target("avx2"))) static unsigned targetMaskAvx2(const char *block) {
+    __m256i bytes   = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+    __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(bytes, _mm256_set1_epi8(' ')), bytes);
+    return _mm256_movemask_epi8(
+        _mm256_or_si256(control, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(0x7f))));
+}
+
+// First byte of [begin, end) whose bit is set in mask(), width bytes per block
+#define SCAN_BLOCKS(mask, width, scalar)                                       \
+    const char *start = begin;                                                 \
+    const char *block;                                                         \
+    while (begin < end && (block = nextBlock(start, begin, end, width))) {     \
+        unsigned found = mask(block) >> (begin - block);                       \
+        if (found) {                                                           \
+            return begin + __builtin_ctz(found);                               \
+        }                                                                      \
+        begin = block + width;                                                 \
+    }                                                                          \
+    return scalar(begin, end)
+
+// The same for tokens, where a set bit is only a candidate checked against the table
+#define SCAN_TOKEN_BLOCKS(mask, width, scalar)                                 \
+    const char *start = begin;                                                 \
+    const char *block;                                                         \
+    while (begin < end && (block = nextBlock(start, begin, end, width))) {     \
+        unsigned other = mask(block) >> (begin - block);                       \
+        if (!other) {                                                          \
+            begin = block + width;                                             \
+            continue;                                                          \
+        }                                                                      \
+        begin += __builtin_ctz(other);                                         \
+        if (!tokens.chars[static_cast<unsigned char>(*begin)]) {               \
+            return begin;                                                      \
+        }                                                                      \
+        ++begin;                                                               \
+    }                                                                          \
+    return scalar(begin, end)
+
+__attribute__((target("sse2"))) static const char *lineEndSse2(const char *begin,
+                                                               const char *end) {
+    SCAN_BLOCKS(lineMask, 16, lineEndScalar);
+}
+
+__attribute__((target("sse2"))) static const char *tokenEndSse2(const char *begin,
+                                                                const char *end) {
+    SCAN_TOKEN_BLOCKS(tokenMask, 16, tokenEndScalar);
+}
+
+__attribute__((target("sse2"))) static const char *targetEndSse2(const char *begin,
+                                                                 const char *end) {
+    SCAN_BLOCKS(targetMask, 16, targetEndScalar);
+}
+
+__attribute__((target("avx2"))) static const char *lineEndAvx2(const char *begin,
+                                                               const char *end) {
+    SCAN_BLOCKS(lineMaskAvx2, 32, lineEndSse2);
+}
+
+__attribute__((target("avx2"))) static const char *tokenEndAvx2(const char *begin,
+                                                                const char *end) {
+    SCAN_TOKEN_BLOCKS(tokenMaskAvx2, 32, tokenEndSse2);
+}
+
+__attribute__((target("avx2"))) static const char *targetEndAvx2(const char *begin,
+                                                                 const char *end) {
+    SCAN_BLOCKS(targetMaskAvx2, 32, targetEndSse2);
+}
+
+#endif
+
+Scanner::Scanner(Level level) {
+    setLevel(level);
+}
+
+const char *Scanner::lineEnd(const char *begin, const char *end) const {
+    return line_end_(begin, end);
+}
+
+const char *Scanner::tokenEnd(const char *begin, const char *end) const {
+    return token_end_(begin, end);
+}
+
+const char *Scanner::targetEnd(const char *begin, const char *end) const {
+    return target_end_(begin, end);
+}
+
+Scanner::Level Scanner::level() const {
+    return level_;
+}
+
+void Scanner::setLevel(Level level) {
+    Level supported = detect();
+    level_          = level < supported ? level : supported;
+    line_end_   = lineEndScalar;
+    token_end_  = tokenEndScalar;
+    target_end_ = targetEndScalar;
+#ifdef SCANNER_X86
+    if (level_ == SSE2) {
+        line_end_   = lineEndSse2;
+        token_end_  = tokenEndSse2;
+        target_end_ = targetEndSse2;
+    } else if (level_ == AVX2) {
+        line_end_   = lineEndAvx2;
+        token_end_  = tokenEndAvx2;
+        target_end_ = targetEndAvx2;
+    }
+#endif
+}
+
+const char *Scanner::name() const {
+    switch (level_) {
+        case SSE2:
+            return "sse2";
+        case AVX2:
+            return "avx2";
+        default:
+            return "scalar";
+    }
+}
+
+Scanner::Level Scanner::detect() {
+#ifdef SCANNER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return SSE2;
+    }
+#endif
+    return SCALAR;
+}
+
+Scanner &Scanner::instance() {
+    static Scanner scanner_instance(detect());
+    return scanner_instance;
+}
@@ -1,21 +1,64 @@
 #include "../include/server.hpp"
 #include <exception>
 #include <string>
+#include <strings.h>
 #include "../include/cgi.hpp"
 
 extern HttpConfig httpConfig;
 
-HttpServer::HttpServer(HttpConfig httpConfig, SocketGenerator socket_generator)
-    : socket_generator_(socket_generator), config_(httpConfig) {}
+HttpServer::HttpServer(HttpConfig httpConfig, EventListener *listener,
+                       SocketGenerator socket_generator)
+    : socket_generator_(socket_generator),
+      connections_(0),
+      accepting_(true),
+      accept_throttled_(false),
+      batch_(0),
+      listener_(listener),
+      owns_listener_(listener == NULL),
+      timers_(monotonicMillis()),
+      config_(httpConfig),
+      pool_(NULL) {
+    // Room for every session plus the listening sockets and a few stray fds, grown past that
+    size_t max_fds = config_.worker_connections + config_.servers.size() + 16;
+    fds_.resize(max_fds);
+    if (socket_generator_ == tcp_socket_generator) {
+        // Accepting up to worker_connections sessions takes nothing from the allocator
+        TcpSession::reserve(config_.worker_connections);
+    }
+
+    if (owns_listener_) {
+        listener_ = event_listener_generator(config_.event_method, max_fds);
+    }
+
+    // Without threads file I/O runs in the event loop
+    if (config_.thread_pool_threads > 0) {
+        try {
+            pool_ = new ThreadPool(config_.thread_pool_threads, config_.thread_pool_max_queue);
+        } catch (std::exception &e) {
+            Logger::instance().log(std::string(e.what()) + ", file I/O stays in the event loop");
+        }
+    }
+}
 
-HttpServer::~HttpServer() {}
+HttpServer::~HttpServer() {
+    // Joins the threads before anything they use goes away
+    delete pool_;
+    if (owns_listener_) {
+        delete listener_;
+    }
+}
 
 void HttpServer::start(bool run_server) {
     Logger::instance().log("Starting server");
 
     // Set up signal handlers
-    listener_.registerEvent(SIGINT, SIGNAL_EVENT);
-    listener_.registerEvent(SIGTERM, SIGNAL_EVENT);
+    listener_->registerEvent(SIGINT, SIGNAL_EVENT);
+    listener_->registerEvent(SIGTERM, SIGNAL_EVENT);
+
+    // Completed file I/O wakes the loop through the pool pipe
+    if (pool_) {
+        listener_->registerEvent(pool_->notifyFd(), READABLE);
+    }
 
     // Create a socket for each server in the config
     Socket *new_socket;
@@ -25,20 +68,33 @@ void HttpServer::start(bool run_server) {
             Logger::instance().log("Creating socket for server: http://" + it->listen.first + ":" +
                                    std::to_string(it->listen.second));
 
-            // Create a new socket
+            // Create a new socket, workers each bind their own to the shared port
             new_socket = socket_generator_();
+            SocketOptions options;
+            options.reuseport = config_.worker_processes > 1;
+            options.backlog   = it->backlog;
+            options.fastopen  = it->fastopen;
+            options.rcvbuf    = it->rcvbuf;
+            options.sndbuf    = it->sndbuf;
+            if (it->deferred) {
+                // Hold the connection back for up to client_header_timeout waiting for the request
+                options.defer_accept = std::max<size_t>(config_.client_header_timeout / 1000, 1);
+            }
+            new_socket->setOptions(options);
 
             // Bind the socket to the address/port
             int server_id = new_socket->bind(it->listen.first, it->listen.second);
 
-            // Listen for connections
+            // Listen for connections, accepted by the backend when it makes the socket calls
             new_socket->listen();
+            new_socket->setAsyncIo(listener_->asyncIo());
 
-            // Add the socket to the map
-            server_sockets_[server_id] = new_socket;
+            // Add the socket to the table
+            slot(server_id).socket = new_socket;
+            listen_fds_.push_back(server_id);
 
             // Add the socket to the listener
-            listener_.registerEvent(server_id, READABLE);
+            listener_->registerEvent(server_id, READABLE);
 
         } catch (std::bad_alloc &e) {
             Logger::instance().log(e.what());
@@ -48,33 +104,45 @@ void HttpServer::start(bool run_server) {
         }
     }
 
+    // Nothing to serve, let the caller tell a failed start from a stop
+    if (listen_fds_.empty()) {
+        throw std::runtime_error("Error: No server socket could be set up");
+    }
+
     // Run the server
     if (run_server == true) run();
 }
 
-bool HttpServer::stop() {
-    Logger::instance().log("Stopping server");
-
-    // Close all sockets and delete them
-    for (std::map<int, Socket *>::iterator it = server_sockets_.begin();
-         it != server_sockets_.end(); ++it) {
-        try {
-            it->second->close();
-        } catch (std::runtime_error &e) {
-            Logger::instance().log(e.what());
+// Delete the finished responses waiting for their turn, the ones still running on the pool are
+// deleted by completionHandler() once it finds their session gone
+static void dropFinished(std::deque<RequestTask *> &pending) {
+    for (std::deque<RequestTask *>::iterator it = pending.begin(); it != pending.end(); ++it) {
+        if ((*it)->done_) {
+            delete *it;
         }
-        delete it->second;
     }
+    pending.clear();
+}
 
-    // Clear the map of sockets
-    std::map<int, Session*>::iterator it = sessions_.begin();
-    if (it != sessions_.end()) {
-        for (std::map<int, Session*>::iterator it = sessions_.begin(); it != sessions_.end(); ++it) {
-            delete it->second;
+bool HttpServer::stop() {
+    Logger::instance().log("Stopping server");
+
+    // Close all sockets and delete them, along with the sessions
+    for (std::vector<FdSlot>::iterator it = fds_.begin(); it != fds_.end(); ++it) {
+        if (it->socket) {
+            try {
+                it->socket->close();
+            } catch (std::runtime_error &e) {
+                Logger::instance().log(e.what());
+            }
+            delete it->socket;
         }
+        dropFinished(it->pending);
+        delete it->session;
+        *it = FdSlot();
     }
-    sessions_.clear();
-    server_sockets_.clear();
+    listen_fds_.clear();
+    connections_ = 0;
     return true;
 }
 
@@ -83,51 +151,105 @@ void HttpServer::run() {
 
     signal(SIGINT, SIG_IGN);
     signal(SIGTERM, SIG_IGN);
+    // A peer closing early must fail the write, not kill the worker
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<Event> events;
+    events.reserve(MAX_EVENTS);
 
     // Loop forever
     while (true) {
-        // Wait for an event
-        std::pair<int, InternalEvent> event = listener_.listen();
+        // Block until a batch of events is ready or the nearest timer is due
+        listener_->listen(events, timers_.nextTimeout(monotonicMillis()));
+        ++batch_;
+
+        // Handle every event in the batch
+        for (std::vector<Event>::iterator event = events.begin(); event != events.end(); ++event) {
+            // Signals are reported by number and may collide with a socket fd
+            if (event->second == SIGNAL_EVENT) {
+                if (signalHandler(event->first))
+                    return;
+                continue;
+            }
+            if (pool_ && event->first == pool_->notifyFd()) {
+                completionHandler();
+                continue;
+            }
+            if (event->first < 0 || static_cast<size_t>(event->first) >= fds_.size()) {
+                continue;
+            }
+            FdSlot &fd = fds_[event->first];
+            if (fd.socket) {
+                connectHandler(event->first);
+                continue;
+            }
 
-        // Handle event
-        if (server_sockets_.find(event.first) != server_sockets_.end()) {
-            connectHandler(event.first);
-        } else {
-            switch (event.second) {
-                case NONE:
-                    break;
+            // Skip sessions closed earlier in the batch, their fd may already be reused
+            if (!fd.session || fd.closed_batch == batch_) {
+                continue;
+            }
+            switch (event->second) {
                 case READABLE:
-                    readableHandler(event.first);
+                    readableHandler(event->first);
                     break;
                 case WRITABLE:
-                    writableHandler(event.first);
+                    writableHandler(event->first);
                     break;
                 case ERROR_EVENT:
-                    errorHandler(event.first);
+                    errorHandler(event->first);
                     break;
-                case SIGNAL_EVENT:
-                    if (signalHandler(event.first))
-                        return;
             }
         }
+
+        // Close the sessions whose deadline passed
+        timeoutHandler();
     }
 }
 
 void HttpServer::readableHandler(int session_id) {
     // Logger::instance().log("Received request on fd: " + std::to_string(session_id));
 
+    FdSlot  &fd      = fds_[session_id];
+    Session *session = fd.session;
+
+    if (fd.linger_until) {
+        drainLingering(session_id);
+        return;
+    }
+
     // Receive the request
     try {
-        std::pair<std::string, ssize_t> partialRequest = receiveRequestChunk(session_id); //Should prolly chunk the request instead
-        if (partialRequest.second == 0 || partialRequest.second < READ_BUFFER_SIZE) {
-            sessions_[session_id]->appendToRawRequest(partialRequest.first);
-            HttpRequest request = HttpRequest(sessions_[session_id]->getRawRequest(), sessions_[session_id]);
-            HttpResponse response = handleRequest(request);
-            sessions_[session_id]->addSendQueue(response.getMessage());
-            listener_.registerEvent(session_id, WRITABLE);   
+        ssize_t received = session->recv();
+        if (received <= 0) {
+            if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (received == 0) {
+                // The client closed its connection, usually an idle persistent one
+                if (fd.pending.empty() && session->sendQueueSize() == 0) {
+                    disconnectHandler(session_id);
+                    return;
+                }
+                // It only shut down its side, answer what it sent before closing
+                fd.closing = true;
+                if (!fd.paused) {
+                    listener_->unregisterEvent(session_id, READABLE);
+                    fd.paused = true;
+                }
+                return;
+            }
+            throw std::runtime_error("Error with recv");
+        }
+        if (fd.idle) {
+            // The next request started, it gets the header timeout instead of the keep-alive one
+            fd.idle = false;
+            timers_.schedule(session_id, monotonicMillis(), config_.client_header_timeout);
         }
-        else {
-            sessions_[session_id]->appendToRawRequest(partialRequest.first);
+        processRequests(session_id);
+
+        // The header timeout covers the whole header block, the body timeout each read
+        if (fd.parser.inBody()) {
+            timers_.schedule(session_id, monotonicMillis(), config_.client_body_timeout);
         }
     } catch (std::exception &e) {
         disconnectHandler(session_id);
@@ -136,16 +258,201 @@ void HttpServer::readableHandler(int session_id) {
     // Logger::instance().log(request.first.printRequest());
 }
 
-void HttpServer::writableHandler(int session_id) {
-    if (sessions_[session_id]->send()) {
-        // listener_.unregisterEvent(session_id, WRITABLE);
+void HttpServer::processRequests(int session_id) {
+    FdSlot     &fd     = fds_[session_id];
+    RecvBuffer &buffer = fd.session->getRecvBuffer();
+
+    // Handle every complete request of the buffer, in the order they were sent
+    while (!fd.closing && fd.pending.size() < PIPELINE_MAX) {
+        HttpParser::State state = fd.parser.parse(buffer.data(), buffer.size());
+        if (state == HttpParser::INVALID) {
+            rejectRequest(session_id, fd.parser.error());
+            break;
+        }
+        if (fd.parser.bodyPending()) {
+            // The headers are in, check and place the body before parsing it
+            HttpStatus status = prepareBody(session_id);
+            if (status != OK) {
+                rejectRequest(session_id, status);
+                break;
+            }
+            continue;
+        }
+        if (state != HttpParser::COMPLETE) {
+            // Body bytes are in the request already, keep the buffer down to one read
+            buffer.consume(fd.parser.discard());
+            break;
+        }
+        // The parser copied what it needs, the buffer goes back to the pool once empty
+        HttpRequest &request   = fd.parser.request();
+        request.currentSession = fd.session;
+        buffer.consume(fd.parser.length());
+
+        ++fd.requests;
+        bool keep_alive = config_.keepalive_timeout > 0 &&
+                          fd.requests < config_.keepalive_requests && request.keepAlive();
+        fd.closing      = !keep_alive;
+
+        // File I/O goes to the pool, the loop picks the response up in completionHandler()
+        if (pool_ && !needsEventLoop(request)) {
+            RequestTask *task = new RequestTask(this, session_id, fd.generation, request, keep_alive);
+            if (pool_->post(task)) {
+                // The send timeout covers the wait for the response
+                fd.pending.push_back(task);
+                timers_.schedule(session_id, monotonicMillis(), config_.send_timeout);
+                fd.parser.reset();
+                continue;
+            }
+            delete task;
+        }
+        HttpResponse response;
+        handleRequest(request, response);
+        queueInOrder(session_id, request, response, keep_alive);
+        fd.parser.reset();
+    }
+
+    // Nothing after a request closing the connection gets an answer
+    if (fd.closing) {
+        buffer.clear();
+    }
+    if (buffer.empty()) {
+        buffer.release();
+    }
+
+    // Stop reading once the pipeline is full or closing, flushPending() resumes
+    if (!fd.paused && (fd.closing || fd.pending.size() >= PIPELINE_MAX)) {
+        listener_->unregisterEvent(session_id, READABLE);
+        fd.paused = true;
+    }
+}
+
+void HttpServer::queueInOrder(int session_id, const HttpRequest &request, HttpResponse &response,
+                              bool keep_alive) {
+    FdSlot &fd = fds_[session_id];
+    if (fd.pending.empty()) {
+        queueResponse(session_id, response, keep_alive);
+        return;
+    }
+
+    // Wait behind the responses still running on the pool
+    RequestTask *task = new RequestTask(this, session_id, fd.generation, request, keep_alive);
+    task->response_   = response;
+    task->done_       = true;
+    fd.pending.push_back(task);
+}
+
+void HttpServer::rejectRequest(int session_id, HttpStatus status) {
+    HttpResponse response;
+    response.server_ = SERVER_NAME;
+    response.status_ = status;
+    response.headers_.set(HEADER_CONTENT_LENGTH, "0");
+
+    // The rest of the stream cannot be framed anymore, close once the answer is out
+    fds_[session_id].closing = true;
+    fds_[session_id].linger  = true;
+    queueInOrder(session_id, HttpRequest(), response, false);
+}
+
+// Closing with unread input makes the kernel reset the connection, and the reset can destroy the
+// response before the client read it. Shut down the sending side instead and drain what the client
+// still sends, until it closes or for LINGERING_TIME at most
+void HttpServer::startLingering(int session_id) {
+    FdSlot &fd = fds_[session_id];
+    if (shutdown(session_id, SHUT_WR) == -1) {
+        disconnectHandler(session_id);
+        return;
+    }
+    unsigned long now = monotonicMillis();
+    fd.linger_until   = now + LINGERING_TIME;
+    listener_->unregisterEvent(session_id, WRITABLE);
+    if (fd.paused) {
+        listener_->registerEvent(session_id, READABLE);
+        fd.paused = false;
+    }
+    fd.session->getRecvBuffer().clear();
+    fd.session->getRecvBuffer().release();
+    timers_.schedule(session_id, now, LINGERING_TIMEOUT);
+}
+
+void HttpServer::drainLingering(int session_id) {
+    FdSlot     &fd       = fds_[session_id];
+    RecvBuffer &buffer   = fd.session->getRecvBuffer();
+    ssize_t     received = fd.session->recv();
+    int         error    = errno;
+    buffer.clear();
+    buffer.release();
+
+    unsigned long now = monotonicMillis();
+    if (received == 0 || (received == -1 && error != EAGAIN && error != EWOULDBLOCK) ||
+        now >= fd.linger_until) {
         disconnectHandler(session_id);
+        return;
+    }
+    timers_.schedule(session_id, now, std::min<unsigned long>(LINGERING_TIMEOUT, fd.linger_until - now));
+}
+
+void HttpServer::flushPending(int session_id) {
+    FdSlot &fd = fds_[session_id];
+
+    // Queue the responses that are ready, up to the first one still running
+    while (!fd.pending.empty() && fd.pending.front()->done_) {
+        RequestTask *task = fd.pending.front();
+        fd.pending.pop_front();
+        queueResponse(session_id, task->response_, task->keep_alive_);
+        delete task;
+    }
+
+    // Pick up the requests left in the buffer while the pipeline was full
+    if (fd.paused && !fd.closing && fd.pending.size() < PIPELINE_MAX) {
+        listener_->registerEvent(session_id, READABLE);
+        fd.paused = false;
+        try {
+            processRequests(session_id);
+        } catch (std::exception &e) {
+            disconnectHandler(session_id);
+            std::cerr << e.what() << std::endl;
+        }
+    }
+}
+
+void HttpServer::writableHandler(int session_id) {
+    FdSlot  &fd      = fds_[session_id];
+    Session *session = fd.session;
+
+    if (session->send()) {
+        if (!fd.keep_alive || (fd.closing && fd.pending.empty())) {
+            if (fd.linger && fd.pending.empty()) {
+                startLingering(session_id);
+                return;
+            }
+            disconnectHandler(session_id);
+            return;
+        }
+        listener_->unregisterEvent(session_id, WRITABLE);
+        if (!fd.pending.empty()) {
+            // Later pipelined responses are still running on the pool
+            timers_.schedule(session_id, monotonicMillis(), config_.send_timeout);
+        } else if (fd.parser.inBody()) {
+            // A 100 Continue went out, the body it asked for is on its way
+            timers_.schedule(session_id, monotonicMillis(), config_.client_body_timeout);
+        } else if (!session->getRecvBuffer().empty()) {
+            // Part of the next request already arrived
+            timers_.schedule(session_id, monotonicMillis(), config_.client_header_timeout);
+        } else {
+            // Wait for the next request on the same connection
+            fd.idle = true;
+            timers_.schedule(session_id, monotonicMillis(), config_.keepalive_timeout);
+        }
+    } else {
+        timers_.schedule(session_id, monotonicMillis(), config_.send_timeout);
     }
 }
 
 void HttpServer::errorHandler(int session_id) {
     Logger::instance().log("Error on fd: " + std::to_string(session_id));
-    return;
+
+    // Level triggered backends keep reporting the error until the fd is gone
+    disconnectHandler(session_id);
 }
 
 bool HttpServer::signalHandler(int signal) {
@@ -160,50 +467,194 @@ bool HttpServer::signalHandler(int signal) {
 void HttpServer::connectHandler(int socket_id) {
     // Logger::instance().log("Received connection on fd: " + std::to_string(socket_id));
 
-    // Accept the connection
-    Session *session = server_sockets_[socket_id]->accept();
-
-    // Create a new session
-    sessions_[session->getSockFd()] = session;
+    // Drain the backlog, up to ACCEPT_BUDGET connections so the other events get their turn
+    std::vector<int> accepted;
+    unsigned long    now = monotonicMillis();
+    for (int i = 0; i < ACCEPT_BUDGET && accepting_; ++i) {
+        errno            = 0;
+        Session *session = fds_[socket_id].socket->accept();
+        if (!session) {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                throttleAccepting(socket_id, now);
+            }
+            break;
+        }
+        accept_throttled_ = false;
+
+        // Create a new session
+        FdSlot &fd = slot(session->getSockFd());
+        fd.session      = session;
+        fd.requests     = 0;
+        fd.keep_alive   = false;
+        fd.idle         = false;
+        fd.closing      = false;
+        fd.paused       = false;
+        fd.linger       = false;
+        fd.linger_until = 0;
+        fd.parser.reset();
+        fd.parser.setBodyBuffer(config_.client_body_buffer_size);
+        fd.parser.setHeaderBuffers(config_.large_client_header_buffers,
+                                   config_.large_client_header_buffer_size);
+        ++fd.generation;
+        accepted.push_back(session->getSockFd());
+
+        // The client has client_header_timeout to send its request headers
+        timers_.schedule(session->getSockFd(), now, config_.client_header_timeout);
+
+        // Leave further connections queued in the kernel backlog once the cap is reached
+        if (++connections_ >= config_.worker_connections && accepting_) {
+            Logger::instance().log("worker_connections reached (" + std::to_string(connections_) +
+                                   "), pausing accept");
+            pauseAccepting();
+        }
+    }
 
-    // Add the session to the listener
-    listener_.registerEvent(session->getSockFd(), READABLE); /** @todo event flags */
+    // Add the new sessions to the listener
+    if (!accepted.empty()) {
+        listener_->registerEvents(accepted, READABLE);
+    }
 }
 
 void HttpServer::disconnectHandler(int session_id) {
     // Logger::instance().log("Disconnecting fd: " + std::to_string(session_id));
 
     // Remove the session from the listener
-    listener_.unregisterEvent(session_id, READABLE | WRITABLE);
+    listener_->unregisterEvent(session_id, READABLE | WRITABLE);
 
-    listener_.removeEvent(session_id);
+    listener_->removeEvent(session_id);
 
-    // Delete the session
-    delete sessions_[session_id];
+    // Cancel the session deadline
+    timers_.cancel(session_id);
 
-    // Remove the session from the map
-    sessions_.erase(session_id);
+    FdSlot &fd = fds_[session_id];
+    dropFinished(fd.pending);
+
+    // A request cut off in its body drops its spool or upload file now, not when the fd is reused
+    fd.parser.reset();
+
+    // Delete the session and remove it from the table
+    delete fd.session;
+    fd.session      = NULL;
+    fd.closed_batch = batch_;
+    if (--connections_ < config_.worker_connections) {
+        resumeAccepting();
+    }
 
     // Close the socket
     close(session_id);
 }
 
-std::pair<std::string, ssize_t> HttpServer::receiveRequestChunk(int session_id) {
-    std::pair<std::string, ssize_t> buffer_pair = sessions_[session_id]->recv(session_id);
-    return buffer_pair;
+void HttpServer::timeoutHandler() {
+    std::vector<int> expired;
+    timers_.expire(monotonicMillis(), expired);
+
+    for (std::vector<int>::iterator it = expired.begin(); it != expired.end(); ++it) {
+        if (static_cast<size_t>(*it) < fds_.size() && fds_[*it].socket) {
+            // Accept retry after throttleAccepting(), unless the cap keeps it paused
+            if (connections_ < config_.worker_connections) {
+                resumeAccepting();
+            }
+            continue;
+        }
+        if (findSession(*it)) {
+            Logger::instance().log("Timeout on fd: " + std::to_string(*it));
+            disconnectHandler(*it);
+        }
+    }
+}
+
+void HttpServer::pauseAccepting() {
+    if (!accepting_) {
+        return;
+    }
+    for (std::vector<int>::iterator it = listen_fds_.begin(); it != listen_fds_.end(); ++it) {
+        listener_->unregisterEvent(*it, READABLE);
+    }
+    accepting_ = false;
+}
+
+void HttpServer::resumeAccepting() {
+    if (accepting_) {
+        return;
+    }
+    for (std::vector<int>::iterator it = listen_fds_.begin(); it != listen_fds_.end(); ++it) {
+        listener_->registerEvent(*it, READABLE);
+    }
+    accepting_ = true;
 }
 
+void HttpServer::throttleAccepting(int socket_id, unsigned long now) {
+    // The connection stays in the backlog and the socket stays readable, retrying right away would
+    // spin on the same error: stop polling the listening sockets until the timer or a close
+    if (!accept_throttled_) {
+        Logger::instance().log("Error: Failed to accept connection -> " + std::string(strerror(errno)) +
+                               ", pausing accept");
+        accept_throttled_ = true;
+    }
+    pauseAccepting();
+    timers_.schedule(socket_id, now, ACCEPT_RETRY_MS);
+}
+
+void HttpServer::completionHandler() {
+    std::vector<ThreadTask *> completed;
+    pool_->collect(completed);
+
+    for (std::vector<ThreadTask *>::iterator it = completed.begin(); it != completed.end(); ++it) {
+        RequestTask *task = static_cast<RequestTask *>(*it);
+
+        // The session may have timed out meanwhile, and its fd been reused by a new one
+        if (findSession(task->session_id_) && fds_[task->session_id_].generation == task->generation_) {
+            task->done_ = true;
+            flushPending(task->session_id_);
+        } else {
+            delete task;
+        }
+    }
+}
+
+// The head is serialized into a buffer of its own and the body queued as the segment it already is,
+// the send queue gathers both into one writev() without copying the body next to the head
+void HttpServer::queueResponse(int session_id, HttpResponse &response, bool keep_alive) {
+    fds_[session_id].keep_alive     = keep_alive;
+    response.headers_.set(HEADER_CONNECTION, keep_alive ? "keep-alive" : "close");
+    std::string head;
+    response.writeHead(head);
+    fds_[session_id].session->setNoDelay(response.tcp_nodelay_);
+    fds_[session_id].session->setNoPush(response.tcp_nopush_);
+    fds_[session_id].session->addSendQueue(head);
+    fds_[session_id].session->addSendQueue(response.body_);
+    fds_[session_id].session->addSendQueue(response.file_);
+    listener_->registerEvent(session_id, WRITABLE);
+    timers_.schedule(session_id, monotonicMillis(), config_.send_timeout);
+}
+
+FdSlot &HttpServer::slot(int fd) {
+    // Tables are sized from worker_connections, only grow for fds beyond that
+    if (static_cast<size_t>(fd) >= fds_.size()) {
+        fds_.resize(std::max(static_cast<size_t>(fd) + 1, fds_.size() * 2));
+    }
+    return fds_[fd];
+}
+
+Session *HttpServer::findSession(int fd) {
+    if (fd < 0 || static_cast<size_t>(fd) >= fds_.size()) {
+        return NULL;
+    }
+    return fds_[fd].session;
+}
+
+
 bool isResourceRequest(HttpResponse &response, const std::string &uri) {
     if (uri.size() >= 4 && uri.substr(uri.size() - 4) == ".css") {
-        response.headers_["Content-Type"] = "text/css";
+        response.headers_.set(HEADER_CONTENT_TYPE, "text/css");
         return true;
     }
     if (uri.size() >= 3 && uri.substr(uri.size() - 3) == ".js") {
-        response.headers_["Content-Type"] = "text/javascript";
+        response.headers_.set(HEADER_CONTENT_TYPE, "text/javascript");
         return true;
     }
     if (uri.size() >= 4 && uri.substr(uri.size() - 4) == ".pdf") {
-        response.headers_["Content-Type"] = "application/pdf";
+        response.headers_.set(HEADER_CONTENT_TYPE, "application/pdf");
         return true;
     }
     return false;
@@ -241,10 +692,37 @@ bool HttpServer::buildErrorPage(HttpRequest &request, HttpResponse &response, Se
     return readFileToBody(response, filepath, location);
 }
 
+// Open a regular file for sendfile(2), -1 if it does not exist or is not a regular file
+static int openRegularFile(const std::string &filepath, struct stat &info) {
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 // Read a file into the response body
 bool HttpServer::readFileToBody(HttpResponse &response, std::string &filepath, LocationConfig *location) {
     if (!location)
         return false;
+    if (location->sendfile) {
+        // Keep the file open and let the session send it, the content never enters user space
+        struct stat info;
+        int         fd = openRegularFile(filepath + location->index_file, info);
+        if (fd == -1) {
+            fd = openRegularFile(filepath, info);
+            if (fd == -1) {
+                return false;
+            }
+        }
+        response.body_.clear();
+        response.file_ = SendSegment(fd, 0, info.st_size);
+        return true;
+    }
     std::ifstream in(filepath + location->index_file);
     if (!in) {
         in.open(filepath);
@@ -357,42 +835,16 @@ bool HttpServer::deleteMethod(HttpRequest &request, HttpResponse &response,
     return true;
 }
 
-std::string extractValue(const std::string& data, const std::string& start, const std::string& end) {
-    size_t startPos = data.find(start) + start.length();
-    size_t endPos = data.find(end, startPos);
-    if (end.empty()) {
-        endPos = data.length();
-    }
-    return data.substr(startPos, endPos - startPos);
+// File name sent by a client without its directories, empty if there is none or it is hidden
+std::string safeFileName(const std::string &filename) {
+    std::string name = filename.substr(filename.find_last_of("/\\") + 1);
+    return name.empty() || name[0] == '.' ? "" : name;
 }
 
-bool fileExists(const std::string &filePath) {
-    std::ifstream file(filePath.c_str());
-    return file.good();
-}
-
-std::string HttpServer::generateUniqueFileName(ServerConfig &server, LocationConfig *location, std::string &originalFileName) {
-    std::string base_path = getUploadDirectory(server, location) + "/";
-    std::string newFileName = base_path + originalFileName;
-    std::string nameWithoutExtension;
-    size_t dot_position;
-    bool moreThanOneChange = false;
-    int counter = 1;
-    while(fileExists(newFileName)) {
-        ++counter;
-        if (counter > 2) {
-            moreThanOneChange = true;
-        }
-        dot_position = newFileName.find('.');
-        nameWithoutExtension = newFileName.substr(0, dot_position);
-        if (moreThanOneChange == true) {
-            dot_position = originalFileName.find('.'); 
-            newFileName = base_path + originalFileName.substr(0, dot_position) + "_" + std::to_string(counter) + originalFileName.substr(dot_position);
-        }
-        else
-            newFileName = nameWithoutExtension + "_" + std::to_string(counter) + newFileName.substr(dot_position);
-    }
-    return (newFileName);
+// Name of the file a raw upload carries in "Content-Disposition: attachment; filename=name"
+std::string uploadFileName(const HttpRequest &request) {
+    return safeFileName(MultipartParser::parameter(
+        request.headers_.get(HEADER_CONTENT_DISPOSITION), "filename"));
 }
 
 std::string readFileContent(const std::string& filename) {
@@ -426,13 +878,13 @@ bool HttpServer::displayFile(HttpRequest& request, HttpResponse& response, Serve
 
     std::string fileContent = readFileContent(filePath);
 
-    response.headers_["Content-Type"] = "application/octet-stream";
-    response.headers_["Content-Disposition"] = "attachment; filename=\"" + filename + "\"";
+    response.headers_.set(HEADER_CONTENT_TYPE, "application/octet-stream");
+    response.headers_.set(HEADER_CONTENT_DISPOSITION, "attachment; filename=\"" + filename + "\"");
 
     response.body_ = fileContent;
 
     response.status_ = OK;
-    response.headers_["Content-Length"] = std::to_string(response.body_.size());
+    response.headers_.set(HEADER_CONTENT_LENGTH, std::to_string(response.body_.size()));
 
     return true;
 }
@@ -442,6 +894,18 @@ bool HttpServer::postMethod(HttpRequest &request, HttpResponse &response, Server
     (void)server;
     (void)location;
 
+    // A streamed upload or form is complete on disk, its files only need their names
+    if (request.upload_.isOpen()) {
+        return saveUpload(request, response, server, location);
+    }
+    if (request.form_.complete) {
+        return saveForm(request, response, server, location);
+    }
+
+    // The form handling below needs the whole body in memory
+    if (!request.loadBody()) {
+        return buildErrorPage(request, response, server, location, INTERNAL_SERVER_ERROR);
+    }
     if (request.body_.empty()) {
         return buildErrorPage(request, response, server, location, BAD_REQUEST);
     } else {
@@ -459,12 +923,13 @@ bool HttpServer::postMethod(HttpRequest &request, HttpResponse &response, Server
             }
         }
         response.status_ = OK;
-        response.headers_["Content-Type"] = "text/html";
-        response.headers_["Content-Length"] = std::to_string(response.body_.size());
+        response.headers_.set(HEADER_CONTENT_TYPE, "text/html");
+        response.headers_.set(HEADER_CONTENT_LENGTH, std::to_string(response.body_.size()));
     }
 
-    if (request.headers_["Content-Type"] == "text/plain") {
-        response.headers_["Content-Type"] = "text/plain; charset=utf-8";
+    std::string content_type = request.headers_.get(HEADER_CONTENT_TYPE);
+    if (content_type == "text/plain") {
+        response.headers_.set(HEADER_CONTENT_TYPE, "text/plain; charset=utf-8");
 
         if (true) {
             response.status_ = CREATED;
@@ -473,41 +938,9 @@ bool HttpServer::postMethod(HttpRequest &request, HttpResponse &response, Server
             return buildErrorPage(request, response, server, location, INTERNAL_SERVER_ERROR);
         }
 
-    } else if (request.headers_["Content-Type"].find("multipart/form-data") != std::string::npos) {
-
-        std::string boundary = extractValue(request.headers_["Content-Type"], "boundary=", "");
-        if (request.body_.empty()) {
-            std::cerr << "Problem uploading the file" << std::endl;
-            response.body_ = "<html><body>There was an error uploading the file<br><br><a href='/'>Return Home</a></body></html>";
-            return true;
-        }
-
-        std::string delimiter = "--" + boundary;
-        size_t pos = 0;
-        pos = request.body_.find(delimiter);
-        while (pos != std::string::npos) {
-            size_t endPos = request.body_.find(delimiter, pos + delimiter.length());
-            
-            std::string part = request.body_.substr(pos, endPos - pos);
-
-            size_t filenamePos = part.find("filename=\"");
-            if (filenamePos != std::string::npos) {
-                std::string filename = extractValue(part, "filename=\"", "\"");
-                if (filename.empty()) {
-                    break;
-                }
-                std::string realFileName = generateUniqueFileName(server, location, filename);
-                size_t contentPos = part.find("\r\n\r\n") + 4;
-                std::ofstream file(realFileName.c_str(), std::ios::binary | std::ios::app);
-                std::string content = part.substr(contentPos, part.length() - contentPos - 2);
-                file << content;
-                file.close();                
-            }
-            pos = response.body_.find(delimiter, endPos);
-        }
     }
-    else if (request.headers_["Content-Type"] == "application/x-www-form-urlencoded") {
-        response.headers_["Content-Type"] = "text/html; charset=utf-8";
+    else if (content_type == "application/x-www-form-urlencoded") {
+        response.headers_.set(HEADER_CONTENT_TYPE, "text/html; charset=utf-8");
 
         if (true) {
             response.status_ = OK;
@@ -524,15 +957,59 @@ bool HttpServer::postMethod(HttpRequest &request, HttpResponse &response, Server
     
     response.body_ = "<html><body><h2>Uploads:</h2><ul>" + fileList.str() + "</ul>" + "<a href='/'>Return Home</a></body></html>";
     response.status_ = OK;
-    response.headers_["Content-Type"] = "text/html";
-    response.headers_["Content-Length"] = std::to_string(response.body_.size());
+    response.headers_.set(HEADER_CONTENT_TYPE, "text/html");
+    response.headers_.set(HEADER_CONTENT_LENGTH, std::to_string(response.body_.size()));
+
+    return true;
+}
+
+// Move the files of a form from their temporary names to free names of the upload directory,
+// a file without a usable name is dropped with the request. This runs on pool threads, the name
+// is taken by UploadFile::commit() itself rather than looked up beforehand
+bool HttpServer::saveForm(HttpRequest &request, HttpResponse &response, ServerConfig &server,
+                          LocationConfig *location) {
+    for (std::vector<FormPart>::iterator part = request.form_.parts.begin();
+         part != request.form_.parts.end(); ++part) {
+        std::string filename = safeFileName(part->filename);
+        if (!part->file.isOpen() || filename.empty()) {
+            continue;
+        }
+        if (!part->file.commit(getUploadDirectory(server, location), filename)) {
+            return buildErrorPage(request, response, server, location, INTERNAL_SERVER_ERROR);
+        }
+    }
+
+    std::stringstream fileList;
+    uploadsFileList(server, location, fileList);
+
+    response.body_ = "<html><body><h2>Uploads:</h2><ul>" + fileList.str() + "</ul>" + "<a href='/'>Return Home</a></body></html>";
+    response.status_ = OK;
+    response.headers_.set(HEADER_CONTENT_TYPE, "text/html");
+    response.headers_.set(HEADER_CONTENT_LENGTH, std::to_string(response.body_.size()));
+    return true;
+}
+
+// Move an upload from its temporary name to a free name of the upload directory, see saveForm()
+bool HttpServer::saveUpload(HttpRequest &request, HttpResponse &response, ServerConfig &server,
+                            LocationConfig *location) {
+    std::string filename = uploadFileName(request);
+    if (!request.upload_.commit(getUploadDirectory(server, location), filename)) {
+        return buildErrorPage(request, response, server, location, INTERNAL_SERVER_ERROR);
+    }
+
+    std::stringstream fileList;
+    uploadsFileList(server, location, fileList);
 
+    response.body_ = "<html><body><h2>Uploads:</h2><ul>" + fileList.str() + "</ul>" + "<a href='/'>Return Home</a></body></html>";
+    response.status_ = CREATED;
+    response.headers_.set(HEADER_CONTENT_TYPE, "text/html");
+    response.headers_.set(HEADER_CONTENT_LENGTH, std::to_string(response.body_.size()));
     return true;
 }
 
 bool HttpServer::getMethod(HttpRequest &request, HttpResponse &response,
                            ServerConfig &server, LocationConfig *location) {
-    response.headers_["Content-Type"] = "text/html; charset=utf-8";
+    response.headers_.set(HEADER_CONTENT_TYPE, "text/html; charset=utf-8");
     if (location) {     
         if (!isResourceRequest(response, request.uri_) && location->autoindex)
             request.uri_ = request.uri_ + location->index_file;
@@ -546,16 +1023,18 @@ bool HttpServer::getMethod(HttpRequest &request, HttpResponse &response,
     return buildErrorPage(request, response, server, location, NOT_FOUND);
 }
 
-bool HttpServer::validateRequestBody(HttpRequest &request, ServerConfig &server, LocationConfig *location) {
-    size_t max = location->client_max_body_size;
-    if (location->max_body_size) {
-        max = location->client_max_body_size;
-    } else if (server.max_body_size) {
-        max = server.client_max_body_size;
-    } else if (this->config_.max_body_size) {
-        max = this->config_.client_max_body_size;
+// The innermost client_max_body_size, either may be NULL before the request is routed
+size_t HttpServer::maxBodySize(ServerConfig *server, LocationConfig *location) {
+    if (location && location->max_body_size) {
+        return location->client_max_body_size;
+    } else if (server && server->max_body_size) {
+        return server->client_max_body_size;
     }
-    return request.body_.size() <= max;
+    return this->config_.client_max_body_size;
+}
+
+bool HttpServer::validateRequestBody(HttpRequest &request, ServerConfig &server, LocationConfig *location) {
+    return request.bodySize() <= maxBodySize(&server, location);
 }
 
 bool HttpServer::isRedirect(HttpRequest &request, HttpResponse &response, std::pair<int, std::string> &redirect) {
@@ -564,14 +1043,24 @@ bool HttpServer::isRedirect(HttpRequest &request, HttpResponse &response, std::p
     response.status_ = HttpStatus(redirect.first);
     size_t pos = redirect.second.find("$request_uri");
     if (pos != std::string::npos) {
-        response.headers_["Location"] = redirect.second.substr(0, pos) + request.uri_;
+        response.headers_.set(HEADER_LOCATION, redirect.second.substr(0, pos) + request.uri_);
     } else {
-        response.headers_["Location"] = redirect.second;
+        response.headers_.set(HEADER_LOCATION, redirect.second);
     }
-    response.headers_["Content-Length"] = std::to_string(response.body_.size());
+    response.headers_.set(HEADER_CONTENT_LENGTH, std::to_string(response.body_.size()));
     return true;
 }
 
+// Location block answering the request. Resources (.css, .js, .pdf) are looked up by the page
+// that referred to them, which also tags their Content-Type on response
+LocationConfig *HttpServer::routeLocation(HttpRequest &request, HttpResponse &response,
+                                          ServerConfig &server) {
+    std::string uri = isResourceRequest(response, request.uri_)
+                          ? trimHost(request.headers_.get(HEADER_REFERER), server)
+                          : request.uri_;
+    return findLocation(uri, server);
+}
+
 // Find the appropriate location and fill the response body
 bool HttpServer::buildResponse(HttpRequest &request, HttpResponse &response,
                            ServerConfig &server) {
@@ -579,12 +1068,10 @@ bool HttpServer::buildResponse(HttpRequest &request, HttpResponse &response,
     if (isRedirect(request, response, server.redirect)) {
         return true;
     }
-    std::string uri = isResourceRequest(response, request.uri_) ? trimHost(request.headers_["Referer"], server) : request.uri_;
-    for (std::map<std::string, LocationConfig>::iterator it = server.locations.begin();
-     it != server.locations.end(); ++it) {    
-        if (uri.substr(0, it->first.size()) == it->first) {
-            location = &(it->second);
-        }
+    location = routeLocation(request, response, server);
+    if (location) {
+        response.tcp_nodelay_ = location->tcp_nodelay;
+        response.tcp_nopush_  = location->tcp_nopush;
     }
     if (!location) {
         return buildErrorPage(request, response, server, location, NOT_FOUND);
@@ -597,7 +1084,8 @@ bool HttpServer::buildResponse(HttpRequest &request, HttpResponse &response,
     } else if (!validateRequestBody(request, server, location)) {
         return buildErrorPage(request, response, server, location, CONTENT_TOO_LARGE);
     }
-    if (checkIfDirectoryRequest(request, location, server) && request.method_ == GET) {
+    if (checkIfDirectoryRequest(request, location, server) &&
+        (request.method_ == GET || request.method_ == HEAD)) {
         if (checkForIndexFile(request, location, server)) {
             handleIndexFile(request, response, location, server);
         }
@@ -621,50 +1109,151 @@ bool HttpServer::buildResponse(HttpRequest &request, HttpResponse &response,
             return postMethod(request, response, server, location);
         case 3: // Enums for comparisons is C++11...
             return deleteMethod(request, response, server, location);
-        default:
-            return false;
+        case HEAD: // Answered like GET, handleRequest() drops the body
+            return getMethod(request, response, server, location);
+        default: // Allowed by limit_except but without a handler
+            return buildErrorPage(request, response, server, location, METHOD_NOT_ALLOWED);
         }
     }
 }
 
-// Validate the host making the request is in the servers
-bool HttpServer::validateHost(HttpRequest &request, HttpResponse &response) {
-    std::string requestHost = request.headers_["Host"];  // Check if the host is valid
+// Find the last location whose prefix matches the uri
+LocationConfig *HttpServer::findLocation(const std::string &uri, ServerConfig &server) {
+    LocationConfig *location = NULL;
+    for (std::map<std::string, LocationConfig>::iterator it = server.locations.begin();
+     it != server.locations.end(); ++it) {    
+        if (uri.substr(0, it->first.size()) == it->first) {
+            location = &(it->second);
+        }
+    }
+    return location;
+}
+
+// Find the server the Host header of the request points to
+ServerConfig *HttpServer::findServer(HttpRequest &request) {
+    std::string requestHost = request.headers_.get(HEADER_HOST);  // Check if the host is valid
 
     for (std::vector<ServerConfig>::iterator it = config_.servers.begin();
          it != config_.servers.end(); ++it) {
         std::string serverHost = it->listen.first + ":" + std::to_string(it->listen.second);
         std::string localHost = "localhost:" + std::to_string(it->listen.second);
         if (requestHost == serverHost || requestHost == localHost) {
-            return buildResponse(request, response, *it);
+            return &(*it);
         }
         for (std::vector<std::string>::iterator server_name = (*it).server_names.begin();
                 server_name != (*it).server_names.end(); ++server_name) {
                     if (requestHost == *server_name + ":" + std::to_string(it->listen.second))
-                        return buildResponse(request, response, *it);
+                        return &(*it);
                 }
     }
-    return false;
+    return NULL;
 }
 
-HttpResponse HttpServer::handleRequest(HttpRequest request) {
-    HttpResponse response;
-    
-    response.version_ = HTTP_VERSION;
-    response.server_  = "webserv/0.1";
-    response.headers_["Connection"] = "Keep-Alive";
+// Validate the host making the request is in the servers
+bool HttpServer::validateHost(HttpRequest &request, HttpResponse &response) {
+    ServerConfig *server = findServer(request);
+    if (!server) {
+        return false;
+    }
+    return buildResponse(request, response, *server);
+}
+
+/*
+ * Runs once the headers of a request with a body are in, before any of the body is read. A body
+ * over client_max_body_size or an expectation other than 100-continue is answered right away, and
+ * a client waiting on "Expect: 100-continue" is told to go on, so a rejected body is never sent.
+ * Uploads naming their file and multipart forms are then written to the upload directory as they
+ * arrive, without ever holding the body in memory. Other bodies stay in the request
+ */
+HttpStatus HttpServer::prepareBody(int session_id) {
+    FdSlot         &fd       = fds_[session_id];
+    HttpParser     &parser   = fd.parser;
+    HttpRequest    &request  = parser.request();
+    ServerConfig   *server   = findServer(request);
+    HttpResponse    scratch;
+    LocationConfig *location = server ? routeLocation(request, scratch, *server) : NULL;
+
+    if (!parser.limitBody(maxBodySize(server, location))) {
+        return CONTENT_TOO_LARGE;
+    }
+    // HTTP/1.0 clients do not know Expect, it is ignored
+    if (request.headers_.has(HEADER_EXPECT) && request.version_ == "HTTP/1.1") {
+        if (strcasecmp(request.headers_.get(HEADER_EXPECT).c_str(), "100-continue") != 0) {
+            return EXPECTATION_FAILED;
+        }
+        // The interim response may not overtake responses still running on the pool, without
+        // it the client sends the body after a while anyway
+        if (fd.pending.empty()) {
+            std::string interim = HTTP_VERSION " 100 Continue" CRLF CRLF;
+            fd.session->addSendQueue(interim);
+            fd.keep_alive = true; // the final response is still to come
+            listener_->registerEvent(session_id, WRITABLE);
+        }
+    }
+
+    if (request.method_ != POST || !server) {
+        return OK;
+    }
+    std::string content_type = request.headers_.get(HEADER_CONTENT_TYPE);
+    bool        form         = content_type.find("multipart/form-data") != std::string::npos;
+    if (content_type == "application/x-www-form-urlencoded" ||
+        (!form && uploadFileName(request).empty())) {
+        return OK;
+    }
+    // Only where postMethod() will take the body, see buildResponse()
+    if (!location || isResourceRequest(scratch, request.uri_) ||
+        (location->cgi_enabled && checkUriForExtension(request.uri_, location)) ||
+        std::find(location->limit_except.begin(), location->limit_except.end(),
+                  static_cast<int>(POST)) == location->limit_except.end()) {
+        return OK;
+    }
+    bool prepared;
+    if (form) {
+        // A form without a usable boundary stays in memory, postMethod() rejects it
+        std::string boundary = MultipartParser::parameter(content_type, "boundary");
+        if (boundary.empty() || boundary.size() > MULTIPART_BOUNDARY_MAX) {
+            return OK;
+        }
+        prepared = parser.formTo(getUploadDirectory(*server, location), boundary);
+    } else {
+        prepared = parser.uploadTo(getUploadDirectory(*server, location));
+    }
+    return prepared ? OK : INTERNAL_SERVER_ERROR;
+}
+
+// CGI forks and waits for the child, it has to stay on the event loop thread
+bool HttpServer::needsEventLoop(HttpRequest &request) {
+    ServerConfig *server = findServer(request);
+    if (!server) {
+        return false;
+    }
+    HttpResponse    scratch;
+    LocationConfig *location = routeLocation(request, scratch, *server);
+    return location && location->cgi_enabled && checkUriForExtension(request.uri_, location);
+}
 
-    if (request.version_ != "HTTP/1.1") {
+// Fill response in place, the request is the parser's or the task's own and may be changed
+void HttpServer::handleRequest(HttpRequest &request, HttpResponse &response) {
+    response.server_ = SERVER_NAME;
+
+    if (request.version_ != "HTTP/1.1" && request.version_ != "HTTP/1.0") {
         response.status_ = IM_A_TEAPOT; // If this happen we ignore the request and return an empty answer
     } else if (!validateHost(request, response)) {
         response.status_                  = NOT_FOUND;
-        response.headers_["Content-Type"] = "text/html";
+        response.headers_.set(HEADER_CONTENT_TYPE, "text/html");
         response.body_ = "<html><head><style>body{display:flex;justify-content:center;align-items:center;height:100vh;margin:0;}.error-message{text-align:center;}</style></head><body><div class=\"error-message\"><h1>Homemade Webserv</h1><h1>404 Not Found</h1></div></body></html>";
     }
-    if (response.body_.size() > 0) {
-        response.headers_["content-length"] = std::to_string(response.body_.size());
+    // Always framed, the connection may carry the next response right after this one
+    if (response.file_.isFile()) {
+        response.headers_.set(HEADER_CONTENT_LENGTH, std::to_string(response.file_.size()));
+    } else {
+        response.headers_.set(HEADER_CONTENT_LENGTH, std::to_string(response.body_.size()));
+    }
+    // A HEAD response announces the length of the body it does not send
+    if (request.method_ == HEAD) {
+        response.body_.clear();
+        response.file_ = SendSegment();
     }
-    return response;
 }
 
 bool HttpServer::checkUriForExtension(std::string& uri, LocationConfig *location) const {
@@ -701,7 +1290,7 @@ void HttpServer::handleIndexFile(HttpRequest &request, HttpResponse &response, L
             tempUri.append("/");
         tempUri.append(location->index_file);
         if (readFileToBody(response, tempUri, location) == true) {
-            response.headers_["content-type"] = "text/html";
+            response.headers_.set(HEADER_CONTENT_TYPE, "text/html");
             response.status_ = OK;
         } else { //something went wrong with reading index.html file
             return ;
@@ -787,19 +1376,16 @@ void HttpServer::generateDirectoryListing(HttpRequest &request, HttpResponse &re
     if (!hasTrailingSlash(request)) {
         std::string newLocation("http://");
         std::string host;
-        std::map<std::string, std::string>::iterator it = request.headers_.find("Host");
-        if (it != request.headers_.end()) {
-            newLocation.append(it->second);
-        }
+        newLocation.append(request.headers_.get(HEADER_HOST));
         newLocation.append(request.uri_);
         newLocation.append("/");
         response.status_ = MOVED_PERMANENTLY;
-        response.headers_["Location"] = newLocation;
+        response.headers_.set(HEADER_LOCATION, newLocation);
     }
     else {
         response.status_ = OK;
     }
-    response.headers_["content-type"] = "text/html";
+    response.headers_.set(HEADER_CONTENT_TYPE, "text/html");
 
     responseBody.append("<!doctype html><html><head><title>Index of ");
     responseBody.append(request.uri_);
@@ -858,6 +1444,22 @@ bool HttpServer::hasTrailingSlash(HttpRequest &request) const {
 void HttpServer::addTrailingSlash(HttpRequest &request, HttpResponse &response) {
     std::string newUri = request.uri_;
     newUri.append("/");
-    response.headers_["Location"] = newUri;
+    response.headers_.set(HEADER_LOCATION, newUri);
     response.status_ = MOVED_PERMANENTLY;
-}
\ No newline at end of file
+}
+
+RequestTask::RequestTask(HttpServer *server, int session_id, unsigned long generation,
+                         const HttpRequest &request, bool keep_alive)
+    : server_(server),
+      session_id_(session_id),
+      generation_(generation),
+      request_(request),
+      keep_alive_(keep_alive),
+      done_(false) {
+    // The session may be gone by the time the task runs
+    request_.currentSession = NULL;
+}
+
+void RequestTask::run() {
+    server_->handleRequest(request_, response_);
+}
@@ -1,85 +1,226 @@
 #include "../include/socket.hpp"
+#include <algorithm>
 #include <stdexcept>
 
 Session::Session(int sockfd, const struct sockaddr* addr, socklen_t addrlen)
-    : rawRequest_(""), sockfd_(sockfd), addr_(addr), addrlen_(addrlen) {}
-
-Session::~Session() {
-    delete addr_;
+    : io_(NULL), sockfd_(sockfd), addrlen_(std::min<socklen_t>(addrlen, sizeof(addr_))) {
+    memset(&addr_, 0, sizeof(addr_));
+    if (addr) {
+        memcpy(&addr_, addr, addrlen_);
+    }
 }
 
+Session::~Session() {}
+
 int Session::getSockFd() const {
     return sockfd_;
 }
 
 const struct sockaddr* Session::getSockaddr() const {
-    return addr_;
+    return reinterpret_cast<const struct sockaddr*>(&addr_);
 }
 
-void Session::addSendQueue(const std::string& buffer) {
-    send_queue_.push_back(buffer);
+void Session::addSendQueue(std::string& buffer) {
+    send_queue_.push(SendSegment(buffer));
 }
 
-std::string &Session::getRawRequest() {
-    return rawRequest_;
+void Session::addSendQueue(const SendSegment& segment) {
+    send_queue_.push(segment);
 }
 
-void Session::appendToRawRequest(std::string &newChunk) {
-    rawRequest_.append(newChunk);
+size_t Session::sendQueueSize() const {
+    return send_queue_.size();
+}
+
+void Session::setNoDelay(bool) {}
+
+void Session::setNoPush(bool) {}
+
+// setsockopt() with an int value, logs the failure
+static bool setIntOption(int sockfd, int level, int option, int value, const char* name) {
+    if (setsockopt(sockfd, level, option, &value, sizeof(value)) == -1) {
+        Logger::instance().log(std::string("Error: Failed to set ") + name + " -> " +
+                               strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+RecvBuffer& Session::getRecvBuffer() {
+    return recv_buffer_;
+}
+
+void Session::setAsyncIo(AsyncIo* io) {
+    io_ = io;
+    if (io_) {
+        io_->attach(sockfd_, ASYNC_STREAM);
+    }
 }
 
 TcpSession::TcpSession(int sockfd, const struct sockaddr* addr, socklen_t addrlen)
-    : Session(sockfd, addr, addrlen) {}
+    : Session(sockfd, addr, addrlen), nodelay_(false), nopush_(false), corked_(false) {}
 
-bool TcpSession::send() {
-    if (send_queue_.empty()) {
-        return true;
+SlabPool& TcpSession::pool() {
+    static SlabPool session_pool(sizeof(TcpSession));
+    return session_pool;
+}
+
+void* TcpSession::operator new(size_t size) {
+    // Derived classes may be larger than the slab objects
+    if (size > pool().objectSize()) {
+        return ::operator new(size);
     }
+    return pool().allocate();
+}
 
-    std::string buffer     = send_queue_.front();
-    ssize_t     bytes_sent = ::send(sockfd_, buffer.c_str(), buffer.length(), MSG_DONTWAIT);
+void TcpSession::operator delete(void* session, size_t size) {
+    if (!session) {
+        return;
+    }
+    if (size > pool().objectSize()) {
+        ::operator delete(session);
+        return;
+    }
+    pool().deallocate(session);
+}
 
-    if (bytes_sent == -1) {
-        Logger::instance().log("ERROR: Failed to send to socket");
-        return false;
+void TcpSession::reserve(size_t sessions) {
+    pool().reserve(sessions);
+}
+
+void TcpSession::setNoDelay(bool on) {
+    if (on != nodelay_ && setIntOption(sockfd_, IPPROTO_TCP, TCP_NODELAY, on, "TCP_NODELAY")) {
+        nodelay_ = on;
     }
+}
 
-    send_queue_.pop_front();
+void TcpSession::setNoPush(bool on) {
+    nopush_ = on;
+}
 
-    if (static_cast<size_t>(bytes_sent) != buffer.length()) {
-        send_queue_.push_front(buffer.substr(bytes_sent));
+void TcpSession::setCork(bool on) {
+#if defined(TCP_CORK)
+    if (setIntOption(sockfd_, IPPROTO_TCP, TCP_CORK, on, "TCP_CORK")) {
+        corked_ = on;
     }
-    if (send_queue_.empty())
-        return true;
-    return false;
+#elif defined(TCP_NOPUSH)
+    if (setIntOption(sockfd_, IPPROTO_TCP, TCP_NOPUSH, on, "TCP_NOPUSH")) {
+        corked_ = on;
+    }
+#else
+    (void)on;
+#endif
 }
 
-std::pair<std::string, ssize_t> TcpSession::recv(int client) const {
-    char buffer[READ_BUFFER_SIZE];
-    ssize_t bytes_received;
-    std::ifstream ifs;
-    std::vector<char> buffer_data = std::vector<char>(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+bool TcpSession::send() {
+    // Headers and the start of the file leave in full packets, uncorking pushes the rest out
+    if (nopush_ && !corked_ && !send_queue_.empty()) {
+        setCork(true);
+    }
+
+    // Hand the socket every pending segment at once, until it is full or the queue is empty
+    while (!send_queue_.empty()) {
+        size_t  wanted;
+        ssize_t bytes_sent;
+        if (io_) {
+            // Takes the completed send and submits the next one, WRITABLE reports its completion
+            bytes_sent = io_->send(sockfd_, send_queue_, wanted);
+        } else if (send_queue_.front().isFile()) {
+            bytes_sent = sendFile(send_queue_.front(), send_queue_.sent(), wanted);
+        } else {
+            struct iovec  iov[SEND_IOV_MAX];
+            struct msghdr msg;
+            int           count;
+            memset(&msg, 0, sizeof(msg));
+            wanted         = send_queue_.gather(iov, SEND_IOV_MAX, count);
+            msg.msg_iov    = iov;
+            msg.msg_iovlen = count;
+            bytes_sent     = ::sendmsg(sockfd_, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return false;
+            }
+            // The peer is gone, nothing queued can be delivered anymore
+            Logger::instance().log("Error: Failed to send to socket -> " + std::string(strerror(errno)));
+            send_queue_.clear();
+            return true;
+        }
+        if (bytes_sent == 0) {
+            // The file got shorter than the Content-Length already sent
+            Logger::instance().log("Error: File truncated while sending it");
+            send_queue_.clear();
+            return true;
+        }
+
+        send_queue_.consume(bytes_sent);
+        if (static_cast<size_t>(bytes_sent) < wanted && !io_) {
+            return false;
+        }
+    }
+    if (corked_) {
+        setCork(false);
+    }
+    return true;
+}
+
+ssize_t TcpSession::sendFile(const SendSegment& segment, size_t sent, size_t& wanted) {
+    off_t offset = segment.offset() + sent;
+    wanted       = segment.size() - sent;
+#ifdef __linux__
+    return ::sendfile(sockfd_, segment.fd(), &offset, wanted);
+#else
+    // No portable sendfile(2), go through a bounded buffer instead
+    char    buffer[SEND_FILE_BUFFER_SIZE];
+    ssize_t bytes_read = pread(segment.fd(), buffer, std::min(wanted, sizeof(buffer)), offset);
+    if (bytes_read <= 0) {
+        return bytes_read;
+    }
+    wanted = bytes_read;
+    return ::send(sockfd_, buffer, bytes_read, MSG_DONTWAIT | MSG_NOSIGNAL);
+#endif
+}
 
-    bytes_received = ::recv(client, buffer, READ_BUFFER_SIZE, 0);
+ssize_t TcpSession::recv() {
+    ssize_t bytes_received;
+    if (io_) {
+        // The backend already received into its own buffers, take what arrived
+        bytes_received = io_->recv(sockfd_, recv_buffer_);
+    } else {
+        bytes_received = ::recv(sockfd_, recv_buffer_.reserve(READ_BUFFER_SIZE), READ_BUFFER_SIZE, 0);
+    }
     if (bytes_received > 0) {
-        for (ssize_t i = 0; i < bytes_received; ++i) {
-            buffer_data.push_back(buffer[i]);
-        }  
+        if (!io_) {
+            recv_buffer_.commit(bytes_received);
+        }
+    } else if (recv_buffer_.empty()) {
+        // Nothing to keep, do not hold a chunk for a session that sent nothing
+        recv_buffer_.release();
     }
-    else
-        throw std::runtime_error("Error with recv");
-    std::string vector_str(buffer_data.begin(), buffer_data.end());
-    return std::make_pair(vector_str,bytes_received);
+    return bytes_received;
 }
 
 Session* tcp_session_generator(int sockfd, const struct sockaddr* addr, socklen_t addrlen) {
     return new TcpSession(sockfd, addr, addrlen);
 }
 
-Socket::Socket(SessionGenerator session_generator) : session_generator_(session_generator) {}
+Socket::Socket(SessionGenerator session_generator)
+    : io_(NULL), session_generator_(session_generator) {}
 
 Socket::~Socket() {}
 
+void Socket::setOptions(const SocketOptions& options) {
+    options_ = options;
+}
+
+void Socket::setAsyncIo(AsyncIo* io) {
+    io_ = io;
+    if (io_) {
+        io_->attach(sockfd_, ASYNC_ACCEPT);
+    }
+}
+
 TcpSocket::TcpSocket(SessionGenerator session_generator) : Socket(session_generator) {
     sockfd_ = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd_ == -1) {
@@ -105,39 +246,109 @@ int TcpSocket::bind(std::string addr, int port) {
 
     int status = getaddrinfo(addr.c_str(), port_str, &hints, &res);
     if (status != 0) {
-        Logger::instance().log(std::string("Error: getaddrinfo failed with error: ") +
-                               gai_strerror(status));
+        ::close(sockfd_);
+        throw std::runtime_error(std::string("Error: getaddrinfo failed with error: ") +
+                                 gai_strerror(status));
     }
 
     // Copy the address information to addr_in_
     memcpy(&addr_in_, res->ai_addr, sizeof(addr_in_));
 
     freeaddrinfo(res);
+
+    // Rebind right away on restart, and share the port between workers if asked to
+    int on = 1;
+    if (setsockopt(sockfd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) {
+        Logger::instance().log("Error: Failed to set SO_REUSEADDR -> " + std::string(strerror(errno)));
+    }
+    if (options_.reuseport &&
+        setsockopt(sockfd_, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+        Logger::instance().log("Error: Failed to set SO_REUSEPORT -> " + std::string(strerror(errno)));
+    }
+
+    // Accepted sessions inherit the buffer sizes of the listening socket
+    if (options_.rcvbuf > 0) {
+        setIntOption(sockfd_, SOL_SOCKET, SO_RCVBUF, options_.rcvbuf, "SO_RCVBUF");
+    }
+    if (options_.sndbuf > 0) {
+        setIntOption(sockfd_, SOL_SOCKET, SO_SNDBUF, options_.sndbuf, "SO_SNDBUF");
+    }
+
     // Binds socket to an address and port
     if (::bind(sockfd_, (struct sockaddr*)&addr_in_, sizeof(addr_in_)) == -1) {
-        Logger::instance().log("Error: Failed to bind socket -> " + std::string(strerror(errno)));
+        std::string error(strerror(errno));
+        ::close(sockfd_);
+        throw std::runtime_error("Error: Failed to bind socket -> " + error);
     }
     return sockfd_;
 }
 
 void TcpSocket::listen() {
+    // Let clients send the request with the SYN on reconnect
+    if (options_.fastopen > 0) {
+#ifdef TCP_FASTOPEN
+        setIntOption(sockfd_, IPPROTO_TCP, TCP_FASTOPEN, options_.fastopen, "TCP_FASTOPEN");
+#else
+        Logger::instance().log("Error: TCP_FASTOPEN is not supported on this system");
+#endif
+    }
+
     // Sets server to listen passively
-    if (::listen(sockfd_, SO_MAX_QUEUE) == -1) {
+    if (::listen(sockfd_, options_.backlog) == -1) {
         Logger::instance().log("Error: Failed to listen on socket -> " + std::string(strerror(errno)));
     }
+
+    // Only report the connection once its first data arrived, accept() then reads right away
+    if (options_.defer_accept > 0) {
+#ifdef TCP_DEFER_ACCEPT
+        setIntOption(sockfd_, IPPROTO_TCP, TCP_DEFER_ACCEPT, options_.defer_accept, "TCP_DEFER_ACCEPT");
+#else
+        Logger::instance().log("Error: TCP_DEFER_ACCEPT is not supported on this system");
+#endif
+    }
 }
 
 Session* TcpSocket::accept() {
-    struct sockaddr* client_addr     = new struct sockaddr;
-    socklen_t        client_addr_len = sizeof(sockaddr);
-
-    int client_sockfd = ::accept(sockfd_, client_addr, &client_addr_len);
+    // The session copies the address, it never leaves the stack here
+    struct sockaddr_storage storage;
+    struct sockaddr*        client_addr     = reinterpret_cast<struct sockaddr*>(&storage);
+    socklen_t               client_addr_len = sizeof(storage);
+
+    // Sessions are non-blocking and not inherited by CGI children, set when the fd is created
+    int client_sockfd;
+    if (io_) {
+        // Accepted by the backend, the address is read back from the connection
+        client_sockfd = io_->accept(sockfd_);
+        if (client_sockfd != -1 && getpeername(client_sockfd, client_addr, &client_addr_len) == -1) {
+            client_addr_len = 0;
+        }
+    } else {
+#ifdef SOCK_NONBLOCK
+        client_sockfd = ::accept4(sockfd_, client_addr, &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        client_sockfd = ::accept(sockfd_, client_addr, &client_addr_len);
+        if (client_sockfd != -1 && (fcntl(client_sockfd, F_SETFL, O_NONBLOCK) == -1 ||
+                                    fcntl(client_sockfd, F_SETFD, FD_CLOEXEC) == -1)) {
+            ::close(client_sockfd);
+            client_sockfd = -1;
+        }
+#endif
+    }
     if (client_sockfd == -1) {
-        delete client_addr;
-        Logger::instance().log("Error: Failed to accept connection -> " + std::string(strerror(errno)));
+        // The backlog is drained, not an error. Running out of descriptors or memory is left to the
+        // caller, which backs off and logs it once
+        int error = errno;
+        if (error != EAGAIN && error != EWOULDBLOCK && error != EMFILE && error != ENFILE &&
+            error != ENOBUFS && error != ENOMEM) {
+            Logger::instance().log("Error: Failed to accept connection -> " + std::string(strerror(error)));
+        }
+        errno = error;
+        return NULL;
     }
 
-    return session_generator_(client_sockfd, client_addr, client_addr_len);
+    Session* session = session_generator_(client_sockfd, client_addr, client_addr_len);
+    session->setAsyncIo(io_);
+    return session;
 }
 
 void TcpSocket::close() {
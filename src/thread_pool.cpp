@@ -0,0 +1,146 @@
+#include "../include/thread_pool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+ThreadTask::ThreadTask() : next_(NULL) {}
+
+ThreadTask::~ThreadTask() {}
+
+ThreadPool::ThreadPool(size_t threads, size_t max_queue)
+    : max_queue_(max_queue), stopping_(false), completed_(NULL) {
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+    notify_pipe_[0] = notify_pipe_[1] = -1;
+
+    // Both ends are non-blocking, a full pipe already guarantees a wakeup
+    if (pipe(notify_pipe_) == -1) {
+        release();
+        throw std::runtime_error("Failed to create thread pool pipe");
+    }
+    for (int i = 0; i < 2; ++i) {
+        fcntl(notify_pipe_[i], F_SETFL, O_NONBLOCK);
+        fcntl(notify_pipe_[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    // Threads inherit a full mask, signals are left to the event loop thread and its signalfd
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    int err = 0;
+    for (size_t i = 0; i < threads && err == 0; ++i) {
+        pthread_t thread;
+        err = pthread_create(&thread, NULL, worker, this);
+        if (err == 0) {
+            threads_.push_back(thread);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (err != 0) {
+        release();
+        throw std::runtime_error("Failed to create thread pool thread: " + std::string(strerror(err)));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    release();
+}
+
+void ThreadPool::release() {
+    // Let the threads finish the task they are running, queued tasks are dropped
+    pthread_mutex_lock(&mutex_);
+    stopping_ = true;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+    for (std::vector<pthread_t>::iterator it = threads_.begin(); it != threads_.end(); ++it) {
+        pthread_join(*it, NULL);
+    }
+    threads_.clear();
+
+    for (std::deque<ThreadTask *>::iterator it = queue_.begin(); it != queue_.end(); ++it) {
+        delete *it;
+    }
+    queue_.clear();
+    while (completed_) {
+        ThreadTask *task = completed_;
+        completed_       = task->next_;
+        delete task;
+    }
+
+    if (notify_pipe_[0] != -1) {
+        close(notify_pipe_[0]);
+        close(notify_pipe_[1]);
+        notify_pipe_[0] = notify_pipe_[1] = -1;
+    }
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+bool ThreadPool::post(ThreadTask *task) {
+    pthread_mutex_lock(&mutex_);
+    if (queue_.size() >= max_queue_ || threads_.empty()) {
+        pthread_mutex_unlock(&mutex_);
+        return false;
+    }
+    queue_.push_back(task);
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&mutex_);
+    return true;
+}
+
+int ThreadPool::notifyFd() const {
+    return notify_pipe_[0];
+}
+
+void ThreadPool::collect(std::vector<ThreadTask *> &completed) {
+    completed.clear();
+
+    // Drain the pipe before taking the stack, a push after the exchange writes a new byte
+    char buffer[64];
+    while (read(notify_pipe_[0], buffer, sizeof(buffer)) > 0) {
+    }
+
+    ThreadTask *task = __atomic_exchange_n(&completed_, static_cast<ThreadTask *>(NULL),
+                                           __ATOMIC_ACQUIRE);
+    for (; task; task = task->next_) {
+        completed.push_back(task);
+    }
+    std::reverse(completed.begin(), completed.end());
+}
+
+void ThreadPool::complete(ThreadTask *task) {
+    // Multiple producers push, the event loop is the single consumer
+    ThreadTask *head = __atomic_load_n(&completed_, __ATOMIC_RELAXED);
+    do {
+        task->next_ = head;
+    } while (!__atomic_compare_exchange_n(&completed_, &head, task, true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+
+    // Only the push onto an empty stack needs to wake the loop
+    if (head == NULL && write(notify_pipe_[1], "", 1) == -1 && errno != EAGAIN) {
+        Logger::instance().log("Error: Failed to wake the event loop -> " +
+                               std::string(strerror(errno)));
+    }
+}
+
+void *ThreadPool::worker(void *arg) {
+    ThreadPool *pool = static_cast<ThreadPool *>(arg);
+
+    while (true) {
+        pthread_mutex_lock(&pool->mutex_);
+        while (!pool->stopping_ && pool->queue_.empty()) {
+            pthread_cond_wait(&pool->cond_, &pool->mutex_);
+        }
+        if (pool->stopping_) {
+            pthread_mutex_unlock(&pool->mutex_);
+            return NULL;
+        }
+        ThreadTask *task = pool->queue_.front();
+        pool->queue_.pop_front();
+        pthread_mutex_unlock(&pool->mutex_);
+
+        task->run();
+        pool->complete(task);
+    }
+}
@@ -0,0 +1,162 @@
+#include "../include/upload.hpp"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "../include/logging.hpp"
+
+UploadFile::UploadFile() : file_(NULL) {}
+
+UploadFile::UploadFile(const UploadFile &other) : file_(other.file_) {
+    if (file_) {
+        __sync_add_and_fetch(&file_->refs, 1);
+    }
+}
+
+UploadFile &UploadFile::operator=(const UploadFile &other) {
+    if (file_ != other.file_) {
+        drop();
+        file_ = other.file_;
+        if (file_) {
+            __sync_add_and_fetch(&file_->refs, 1);
+        }
+    }
+    return *this;
+}
+
+UploadFile::~UploadFile() {
+    drop();
+}
+
+// Copies can go away on the event loop and on a pool thread at the same time
+void UploadFile::drop() {
+    if (file_ && __sync_sub_and_fetch(&file_->refs, 1) == 0) {
+        close(file_->fd);
+        if (!file_->committed) {
+            unlink(file_->path.c_str());
+        }
+        delete file_;
+    }
+    file_ = NULL;
+}
+
+// Reserve the blocks without changing the length, a short upload never shows unwritten bytes
+static bool preallocate(int fd, size_t size) {
+    int result = 0;
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+    result = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+#elif defined(F_PREALLOCATE)
+    fstore_t store = {F_ALLOCATEALL, F_PEOFPOSMODE, 0, static_cast<off_t>(size), 0};
+    result         = fcntl(fd, F_PREALLOCATE, &store);
+#else
+    (void)fd;
+    (void)size;
+#endif
+    // Only a full disk is an error, some filesystems cannot preallocate
+    return result == 0 || (errno != ENOSPC && errno != EFBIG);
+}
+
+bool UploadFile::open(const std::string &directory, size_t size) {
+    drop();
+    std::string       path = directory + "/" UPLOAD_TEMP_NAME;
+    std::vector<char> name(path.begin(), path.end());
+    name.push_back('\0');
+
+    int fd = mkstemp(&name[0]);
+    if (fd == -1) {
+        Logger::instance().log("Error: Failed to create an upload file in " + directory + " -> " +
+                               std::string(strerror(errno)));
+        return false;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fchmod(fd, 0644);
+    file_            = new File;
+    file_->fd        = fd;
+    file_->path      = &name[0];
+    file_->size      = 0;
+    file_->committed = false;
+    file_->refs      = 1;
+
+    if (size > 0 && !preallocate(fd, size)) {
+        Logger::instance().log("Error: Failed to reserve " + std::to_string(size) +
+                               " bytes for an upload -> " + std::string(strerror(errno)));
+        drop();
+        return false;
+    }
+    return true;
+}
+
+bool UploadFile::write(const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = ::write(file_->fd, data, size);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            Logger::instance().log("Error: Failed to write an upload file -> " +
+                                   std::string(strerror(errno)));
+            return false;
+        }
+        data += written;
+        size -= written;
+        file_->size += written;
+    }
+    return true;
+}
+
+bool UploadFile::commit(const std::string &path) {
+    if (link(file_->path.c_str(), path.c_str()) == -1) {
+        if (errno != EEXIST) {
+            Logger::instance().log("Error: Failed to move an upload to " + path + " -> " +
+                                   std::string(strerror(errno)));
+        }
+        return false;
+    }
+    unlink(file_->path.c_str());
+    file_->path      = path;
+    file_->committed = true;
+    return true;
+}
+
+// The counter goes before the first dot of name, "a.tar.gz" becomes "a_2.tar.gz"
+bool UploadFile::commit(const std::string &directory, const std::string &name) {
+    size_t dot = name.find('.');
+    for (int counter = 1; counter <= UPLOAD_NAME_ATTEMPTS; ++counter) {
+        std::string path = directory + "/" + name;
+        if (counter > 1) {
+            path = directory + "/" + name.substr(0, dot) + "_" + std::to_string(counter) +
+                   (dot == std::string::npos ? "" : name.substr(dot));
+        }
+        if (commit(path)) {
+            return true;
+        }
+        if (errno != EEXIST) {
+            return false;
+        }
+    }
+    Logger::instance().log("Error: No free name left for an upload named " + name);
+    return false;
+}
+
+bool UploadFile::isOpen() const {
+    return file_ != NULL;
+}
+
+int UploadFile::fd() const {
+    return file_ ? file_->fd : -1;
+}
+
+const std::string &UploadFile::path() const {
+    return file_->path;
+}
+
+size_t UploadFile::size() const {
+    return file_ ? file_->size : 0;
+}
@@ -0,0 +1,123 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include "buffer.hpp"
+#include "http.hpp"
+
+// Append data the way TcpSession::recv() does, one read of at most 4096 bytes at a time
+static void receive(RecvBuffer &buffer, const std::string &data) {
+    for (size_t pos = 0; pos < data.size();) {
+        size_t size = std::min<size_t>(4096, data.size() - pos);
+        memcpy(buffer.reserve(4096), data.data() + pos, size);
+        buffer.commit(size);
+        pos += size;
+    }
+}
+
+// A chunk acquired then released, so the pool has one to hand out
+static void primePool() {
+    RecvBuffer buffer;
+    buffer.reserve(1);
+}
+
+// Headers longer than a chunk: the buffer moves to one larger block and the request parses in place
+TEST(recvBufferTest, SpansTwoChunks) {
+    std::string request = "GET /long HTTP/1.1\r\nHost: example\r\nX-Long: " +
+                          std::string(BUFFER_CHUNK_SIZE, 'a') + "\r\n\r\n";
+    ASSERT_GT(request.size(), size_t(BUFFER_CHUNK_SIZE));
+    ASSERT_LT(request.size(), size_t(2 * BUFFER_CHUNK_SIZE));
+
+    RecvBuffer buffer;
+    receive(buffer, request.substr(0, BUFFER_CHUNK_SIZE));
+    EXPECT_EQ(buffer.writable(), 0u);
+    EXPECT_EQ(buffer.find("\r\n\r\n", 4), -1);
+    HttpParser parser;
+    parser.setHeaderBuffers(4, 2 * BUFFER_CHUNK_SIZE);
+    EXPECT_EQ(parser.parse(buffer.data(), buffer.size()), HttpParser::HEADERS);
+
+    receive(buffer, request.substr(BUFFER_CHUNK_SIZE));
+    ASSERT_EQ(buffer.size(), request.size());
+    EXPECT_TRUE(std::string(buffer.data(), buffer.size()) == request);
+    EXPECT_EQ(buffer.find("\r\n\r\n", 4), ssize_t(request.size() - 4));
+    ASSERT_EQ(parser.parse(buffer.data(), buffer.size()), HttpParser::COMPLETE);
+    EXPECT_EQ(parser.length(), request.size());
+    EXPECT_EQ(parser.request().headers_.get("X-Long").size(), size_t(BUFFER_CHUNK_SIZE));
+}
+
+// Once the front of the buffer is consumed, the rest moves to the start instead of growing
+TEST(recvBufferTest, CompactsAfterPartialConsume) {
+    std::string first(BUFFER_CHUNK_SIZE - 100, 'a');
+    first.replace(first.size() - 10, 10, "0123456789");
+
+    RecvBuffer buffer;
+    receive(buffer, first);
+    const char *block = buffer.data();
+    buffer.consume(first.size() - 10);
+    EXPECT_EQ(std::string(buffer.data(), buffer.size()), "0123456789");
+
+    // 100 bytes are left at the end, a 4096 byte read reclaims the consumed space
+    char *write = buffer.reserve(4096);
+    EXPECT_EQ(buffer.data(), block);
+    EXPECT_EQ(write, block + 10);
+    EXPECT_EQ(buffer.writable(), size_t(BUFFER_CHUNK_SIZE - 10));
+    memcpy(write, "abc", 3);
+    buffer.commit(3);
+    EXPECT_EQ(std::string(buffer.data(), buffer.size()), "0123456789abc");
+
+    // Consuming everything rewinds to the start of the block
+    buffer.consume(buffer.size());
+    EXPECT_TRUE(buffer.empty());
+    EXPECT_EQ(buffer.reserve(1), block);
+}
+
+// An empty buffer gives its chunk back, a buffer with data keeps it
+TEST(recvBufferTest, ReleasesChunkToPool) {
+    primePool();
+    BufferPool &pool      = BufferPool::instance();
+    size_t      available = pool.available();
+
+    RecvBuffer buffer;
+    receive(buffer, "GET / HTTP/1.1\r\n");
+    EXPECT_EQ(pool.available(), available - 1);
+    buffer.release();
+    EXPECT_EQ(pool.available(), available - 1);
+
+    buffer.consume(buffer.size());
+    buffer.release();
+    EXPECT_EQ(pool.available(), available);
+
+    // Reused after a release, the chunk comes from the pool again
+    receive(buffer, "x");
+    EXPECT_EQ(pool.available(), available - 1);
+    buffer.clear();
+    buffer.release();
+    EXPECT_EQ(pool.available(), available);
+}
+
+// Growing returns the chunk right away, the larger block is freed rather than pooled
+TEST(recvBufferTest, GrowingReturnsChunk) {
+    primePool();
+    BufferPool &pool      = BufferPool::instance();
+    size_t      available = pool.available();
+    {
+        RecvBuffer buffer;
+        receive(buffer, std::string(BUFFER_CHUNK_SIZE, 'a'));
+        EXPECT_EQ(pool.available(), available - 1);
+        receive(buffer, "b");
+        EXPECT_EQ(pool.available(), available);
+        EXPECT_EQ(buffer.size(), size_t(BUFFER_CHUNK_SIZE + 1));
+    }
+    EXPECT_EQ(pool.available(), available);
+
+    // Destroyed with data in it, the chunk still goes back
+    {
+        RecvBuffer buffer;
+        receive(buffer, "partial request");
+        EXPECT_EQ(pool.available(), available - 1);
+    }
+    EXPECT_EQ(pool.available(), available);
+}
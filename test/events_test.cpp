@@ -1,8 +1,225 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
-#include "webserv.hpp"
+#include "events.hpp"
 
 TEST(eventsTest, BasicAssertions) {
     EXPECT_TRUE(true);
 }
+
+TEST(timerWheelTest, ExpiresOnDeadline) {
+    TimerWheel       timers(0);
+    std::vector<int> expired;
+
+    timers.schedule(4, 0, 1000);
+    timers.expire(900, expired);
+    EXPECT_TRUE(expired.empty());
+    EXPECT_TRUE(timers.pending(4));
+
+    timers.expire(1000, expired);
+    ASSERT_EQ(expired.size(), 1u);
+    EXPECT_EQ(expired[0], 4);
+    EXPECT_FALSE(timers.pending(4));
+    EXPECT_EQ(timers.size(), 0u);
+}
+
+TEST(timerWheelTest, CascadesLongTimeouts) {
+    TimerWheel       timers(0);
+    std::vector<int> expired;
+
+    // Beyond level 0 and level 1
+    timers.schedule(3, 0, 75 * 1000);
+    timers.schedule(5, 0, 600 * 1000);
+    for (unsigned long now = 0; now < 75 * 1000; now += 500) {
+        timers.expire(now, expired);
+    }
+    EXPECT_TRUE(expired.empty());
+
+    timers.expire(75 * 1000, expired);
+    ASSERT_EQ(expired.size(), 1u);
+    EXPECT_EQ(expired[0], 3);
+
+    timers.expire(600 * 1000 - TIMER_TICK_MS, expired);
+    EXPECT_EQ(expired.size(), 1u);
+    timers.expire(600 * 1000, expired);
+    ASSERT_EQ(expired.size(), 2u);
+    EXPECT_EQ(expired[1], 5);
+}
+
+TEST(timerWheelTest, RescheduleAndCancel) {
+    TimerWheel       timers(0);
+    std::vector<int> expired;
+
+    timers.schedule(7, 0, 1000);
+    timers.schedule(7, 500, 1000);
+    timers.schedule(8, 0, 1000);
+    timers.cancel(8);
+    EXPECT_EQ(timers.size(), 1u);
+
+    timers.expire(1000, expired);
+    EXPECT_TRUE(expired.empty());
+    timers.expire(1500, expired);
+    ASSERT_EQ(expired.size(), 1u);
+    EXPECT_EQ(expired[0], 7);
+}
+
+TEST(timerWheelTest, NextTimeout) {
+    TimerWheel timers(0);
+
+    EXPECT_EQ(timers.nextTimeout(0), -1);
+    timers.schedule(3, 0, 250);
+    EXPECT_EQ(timers.nextTimeout(0), 300);
+    EXPECT_EQ(timers.nextTimeout(400), 0);
+
+    // Timers on a higher level wake the loop up for the next cascade
+    timers.cancel(3);
+    timers.schedule(3, 0, 60 * 1000);
+    EXPECT_EQ(timers.nextTimeout(0), TIMER_WHEEL_SLOTS * TIMER_TICK_MS);
+}
+
+#ifdef USE_IO_URING
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <cstdio>
+
+// Listen until fd reports event, false after a second without it
+static bool waitFor(EventListener &listener, int fd, InternalEvent event) {
+    std::vector<Event> events;
+    for (int i = 0; i < 20; ++i) {
+        listener.listen(events, 50);
+        for (size_t j = 0; j < events.size(); ++j) {
+            if (events[j].first == fd && (events[j].second & event)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Ring for the tests, NULL where io_uring is not available (old kernel, seccomp)
+static IoUringEventListener *ring() {
+    try {
+        return new IoUringEventListener(64);
+    } catch (std::exception &e) {
+        return NULL;
+    }
+}
+
+TEST(ioUringTest, PollsSocketpair) {
+    IoUringEventListener *listener = ring();
+    if (!listener) {
+        GTEST_SKIP() << "io_uring is not available";
+    }
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+    // Not attached, readiness comes from POLL_ADD requests
+    ASSERT_TRUE(listener->registerEvent(fds[0], READABLE | WRITABLE));
+    EXPECT_TRUE(waitFor(*listener, fds[0], WRITABLE));
+    ASSERT_EQ(write(fds[1], "x", 1), 1);
+    EXPECT_TRUE(waitFor(*listener, fds[0], READABLE));
+
+    // Level-triggered, reported again until the byte is read
+    EXPECT_TRUE(waitFor(*listener, fds[0], READABLE));
+    char byte;
+    ASSERT_EQ(read(fds[0], &byte, 1), 1);
+
+    // The armed poll is removed, nothing fires once both events are gone
+    listener->unregisterEvent(fds[0], READABLE | WRITABLE);
+    ASSERT_EQ(write(fds[1], "y", 1), 1);
+    EXPECT_FALSE(waitFor(*listener, fds[0], READABLE | WRITABLE | ERROR_EVENT));
+    listener->removeEvent(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+    delete listener;
+}
+
+TEST(ioUringTest, AcceptsReceivesAndSends) {
+    IoUringEventListener *listener = ring();
+    if (!listener || !listener->asyncIo()) {
+        delete listener;
+        GTEST_SKIP() << "io_uring buffer rings are not available";
+    }
+    AsyncIo *io = listener->asyncIo();
+
+    struct sockaddr_in addr;
+    socklen_t          addrlen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int server           = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    ASSERT_EQ(bind(server, reinterpret_cast<struct sockaddr *>(&addr), addrlen), 0);
+    ASSERT_EQ(::listen(server, 8), 0);
+    ASSERT_EQ(getsockname(server, reinterpret_cast<struct sockaddr *>(&addr), &addrlen), 0);
+
+    // Accepted by the multishot request, the connection waits in the fd state
+    io->attach(server, ASYNC_ACCEPT);
+    ASSERT_TRUE(listener->registerEvent(server, READABLE));
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(connect(client, reinterpret_cast<struct sockaddr *>(&addr), addrlen), 0);
+    ASSERT_TRUE(waitFor(*listener, server, READABLE));
+    int session = io->accept(server);
+    ASSERT_NE(session, -1);
+    EXPECT_EQ(io->accept(server), -1);
+    EXPECT_EQ(errno, EAGAIN);
+
+    // Received into a registered buffer, copied out on recv()
+    io->attach(session, ASYNC_STREAM);
+    ASSERT_TRUE(listener->registerEvent(session, READABLE));
+    ASSERT_EQ(::send(client, "hello", 5, 0), 5);
+    ASSERT_TRUE(waitFor(*listener, session, READABLE));
+    RecvBuffer buffer;
+    ASSERT_EQ(io->recv(session, buffer), 5);
+    EXPECT_EQ(std::string(buffer.data(), buffer.size()), "hello");
+
+    // A memory segment then a file segment, each send completes before the next is submitted
+    FILE *file = tmpfile();
+    ASSERT_TRUE(file);
+    ASSERT_EQ(fwrite("-file-", 1, 6, file), 6u);
+    fflush(file);
+    std::string head("head");
+    SendQueue   queue;
+    queue.push(SendSegment(head));
+    queue.push(SendSegment(dup(fileno(file)), 1, 4));
+    fclose(file);
+
+    ASSERT_TRUE(listener->registerEvent(session, WRITABLE));
+    while (!queue.empty()) {
+        ASSERT_TRUE(waitFor(*listener, session, WRITABLE));
+        size_t  wanted;
+        ssize_t sent = io->send(session, queue, wanted);
+        if (sent == -1) {
+            ASSERT_EQ(errno, EAGAIN);
+            continue;
+        }
+        ASSERT_GT(sent, 0);
+        queue.consume(sent);
+    }
+    char received[8];
+    ASSERT_EQ(::recv(client, received, sizeof(received), MSG_WAITALL), 8);
+    EXPECT_EQ(std::string(received, 8), "headfile");
+
+    // The peer closing is reported once the buffered data was taken
+    close(client);
+    ASSERT_TRUE(waitFor(*listener, session, READABLE));
+    EXPECT_EQ(io->recv(session, buffer), 0);
+
+    listener->removeEvent(session);
+    listener->removeEvent(server);
+    close(session);
+    close(server);
+    delete listener;
+}
+
+TEST(ioUringTest, FallsBackToEpoll) {
+    // No ring takes zero entries
+    EventListener *listener = io_uring_listener_generator(64, 0);
+    EXPECT_TRUE(dynamic_cast<EpollEventListener *>(listener));
+    EXPECT_FALSE(listener->asyncIo());
+    delete listener;
+}
+
+#endif
@@ -0,0 +1,414 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "http.hpp"
+#include "upload.hpp"
+
+static HttpParser::State parseAll(HttpParser &parser, const std::string &request) {
+    return parser.parse(request.data(), request.size());
+}
+
+TEST(httpHeadersTest, InternsKnownNames) {
+    EXPECT_EQ(HttpHeaders::intern("host", 4), HEADER_HOST);
+    EXPECT_EQ(HttpHeaders::intern("CONTENT-LENGTH", 14), HEADER_CONTENT_LENGTH);
+    EXPECT_EQ(HttpHeaders::intern("X-Request-Id", 12), HEADER_OTHER);
+    EXPECT_STREQ(HttpHeaders::canonical(HEADER_CONTENT_TYPE), "Content-Type");
+}
+
+TEST(httpHeadersTest, LooksUpCaseInsensitively) {
+    HttpHeaders headers;
+    headers.add("content-type", 12, "text/html", 9);
+    headers.add("X-Trace", 7, "abc", 3);
+
+    EXPECT_TRUE(headers.has(HEADER_CONTENT_TYPE));
+    EXPECT_EQ(headers.get(HEADER_CONTENT_TYPE), "text/html");
+    EXPECT_EQ(headers.get("Content-Type"), "text/html");
+    EXPECT_EQ(headers.get("x-trace"), "abc");
+    EXPECT_FALSE(headers.has(HEADER_HOST));
+    EXPECT_EQ(headers.get(HEADER_HOST), "");
+    EXPECT_EQ(headers.size(), 2u);
+}
+
+TEST(httpHeadersTest, SetReplacesEveryCase) {
+    HttpHeaders headers;
+    headers.set("content-length", "10");
+    headers.set(HEADER_CONTENT_LENGTH, "0");
+    headers.set("Status", "200");
+    headers.set("status", "404");
+
+    EXPECT_EQ(headers.size(), 2u);
+    EXPECT_EQ(headers.get(HEADER_CONTENT_LENGTH), "0");
+    EXPECT_EQ(headers.get("Status"), "404");
+
+    std::string buffer;
+    headers.serialize(buffer);
+    EXPECT_EQ(buffer, "Content-Length: 0\r\nstatus: 404\r\n");
+}
+
+TEST(httpParserTest, StoresHeaders) {
+    HttpParser parser;
+    ASSERT_EQ(parseAll(parser, "GET /a HTTP/1.1\r\nHost: example\r\nCOOKIE:  x=1 \r\n\r\n"),
+              HttpParser::COMPLETE);
+    EXPECT_EQ(parser.request().method_, GET);
+    EXPECT_EQ(parser.request().uri_, "/a");
+    EXPECT_EQ(parser.request().headers_.get(HEADER_HOST), "example");
+    EXPECT_EQ(parser.request().headers_.get(HEADER_COOKIE), "x=1");
+}
+
+TEST(httpParserTest, RejectsRepeatedFraming) {
+    HttpParser parser;
+    EXPECT_EQ(parseAll(parser, "POST / HTTP/1.1\r\nContent-Length: 1\r\ncontent-length: 2\r\n\r\n"),
+              HttpParser::INVALID);
+}
+
+TEST(httpParserTest, RejectsTransferEncodingWithContentLength) {
+    HttpParser parser;
+    EXPECT_EQ(parseAll(parser, "POST / HTTP/1.1\r\nContent-Length: 5\r\n"
+                               "Transfer-Encoding: chunked\r\n\r\n0\r\n\r\nGET /"),
+              HttpParser::INVALID);
+    EXPECT_EQ(parser.error(), BAD_REQUEST);
+
+    parser.reset();
+    EXPECT_EQ(parseAll(parser, "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n"
+                               "Content-Length: 5\r\n\r\n0\r\n\r\n"),
+              HttpParser::INVALID);
+}
+
+// Feed request as recv() appends it to the buffer, a piece ending at each cut
+static HttpParser::State parseSplit(HttpParser &parser, const std::string &request,
+                                    const std::vector<size_t> &cuts) {
+    HttpParser::State state = HttpParser::REQUEST_LINE;
+    for (size_t i = 0; i < cuts.size(); ++i) {
+        // A body waits for the caller to pick where it goes, then parsing goes on
+        do {
+            state = parser.parse(request.data(), cuts[i]);
+        } while (parser.bodyPending());
+    }
+    return state;
+}
+
+// What the parser made of the request, to compare a split parse with a single-shot one
+static std::string parsed(HttpParser &parser, HttpParser::State state) {
+    const HttpRequest &request = parser.request();
+    std::string        result  = std::to_string(state) + " " + std::to_string(parser.error());
+    if (state != HttpParser::COMPLETE) {
+        return result;
+    }
+    std::string headers;
+    request.headers_.serialize(headers);
+    return result + " " + HttpRequest::methodName(request.method_) + " " + request.uri_ + " " +
+           request.version_ + "\n" + headers + "\n" + request.body_;
+}
+
+// Parse request in one read, then split in every way and expect the same result each time
+static HttpParser::State expectSameParse(const std::string &request) {
+    HttpParser        whole;
+    HttpParser::State state    = parseSplit(whole, request, std::vector<size_t>(1, request.size()));
+    std::string       expected = parsed(whole, state);
+
+    // One byte at a time, every line split everywhere
+    std::vector<size_t> cuts;
+    for (size_t i = 1; i <= request.size(); ++i) {
+        cuts.push_back(i);
+    }
+    HttpParser bytes;
+    EXPECT_EQ(parsed(bytes, parseSplit(bytes, request, cuts)), expected) << "byte by byte";
+
+    // Random pieces, the same seed every run
+    srand(42);
+    for (int round = 0; round < 200; ++round) {
+        cuts.clear();
+        for (size_t cut = 0; cut < request.size();) {
+            cut = std::min(request.size(), cut + 1 + rand() % 16);
+            cuts.push_back(cut);
+        }
+        HttpParser random;
+        EXPECT_EQ(parsed(random, parseSplit(random, request, cuts)), expected) << "round " << round;
+    }
+    return state;
+}
+
+TEST(httpParserTest, SplitReadsParseLikeOneRead) {
+    EXPECT_EQ(expectSameParse("\r\nPOST /form?a=1 HTTP/1.1\r\nHost: example\r\nX-Long: " +
+                              std::string(100, 'v') + " \r\nContent-Length: 26\r\n\r\n"
+                              "abcdefghijklmnopqrstuvwxyz"),
+              HttpParser::COMPLETE);
+    EXPECT_EQ(expectSameParse("POST /up HTTP/1.1\r\nHost: example\r\nTransfer-Encoding: chunked\r\n\r\n"
+                              "5;name=value\r\nhello\r\n1a\r\n, world of chunked bodies.\r\n"
+                              "0\r\nX-Trailer: ignored\r\n\r\n"),
+              HttpParser::COMPLETE);
+    EXPECT_EQ(expectSameParse("GET / HTTP/1.1\nHost: bare-newlines\n\n"), HttpParser::COMPLETE);
+
+    // Rejected the same way wherever the reads end
+    EXPECT_EQ(expectSameParse("GET / HTTP/1.1\r\nX-Folded: first\r\n second\r\n\r\n"),
+              HttpParser::INVALID);
+    EXPECT_EQ(expectSameParse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5x\r\nhello\r\n"),
+              HttpParser::INVALID);
+    EXPECT_EQ(expectSameParse("POST / HTTP/1.1\r\nContent-Length: 3\r\n"
+                              "Transfer-Encoding: chunked\r\n\r\n"),
+              HttpParser::INVALID);
+}
+
+TEST(httpParserTest, LimitsHeaderBuffers) {
+    HttpParser parser;
+    parser.setHeaderBuffers(2, 32);
+    // Rejected before the end of the line arrives
+    EXPECT_EQ(parseAll(parser, "GET /" + std::string(40, 'a')), HttpParser::INVALID);
+    EXPECT_EQ(parser.error(), URI_TOO_LONG);
+
+    parser.reset();
+    EXPECT_EQ(parseAll(parser, "GET / HTTP/1.1\r\nX: " + std::string(40, 'a')),
+              HttpParser::INVALID);
+    EXPECT_EQ(parser.error(), REQUEST_HEADER_FIELDS_TOO_LARGE);
+
+    parser.reset();
+    std::string request("GET / HTTP/1.1\r\n");
+    for (char name = 'A'; name < 'M'; ++name) {
+        request += std::string(1, name) + ": 1\r\n";
+    }
+    EXPECT_EQ(parseAll(parser, request), HttpParser::INVALID);
+    EXPECT_EQ(parser.error(), REQUEST_HEADER_FIELDS_TOO_LARGE);
+
+    parser.reset();
+    EXPECT_EQ(parseAll(parser, "GET / HTTP/1.1\r\nA: 1\r\n\r\n"), HttpParser::COMPLETE);
+}
+
+TEST(httpParserTest, LimitsBodyBeforeReadingIt) {
+    HttpParser parser;
+    ASSERT_EQ(parseAll(parser, "POST / HTTP/1.1\r\nContent-Length: 11\r\n\r\n"), HttpParser::BODY);
+    EXPECT_FALSE(parser.limitBody(10));
+    EXPECT_EQ(parser.error(), CONTENT_TOO_LARGE);
+
+    // A chunked body is cut at the chunk size going past the limit
+    std::string request("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                        "6\r\n012345\r\n5\r\n");
+    parser.reset();
+    ASSERT_EQ(parseAll(parser, request), HttpParser::CHUNK_SIZE);
+    EXPECT_TRUE(parser.limitBody(10));
+    EXPECT_EQ(parseAll(parser, request), HttpParser::INVALID);
+    EXPECT_EQ(parser.error(), CONTENT_TOO_LARGE);
+
+    parser.reset();
+    ASSERT_EQ(parseAll(parser, request), HttpParser::CHUNK_SIZE);
+    EXPECT_TRUE(parser.limitBody(11));
+    EXPECT_EQ(parseAll(parser, request + "01234\r\n0\r\n\r\n"), HttpParser::COMPLETE);
+}
+
+TEST(httpRequestTest, MethodTable) {
+    const char *names[] = {"GET", "POST", "DELETE", "HEAD", "PUT", "OPTIONS", "PATCH"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        HttpMethod method = HttpRequest::method(names[i], strlen(names[i]));
+        EXPECT_NE(method, UNKNOWN);
+        EXPECT_STREQ(HttpRequest::methodName(method), names[i]);
+    }
+    EXPECT_EQ(HttpRequest::method("get", 3), UNKNOWN);
+    EXPECT_EQ(HttpRequest::method("CONNECT", 7), UNKNOWN);
+}
+
+static bool keepAlive(const std::string &version, const std::string &connection) {
+    HttpRequest request;
+    request.version_ = version;
+    if (!connection.empty()) {
+        request.headers_.set(HEADER_CONNECTION, connection);
+    }
+    return request.keepAlive();
+}
+
+TEST(httpRequestTest, KeepAlive) {
+    // HTTP/1.1 persists unless told to close
+    EXPECT_TRUE(keepAlive("HTTP/1.1", ""));
+    EXPECT_TRUE(keepAlive("HTTP/1.1", "keep-alive"));
+    EXPECT_FALSE(keepAlive("HTTP/1.1", "close"));
+    EXPECT_FALSE(keepAlive("HTTP/1.1", "Upgrade, Close"));
+
+    // HTTP/1.0 only when asked for
+    EXPECT_FALSE(keepAlive("HTTP/1.0", ""));
+    EXPECT_TRUE(keepAlive("HTTP/1.0", "keep-alive"));
+    EXPECT_TRUE(keepAlive("HTTP/1.0", "Keep-Alive"));
+    EXPECT_FALSE(keepAlive("HTTP/1.0", "CLOSE"));
+}
+
+TEST(httpResponseTest, StatusLines) {
+    size_t      size;
+    const char *line = HttpResponse::statusLine(NOT_FOUND, size);
+    EXPECT_EQ(std::string(line, size), "HTTP/1.1 404 Not Found\r\n");
+    EXPECT_EQ(HttpResponse::statusLine(HttpStatus(307), size), (const char *)NULL);
+
+    HttpResponse response;
+    response.status_ = HttpStatus(307);
+    EXPECT_EQ(response.getMessage().compare(0, 15, "HTTP/1.1 307 \r\n"), 0);
+}
+
+TEST(httpResponseTest, WritesHeadWithoutBody) {
+    HttpResponse response;
+    response.server_ = "test";
+    response.headers_.set(HEADER_CONTENT_LENGTH, "4");
+    response.headers_.set("X-Custom", "a b");
+    response.body_ = "body";
+
+    std::string head("left over");
+    response.writeHead(head);
+    EXPECT_EQ(head,
+              "HTTP/1.1 200 OK\r\nServer: test\r\nContent-Length: 4\r\nX-Custom: a b\r\n\r\n");
+    EXPECT_EQ(response.headers_.serializedSize(),
+              sizeof("Content-Length: 4\r\nX-Custom: a b\r\n") - 1);
+    EXPECT_EQ(response.getMessage(), head + "body");
+}
+
+static std::string readFile(const std::string &path) {
+    char   content[64];
+    FILE  *file = fopen(path.c_str(), "r");
+    size_t size = file ? fread(content, 1, sizeof(content), file) : 0;
+    if (file) {
+        fclose(file);
+    }
+    return std::string(content, size);
+}
+
+TEST(uploadFileTest, CommitNeverReplacesAFile) {
+    char directory[] = "/tmp/webserv-test-XXXXXX";
+    ASSERT_TRUE(mkdtemp(directory));
+    std::string path = std::string(directory) + "/a.tar.gz";
+
+    UploadFile first;
+    UploadFile second;
+    UploadFile third;
+    ASSERT_TRUE(first.open(directory, 0) && first.write("first", 5));
+    ASSERT_TRUE(second.open(directory, 0) && second.write("second", 6));
+    ASSERT_TRUE(third.open(directory, 0) && third.write("third", 5));
+
+    // Both uploads claim the same name, the second one must not take it over
+    ASSERT_TRUE(first.commit(path));
+    EXPECT_FALSE(second.commit(path));
+    EXPECT_EQ(errno, EEXIST);
+    ASSERT_TRUE(second.commit(directory, "a.tar.gz"));
+    ASSERT_TRUE(third.commit(directory, "a.tar.gz"));
+    EXPECT_EQ(second.path(), std::string(directory) + "/a_2.tar.gz");
+    EXPECT_EQ(third.path(), std::string(directory) + "/a_3.tar.gz");
+
+    EXPECT_EQ(readFile(path), "first");
+    EXPECT_EQ(readFile(second.path()), "second");
+    EXPECT_EQ(readFile(third.path()), "third");
+    unlink(first.path().c_str());
+    unlink(second.path().c_str());
+    unlink(third.path().c_str());
+    // No temporary name is left behind
+    EXPECT_EQ(rmdir(directory), 0);
+}
+
+TEST(httpParserTest, StreamsUploadToFile) {
+    char directory[] = "/tmp/webserv-test-XXXXXX";
+    ASSERT_TRUE(mkdtemp(directory));
+    std::string request("POST /up HTTP/1.1\r\nContent-Length: 10\r\n\r\n0123456789");
+
+    HttpParser parser;
+    ASSERT_EQ(parseAll(parser, request), HttpParser::BODY);
+    ASSERT_TRUE(parser.bodyPending());
+    ASSERT_TRUE(parser.uploadTo(directory));
+    ASSERT_EQ(parseAll(parser, request), HttpParser::COMPLETE);
+    EXPECT_TRUE(parser.request().body_.empty());
+    EXPECT_EQ(parser.request().bodySize(), 10u);
+
+    std::string path = std::string(directory) + "/file";
+    ASSERT_TRUE(parser.request().upload_.commit(path));
+    parser.reset();
+    EXPECT_EQ(readFile(path), "0123456789");
+    unlink(path.c_str());
+    rmdir(directory);
+}
+
+// The body as the handler sees it, from memory or read back from the spooled file
+static std::string bodyOf(const HttpRequest &request) {
+    if (!request.body_file_.isFile()) {
+        return request.body_;
+    }
+    std::string body(request.bodySize(), '\0');
+    ssize_t     bytes = pread(request.body_file_.fd(), &body[0], body.size(), 0);
+    return std::string(body, 0, bytes < 0 ? 0 : bytes);
+}
+
+// Every byte value, so a text-only copy would show
+static std::string binaryBody(size_t size) {
+    std::string body;
+    for (size_t i = 0; i < size; ++i) {
+        body += char((i * 7 + i / 256) % 256);
+    }
+    return body;
+}
+
+static HttpParser::State parseBody(HttpParser &parser, const std::string &request) {
+    return parseSplit(parser, request, std::vector<size_t>(1, request.size()));
+}
+
+TEST(httpParserTest, KeepsSmallBodyInMemory) {
+    std::string body = binaryBody(1000);
+    HttpParser  parser;
+    parser.setBodyBuffer(1000);
+    ASSERT_EQ(parseBody(parser, "POST / HTTP/1.1\r\nContent-Length: 1000\r\n\r\n" + body),
+              HttpParser::COMPLETE);
+    EXPECT_FALSE(parser.request().body_file_.isFile());
+    EXPECT_EQ(parser.request().bodySize(), body.size());
+    EXPECT_TRUE(parser.request().body_ == body);
+}
+
+// Past client_body_buffer_size the body goes to a temporary file, unlinked right away
+TEST(httpParserTest, SpoolsLargeBodyToFile) {
+    std::string body = binaryBody(70000);
+    HttpParser  parser;
+    parser.setBodyBuffer(1000);
+    ASSERT_EQ(parseBody(parser, "POST / HTTP/1.1\r\nContent-Length: 70000\r\n\r\n" + body),
+              HttpParser::COMPLETE);
+    const HttpRequest &request = parser.request();
+    ASSERT_TRUE(request.body_file_.isFile());
+    EXPECT_TRUE(request.body_.empty());
+    EXPECT_EQ(request.bodySize(), body.size());
+    EXPECT_TRUE(bodyOf(request) == body);
+
+    struct stat info;
+    ASSERT_EQ(fstat(request.body_file_.fd(), &info), 0);
+    EXPECT_EQ(info.st_nlink, 0u);
+    EXPECT_EQ(info.st_size, off_t(body.size()));
+}
+
+// Decoded chunks fill memory first, then move to the file together with the ones after them
+TEST(httpParserTest, SpoolsChunkedBodyToFile) {
+    std::string body = binaryBody(5000);
+    std::string request("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n");
+    for (size_t pos = 0, size = 1; pos < body.size(); pos += size, size = size * 3 + 1) {
+        size = std::min(size, body.size() - pos);
+        char length[32];
+        snprintf(length, sizeof(length), "%zx\r\n", size);
+        request += length + body.substr(pos, size) + "\r\n";
+    }
+    request += "0\r\n\r\n";
+
+    HttpParser parser;
+    parser.setBodyBuffer(600);
+    ASSERT_EQ(parseBody(parser, request), HttpParser::COMPLETE);
+    ASSERT_TRUE(parser.request().body_file_.isFile());
+    EXPECT_TRUE(parser.request().body_.empty());
+    EXPECT_EQ(parser.request().bodySize(), body.size());
+    EXPECT_TRUE(bodyOf(parser.request()) == body);
+
+    // Read in pieces, the same bytes reach the file
+    std::vector<size_t> cuts;
+    for (size_t cut = 7; cut < request.size(); cut += 97) {
+        cuts.push_back(cut);
+    }
+    cuts.push_back(request.size());
+    HttpParser split;
+    split.setBodyBuffer(600);
+    ASSERT_EQ(parseSplit(split, request, cuts), HttpParser::COMPLETE);
+    ASSERT_TRUE(split.request().body_file_.isFile());
+    EXPECT_TRUE(bodyOf(split.request()) == body);
+}
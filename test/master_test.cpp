@@ -0,0 +1,120 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <set>
+
+#include "master.hpp"
+
+static int pid_pipe[2] = {-1, -1}; // workers write their pid to it once started
+
+// Stands in for the server, runs until it is killed
+static int sleeping_worker(const HttpConfig &) {
+    pid_t pid = getpid();
+    if (write(pid_pipe[1], &pid, sizeof(pid)) != sizeof(pid)) {
+        return EXIT_FAILURE;
+    }
+    while (true) {
+        pause();
+    }
+    return EXIT_SUCCESS;
+}
+
+// Fails like a worker whose port is taken
+static int failing_worker(const HttpConfig &) {
+    return WORKER_STARTUP_FAILURE;
+}
+
+// Pid of the next started worker, -1 if none started within timeout_ms
+static pid_t nextWorker(int timeout_ms) {
+    struct pollfd fd = {pid_pipe[0], POLLIN, 0};
+    pid_t         pid;
+    if (poll(&fd, 1, timeout_ms) != 1 || read(pid_pipe[0], &pid, sizeof(pid)) != sizeof(pid)) {
+        return -1;
+    }
+    return pid;
+}
+
+// Run the master in its own process, it blocks until its workers are gone
+static pid_t startMaster(size_t workers, WorkerFunction worker) {
+    HttpConfig config;
+    config.worker_processes = workers;
+    pid_t pid               = fork();
+    if (pid == 0) {
+        MasterProcess master(config, worker);
+        _exit(master.run());
+    }
+    return pid;
+}
+
+TEST(masterTest, RespawnsKilledWorker) {
+    ASSERT_EQ(pipe(pid_pipe), 0);
+    pid_t master = startMaster(2, sleeping_worker);
+    ASSERT_GT(master, 0);
+
+    std::set<pid_t> workers;
+    workers.insert(nextWorker(5000));
+    workers.insert(nextWorker(5000));
+    ASSERT_EQ(workers.size(), 2u);
+    ASSERT_EQ(workers.count(-1), 0u);
+
+    // A crash gets a new worker, after the respawn delay since it died right away
+    ASSERT_EQ(kill(*workers.begin(), SIGKILL), 0);
+    pid_t respawned = nextWorker(5000 + WORKER_RESPAWN_DELAY * 1000);
+    EXPECT_NE(respawned, -1);
+    EXPECT_EQ(workers.count(respawned), 0u);
+
+    // Stopping the master stops the workers, none is respawned
+    ASSERT_EQ(kill(master, SIGTERM), 0);
+    int status;
+    ASSERT_EQ(waitpid(master, &status, 0), master);
+    ASSERT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), EXIT_SUCCESS);
+    EXPECT_EQ(nextWorker(0), -1);
+    close(pid_pipe[0]);
+    close(pid_pipe[1]);
+}
+
+TEST(masterTest, GivesUpOnWorkersFailingAtStartup) {
+    pid_t master = startMaster(2, failing_worker);
+    ASSERT_GT(master, 0);
+
+    // Respawned WORKER_RESPAWN_LIMIT times at most, then the master exits with a failure
+    int status;
+    ASSERT_EQ(waitpid(master, &status, 0), master);
+    ASSERT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), EXIT_FAILURE);
+}
+
+TEST(masterTest, SingleWorkerReportsStartupFailure) {
+    HttpConfig config;
+    config.worker_processes = 1;
+    MasterProcess master(config, failing_worker);
+    EXPECT_EQ(master.run(), EXIT_FAILURE);
+}
+
+TEST(masterTest, WorkerFailsWhenThePortIsTaken) {
+    struct sockaddr_in addr;
+    socklen_t          addrlen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int taken            = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(bind(taken, reinterpret_cast<struct sockaddr *>(&addr), addrlen), 0);
+    ASSERT_EQ(listen(taken, 1), 0);
+    ASSERT_EQ(getsockname(taken, reinterpret_cast<struct sockaddr *>(&addr), &addrlen), 0);
+
+    HttpConfig   config;
+    ServerConfig server;
+    server.listen = std::make_pair(std::string("127.0.0.1"), int(ntohs(addr.sin_port)));
+    config.servers.push_back(server);
+    EXPECT_EQ(run_worker(config), WORKER_STARTUP_FAILURE);
+    close(taken);
+}
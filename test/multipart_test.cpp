@@ -0,0 +1,135 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <string>
+
+#include "http.hpp"
+#include "multipart.hpp"
+
+// Writes down every callback as text
+class RecordingSink : public MultipartSink {
+   public:
+    bool partBegin(const HttpHeaders &headers) {
+        events += "[";
+        for (size_t i = 0; i < headers.size(); ++i) {
+            events += headers.name(i) + "=" + headers.value(i) + ";";
+        }
+        events += "]";
+        return true;
+    }
+
+    bool partData(const char *data, size_t size) {
+        events.append(data, size);
+        return true;
+    }
+
+    bool partEnd() {
+        events += "|";
+        return true;
+    }
+
+    std::string events;
+};
+
+static const char BODY[] =
+    "preamble\r\n"
+    "--XyZ\r\n"
+    "Content-Disposition: form-data; name=\"a\"\r\n"
+    "\r\n"
+    "one\r\n--XyZ\r\n\r\n--Xy\r\n"
+    "--XyZ  \r\n"
+    "Content-Disposition: form-data; name=\"f\"; filename=\"f.txt\"\r\n"
+    "Content-Type: text/plain\r\n"
+    "\r\n"
+    "\r\n\r\nline\r\n-\r\n"
+    "--XyZ\r\n"
+    "\r\n"
+    "\r\n"
+    "--XyZ--\r\n"
+    "epilogue --XyZ\r\n";
+
+static const char EVENTS[] =
+    "[Content-Disposition=form-data; name=\"a\";]one|"
+    "[]--Xy|"
+    "[Content-Disposition=form-data; name=\"f\"; filename=\"f.txt\";Content-Type=text/plain;]"
+    "\r\n\r\nline\r\n-|"
+    "[]|";
+
+TEST(multipartParserTest, ParsesParts) {
+    MultipartParser parser("XyZ");
+    RecordingSink   sink;
+    EXPECT_EQ(parser.feed(BODY, sizeof(BODY) - 1, sink), MultipartParser::DONE);
+    EXPECT_EQ(sink.events, EVENTS);
+}
+
+TEST(multipartParserTest, CarriesStateAcrossFeeds) {
+    std::string body(BODY);
+    for (size_t split = 0; split <= body.size(); ++split) {
+        MultipartParser parser("XyZ");
+        RecordingSink   sink;
+        parser.feed(body.data(), split, sink);
+        EXPECT_EQ(parser.feed(body.data() + split, body.size() - split, sink),
+                  MultipartParser::DONE);
+        EXPECT_EQ(sink.events, EVENTS) << "split at " << split;
+    }
+
+    MultipartParser parser("XyZ");
+    RecordingSink   sink;
+    for (size_t i = 0; i < body.size(); ++i) {
+        parser.feed(&body[i], 1, sink);
+    }
+    EXPECT_EQ(parser.state(), MultipartParser::DONE);
+    EXPECT_EQ(sink.events, EVENTS);
+}
+
+TEST(multipartParserTest, ManyParts) {
+    std::string body;
+    std::string events;
+    for (int i = 0; i < 1000; ++i) {
+        std::string data(i, 'a' + i % 26);
+        body += "--b\r\n\r\n" + data + "\r\n";
+        events += "[]" + data + "|";
+    }
+    body += "--b--";
+
+    MultipartParser parser("b");
+    RecordingSink   sink;
+    EXPECT_EQ(parser.feed(body.data(), body.size(), sink), MultipartParser::DONE);
+    EXPECT_EQ(sink.events, events);
+}
+
+TEST(multipartParserTest, RejectsMalformedBodies) {
+    const char *bodies[] = {
+        "--b\r\nno colon\r\n\r\n",
+        "--b\r\n: empty name\r\n\r\n",
+        "--bx\r\n\r\n",
+        "--b-x",
+    };
+    for (size_t i = 0; i < sizeof(bodies) / sizeof(bodies[0]); ++i) {
+        MultipartParser parser("b");
+        RecordingSink   sink;
+        EXPECT_EQ(parser.feed(bodies[i], strlen(bodies[i]), sink), MultipartParser::INVALID)
+            << bodies[i];
+    }
+
+    RecordingSink sink;
+    EXPECT_EQ(MultipartParser("").state(), MultipartParser::INVALID);
+    EXPECT_EQ(MultipartParser(std::string(71, 'b')).feed("--", 2, sink),
+              MultipartParser::INVALID);
+
+    std::string headers = "--b\r\nX: " + std::string(MULTIPART_HEADERS_MAX, 'x');
+    MultipartParser parser("b");
+    EXPECT_EQ(parser.feed(headers.data(), headers.size(), sink), MultipartParser::INVALID);
+}
+
+TEST(multipartParserTest, Parameters) {
+    std::string disposition = "form-data; name=\"file\"; filename=\"a \\\"b\\\";c.txt\"";
+    EXPECT_EQ(MultipartParser::parameter(disposition, "name"), "file");
+    EXPECT_EQ(MultipartParser::parameter(disposition, "filename"), "a \"b\";c.txt");
+    EXPECT_EQ(MultipartParser::parameter("multipart/form-data; BOUNDARY= ab-cd ; x", "boundary"),
+              "ab-cd");
+    EXPECT_EQ(MultipartParser::parameter("form-data; filename=", "filename"), "");
+    EXPECT_EQ(MultipartParser::parameter("form-data; name=x", "filename"), "");
+    EXPECT_EQ(MultipartParser::parameter("name=x", "name"), "");
+}
@@ -2,9 +2,12 @@
 
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <string>
 
 #include "config.hpp"
-#include "webserv.hpp"
 
 TEST(parsingTest, GlobalErrorLog) {
     HttpConfig httpConfig;
@@ -16,4 +19,121 @@ TEST(parsingTest, GlobalWorkerConnections) {
     HttpConfig httpConfig;
     parseConfig("../test/parsing_test.conf", httpConfig);
     EXPECT_EQ(httpConfig.error_log, "logs/error.log");
-}
\ No newline at end of file
+}
+// Parse config text through a temporary file, as parseConfig() reads it
+static void parseText(const std::string &text, HttpConfig &httpConfig) {
+    char path[] = "/tmp/webserv-test-XXXXXX";
+    int  fd     = mkstemp(path);
+    ASSERT_NE(fd, -1);
+    ASSERT_EQ(write(fd, text.data(), text.size()), ssize_t(text.size()));
+    close(fd);
+    try {
+        parseConfig(path, httpConfig);
+    } catch (...) {
+        unlink(path);
+        throw;
+    }
+    unlink(path);
+}
+
+// A server listening with the given parameters, its location / holding the given settings
+static std::string serverConfig(const std::string &parameters, const std::string &location,
+                                const std::string &http = "") {
+    return "events {\n  worker_connections 1024;\n}\nhttp {\n  index index.html;\n  " + http +
+           "\n  server {\n    listen 127.0.0.1:8080 " + parameters + ";\n    location / {\n      " +
+           location + "\n    }\n  }\n}\n";
+}
+
+static std::string listenConfig(const std::string &parameters) {
+    return serverConfig(parameters, "autoindex on;");
+}
+
+TEST(parsingTest, ListenParameters) {
+    HttpConfig httpConfig;
+    parseText(listenConfig("backlog=511 deferred fastopen=256 rcvbuf=64k sndbuf=1m"), httpConfig);
+    ASSERT_EQ(httpConfig.servers.size(), 1u);
+    EXPECT_EQ(httpConfig.servers[0].backlog, 511);
+    EXPECT_TRUE(httpConfig.servers[0].deferred);
+    EXPECT_EQ(httpConfig.servers[0].fastopen, 256);
+    EXPECT_EQ(httpConfig.servers[0].rcvbuf, 64 * 1024);
+    EXPECT_EQ(httpConfig.servers[0].sndbuf, 1024 * 1024);
+}
+
+TEST(parsingTest, ListenParameterBounds) {
+    const char *valid[] = {"backlog=1", "backlog=65535", "fastopen=1", "fastopen=65535",
+                           "rcvbuf=1", "rcvbuf=999999999", "sndbuf=2047m", "sndbuf=2097151k"};
+    for (size_t i = 0; i < sizeof(valid) / sizeof(*valid); ++i) {
+        HttpConfig httpConfig;
+        EXPECT_NO_THROW(parseText(listenConfig(valid[i]), httpConfig)) << valid[i];
+    }
+    const char *invalid[] = {"backlog=0",         "backlog=65536",  "backlog=-1",
+                             "backlog=",          "backlog=1k",     "backlog=0000000001",
+                             "fastopen=0",        "fastopen=65536", "rcvbuf=0",
+                             "rcvbuf=2147483648", "rcvbuf=2048m",   "sndbuf=2097152k",
+                             "sndbuf=k",          "sndbuf=1g",      "sndbuf=99999999999",
+                             "reuseport"};
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(*invalid); ++i) {
+        HttpConfig httpConfig;
+        EXPECT_ANY_THROW(parseText(listenConfig(invalid[i]), httpConfig)) << invalid[i];
+    }
+}
+
+TEST(parsingTest, LocationFlags) {
+    HttpConfig httpConfig;
+    parseText(serverConfig("", "sendfile on;\n      tcp_nodelay off;\n      tcp_nopush on;"),
+              httpConfig);
+    ASSERT_EQ(httpConfig.servers.size(), 1u);
+    LocationConfig &location = httpConfig.servers[0].locations["/"];
+    EXPECT_TRUE(location.sendfile);
+    EXPECT_FALSE(location.tcp_nodelay);
+    EXPECT_TRUE(location.tcp_nopush);
+
+    // Unset flags keep their defaults
+    HttpConfig defaults;
+    parseText(listenConfig(""), defaults);
+    EXPECT_FALSE(defaults.servers[0].locations["/"].sendfile);
+    EXPECT_TRUE(defaults.servers[0].locations["/"].tcp_nodelay);
+    EXPECT_FALSE(defaults.servers[0].locations["/"].tcp_nopush);
+
+    const char *invalid[] = {"sendfile yes;", "tcp_nodelay ON;", "tcp_nopush 1;",
+                             "sendfile;",     "tcp_nodelay on off;"};
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(*invalid); ++i) {
+        HttpConfig httpConfig;
+        EXPECT_ANY_THROW(parseText(serverConfig("", invalid[i]), httpConfig)) << invalid[i];
+    }
+}
+
+TEST(parsingTest, TimeoutUnits) {
+    HttpConfig httpConfig;
+    parseText(serverConfig("", "autoindex on;",
+                           "client_header_timeout 250ms;\n  client_body_timeout 7;\n"
+                           "  keepalive_timeout 2m;\n  send_timeout 1h;"),
+              httpConfig);
+    EXPECT_EQ(httpConfig.client_header_timeout, 250u);
+    EXPECT_EQ(httpConfig.client_body_timeout, 7000u);
+    EXPECT_EQ(httpConfig.keepalive_timeout, 120000u);
+    EXPECT_EQ(httpConfig.send_timeout, 3600000u);
+}
+
+// Timeouts are kept within an int of milliseconds, larger values are rejected instead of wrapping
+TEST(parsingTest, TimeoutBounds) {
+    const char *valid[] = {"0", "2147483647ms", "2147483s", "35791m", "596h", "0000000001h"};
+    for (size_t i = 0; i < sizeof(valid) / sizeof(*valid); ++i) {
+        HttpConfig httpConfig;
+        EXPECT_NO_THROW(parseText(
+            serverConfig("", "autoindex on;", std::string("send_timeout ") + valid[i] + ";"),
+            httpConfig))
+            << valid[i];
+    }
+    const char *invalid[] = {"2147483648ms", "2147484s", "35792m",
+                             "597h",         "-1s",      "99999999999",
+                             "18446744073709551617ms",   "s",
+                             "10d",          "1.5s"};
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(*invalid); ++i) {
+        HttpConfig httpConfig;
+        EXPECT_ANY_THROW(parseText(
+            serverConfig("", "autoindex on;", std::string("send_timeout ") + invalid[i] + ";"),
+            httpConfig))
+            << invalid[i];
+    }
+}
@@ -0,0 +1,138 @@
+// Micro-benchmark of request header scanning, run as: ./scanner_bench [iterations]
+//
+// "baseline" splits the header block with memchr() and checks the field names byte by byte
+// against a tchar table, like the parser did before the Scanner. The other rows do the same work
+// with each Scanner level the CPU supports, alone and inside HttpParser. The checksum column is
+// the same for the baseline and the Scanner rows.
+
+#include <time.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "http.hpp"
+#include "scanner.hpp"
+
+static const char REQUEST[] =
+    "GET /assets/images/products/thumbnails/item-20231107.webp?size=small&v=3 HTTP/1.1\r\n"
+    "Host: shop.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/119.0.0.0 Safari/537.36\r\n"
+    "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,fr;q=0.8\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; cart=17,42,256\r\n"
+    "Pragma: no-cache\r\n"
+    "Referer: https://shop.example.com/catalog/summer?page=2\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "\r\n";
+
+static double nowNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static void report(const char *name, double start, size_t iterations, size_t checksum) {
+    double elapsed = nowNanos() - start;
+    printf("%-16s %8.1f ns/request %8.2f GB/s  (%zu)\n", name, elapsed / iterations,
+           (sizeof(REQUEST) - 1) * iterations / elapsed, checksum);
+}
+
+// RFC 9110 tchar, as the parser looked it up before the Scanner
+static bool isTokenChar(unsigned char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c && strchr("!#$%&'*+-.^_`|~", c));
+}
+
+struct TokenTable {
+    TokenTable() {
+        for (int c = 0; c < 256; ++c) {
+            chars[c] = isTokenChar(c);
+        }
+    }
+
+    bool chars[256];
+};
+
+static const TokenTable tokens;
+
+// Line ends and the token at the start of every line, as found before the Scanner
+static size_t baseline(const char *begin, const char *end) {
+    size_t found = 0;
+    while (begin < end) {
+        const char *newline = static_cast<const char *>(memchr(begin, '\n', end - begin));
+        if (!newline) {
+            break;
+        }
+        const char *token = begin;
+        while (token < newline && tokens.chars[static_cast<unsigned char>(*token)]) {
+            ++token;
+        }
+        found += token - begin;
+        begin = newline + 1;
+    }
+    return found;
+}
+
+// The same with a Scanner
+static size_t scan(const Scanner &scanner, const char *begin, const char *end) {
+    size_t found = 0;
+    while (begin < end) {
+        const char *newline = scanner.lineEnd(begin, end);
+        if (newline == end) {
+            break;
+        }
+        found += scanner.tokenEnd(begin, newline) - begin;
+        begin = newline + 1;
+    }
+    return found;
+}
+
+int main(int argc, char **argv) {
+    size_t      iterations = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 1000000;
+    const char *begin      = REQUEST;
+    const char *end        = REQUEST + sizeof(REQUEST) - 1;
+    const char *names[]    = {"scalar", "sse2", "avx2"};
+
+    printf("%zu byte request, %zu iterations, best level: %s\n", sizeof(REQUEST) - 1, iterations,
+           Scanner(Scanner::detect()).name());
+
+    size_t checksum = 0;
+    double start    = nowNanos();
+    for (size_t i = 0; i < iterations; ++i) {
+        checksum += baseline(begin, end);
+    }
+    report("baseline", start, iterations, checksum);
+
+    for (int level = Scanner::SCALAR; level <= Scanner::detect(); ++level) {
+        Scanner scanner(static_cast<Scanner::Level>(level));
+        checksum = 0;
+        start    = nowNanos();
+        for (size_t i = 0; i < iterations; ++i) {
+            checksum += scan(scanner, begin, end);
+        }
+        report(names[level], start, iterations, checksum);
+    }
+
+    // Whole requests through the parser, header storage included
+    for (int level = Scanner::SCALAR; level <= Scanner::detect(); ++level) {
+        Scanner::instance().setLevel(static_cast<Scanner::Level>(level));
+        HttpParser  parser;
+        std::string name = std::string("parser/") + names[level];
+        checksum         = 0;
+        start            = nowNanos();
+        for (size_t i = 0; i < iterations; ++i) {
+            checksum += parser.parse(begin, end - begin) == HttpParser::COMPLETE;
+            parser.reset();
+        }
+        report(name.c_str(), start, iterations, checksum);
+    }
+    return EXIT_SUCCESS;
+}
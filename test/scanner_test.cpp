@@ -0,0 +1,71 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <string>
+
+#include "scanner.hpp"
+
+// Every level the CPU supports must stop on the same byte as the scalar loops
+static void expectSameScans(const std::string &input) {
+    Scanner     scalar(Scanner::SCALAR);
+    const char *begin = input.data();
+    const char *end   = input.data() + input.size();
+    for (int level = Scanner::SSE2; level <= Scanner::detect(); ++level) {
+        Scanner vector(static_cast<Scanner::Level>(level));
+        for (size_t offset = 0; offset <= input.size(); ++offset) {
+            EXPECT_EQ(vector.lineEnd(begin + offset, end), scalar.lineEnd(begin + offset, end));
+            EXPECT_EQ(vector.tokenEnd(begin + offset, end), scalar.tokenEnd(begin + offset, end));
+            EXPECT_EQ(vector.targetEnd(begin + offset, end), scalar.targetEnd(begin + offset, end));
+        }
+    }
+}
+
+TEST(scannerTest, ScalarScans) {
+    Scanner     scanner(Scanner::SCALAR);
+    std::string line("Content-Type: text/html\r\n");
+    const char *end = line.data() + line.size();
+
+    EXPECT_EQ(scanner.lineEnd(line.data(), end), end - 1);
+    EXPECT_EQ(*scanner.tokenEnd(line.data(), end), ':');
+    EXPECT_EQ(scanner.targetEnd(line.data(), end), line.data() + 13);
+    EXPECT_EQ(scanner.lineEnd(line.data(), line.data() + 10), line.data() + 10);
+}
+
+TEST(scannerTest, TokenCharacters) {
+    Scanner     scanner(Scanner::detect());
+    std::string token("X-Custom_Header.v2!#$%&'*+^`|~abcdefghijklmnopqrstuvwxyz0123456789");
+    std::string name = token + token + "(";
+    const char *end  = name.data() + name.size();
+
+    EXPECT_EQ(scanner.tokenEnd(name.data(), end), end - 1);
+    EXPECT_EQ(*scanner.tokenEnd(name.data(), end), '(');
+}
+
+TEST(scannerTest, TargetStopsOnControls) {
+    Scanner     scanner(Scanner::detect());
+    std::string target("/index.html?q=\xc3\xa9t\xc3\xa9&page=2&sort=name-descending");
+    std::string with_tab = target + "\t" + target;
+    std::string with_del = target + "\x7f" + target;
+
+    EXPECT_EQ(scanner.targetEnd(with_tab.data(), with_tab.data() + with_tab.size()),
+              with_tab.data() + target.size());
+    EXPECT_EQ(scanner.targetEnd(with_del.data(), with_del.data() + with_del.size()),
+              with_del.data() + target.size());
+}
+
+TEST(scannerTest, VectorLevelsMatchScalar) {
+    expectSameScans("GET /assets/style.css HTTP/1.1\r\nHost: localhost:9090\r\n\r\n");
+    expectSameScans("Accept-Language: en-US,en;q=0.9\r\nX_Forwarded_For: 10.0.0.1\r\n");
+    expectSameScans(std::string(100, 'a') + "\n" + std::string(70, '-') + ":" + "\x7f\x80");
+
+    // Every byte value at every position of a block
+    srand(42);
+    for (int round = 0; round < 200; ++round) {
+        std::string input(1 + rand() % 96, 'x');
+        for (size_t i = 0; i < input.size(); ++i) {
+            input[i] = rand() % 4 ? 'a' + rand() % 26 : static_cast<char>(rand() % 256);
+        }
+        expectSameScans(input);
+    }
+}
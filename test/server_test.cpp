@@ -1,9 +1,19 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
 
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
 #include <utility>
+#include <vector>
 
-#include "webserv.hpp"
+#include "server.hpp"
 
 using std::pair;
 using std::string;
@@ -18,8 +28,8 @@ class MockSession : public Session {
     MockSession(int sockfd, const struct sockaddr* addr, socklen_t addrlen)
         : Session(sockfd, addr, addrlen) {}
 
-    MOCK_METHOD(void, send, (int client, string message), (const, override));
-    MOCK_METHOD(string, recv, (int client), (const, override));
+    MOCK_METHOD(bool, send, (), (override));
+    MOCK_METHOD(ssize_t, recv, (), (override));
 };
 
 Session* mock_session_generator(int sockfd, const struct sockaddr* addr, socklen_t addrlen) {
@@ -38,12 +48,11 @@ class MockSocket : public Socket {
 };
 
 class MockEventListener : public EventListener {
-    typedef pair<int, InternalEvent> Event;
-
    public:
-    MOCK_METHOD(Event, listen, (), (override));
-    MOCK_METHOD(void, registerEvent, (int fd, int events), (override));
-    MOCK_METHOD(void, unregisterEvent, (int fd), (override));
+    MOCK_METHOD(int, listen, (std::vector<Event> & events, int timeout_ms), (override));
+    MOCK_METHOD(bool, registerEvent, (int fd, InternalEvent events), (override));
+    MOCK_METHOD(void, unregisterEvent, (int fd, InternalEvent events), (override));
+    MOCK_METHOD(void, removeEvent, (int fd), (override));
 };
 
 Socket* mock_socket_generator() {
@@ -52,8 +61,9 @@ Socket* mock_socket_generator() {
 }
 
 TEST(ServerTest, StartAndStop) {
-    // Create a default HttpConfig
+    // Create a default HttpConfig with one server
     HttpConfig httpConfig;
+    httpConfig.servers.push_back(ServerConfig());
 
     // Create a nice mock for EventListener
     NiceMock<MockEventListener> mockEventListener;
@@ -77,3 +87,532 @@ TEST(ServerTest, StartAndStop) {
     // Call the stop() method of the Server object
     server.stop();
 }
+
+/*
+ * The tests below run the real event loop on one end of a socketpair. The listening socket is a
+ * pipe that never becomes readable, its single connection is the server end of the pair. The
+ * listener polls the registered fds and plays the client on the other end, the server is stopped
+ * once the expected responses are in or it closed the connection.
+ */
+
+static int  pair_listen_fd      = -1;    // read end of the pipe standing in for the listening socket
+static int  pair_server_fd      = -1;    // server end of the socketpair, accepted once
+static int  pair_exhausted      = 0;     // accept() calls failing with EMFILE before the pair is handed out
+static int  pair_backlog_fd     = -1;    // server end of a second pair, queued behind the first one
+static int  pair_accepted_fd    = -1;    // server end handed out last
+static bool pair_backlog_waited = false; // the second pair was accepted once the first was closed
+static string pair_fifo;                 // FIFO a pool thread waits on, written once the second pair is accepted
+
+class PairSocket : public Socket {
+   public:
+    PairSocket() : Socket(tcp_session_generator) {
+        pipe_[0] = pipe_[1] = -1;
+    }
+
+    int bind(string, int) {
+        if (pipe(pipe_) == -1) {
+            throw std::runtime_error("pipe");
+        }
+        sockfd_        = pipe_[0];
+        pair_listen_fd = sockfd_;
+        return sockfd_;
+    }
+
+    void listen() {}
+
+    Session* accept() {
+        if (pair_exhausted > 0 && pair_server_fd != -1) {
+            --pair_exhausted;
+            errno = EMFILE;
+            return NULL;
+        }
+        if (pair_server_fd == -1 && pair_backlog_fd != -1) {
+            // Like the kernel, hand out the lowest free number: the first pair's once it is closed
+            pair_backlog_waited = fcntl(pair_accepted_fd, F_GETFD) == -1;
+            if (pair_backlog_waited && dup2(pair_backlog_fd, pair_accepted_fd) != -1) {
+                ::close(pair_backlog_fd);
+                pair_backlog_fd = pair_accepted_fd;
+            }
+            if (!pair_fifo.empty()) {
+                releaseFifo();
+            }
+            std::swap(pair_server_fd, pair_backlog_fd);
+        }
+        if (pair_server_fd == -1) {
+            return NULL;
+        }
+        int fd           = pair_server_fd;
+        pair_server_fd   = -1;
+        pair_accepted_fd = fd;
+        return session_generator_(fd, NULL, 0);
+    }
+
+    void close() {
+        ::close(pipe_[0]);
+        ::close(pipe_[1]);
+    }
+
+   private:
+    // Let the task reading the FIFO finish, it answers a connection gone by now
+    static void releaseFifo() {
+        int fd = open(pair_fifo.c_str(), O_WRONLY | O_NONBLOCK);
+        if (fd != -1) {
+            ssize_t written = write(fd, "stale", 5);
+            (void)written;
+            ::close(fd);
+        }
+        pair_fifo.clear();
+    }
+
+    int pipe_[2];
+};
+
+Socket* pair_socket_generator() {
+    return new PairSocket();
+}
+
+class ClientListener : public EventListener {
+   public:
+    ClientListener(int client_fd, size_t responses, int backlog_fd = -1)
+        : closed(false), backlog_closed(false), open_after_eof(false), pauses(0),
+          client_fd_(client_fd),
+          backlog_fd_(backlog_fd), responses_(responses), rounds_(0), pending_(true) {}
+
+    int listen(std::vector<Event>& events, int) {
+        events.clear();
+        ++rounds_;
+        if (pending_ && interests_[pair_listen_fd] & READABLE) {
+            // The listening socket wakes up and hands out the socketpair, again after a pause
+            pending_ = false;
+            events.push_back(Event(pair_listen_fd, READABLE));
+            return events.size();
+        }
+
+        char    buffer[65536];
+        ssize_t bytes;
+        while ((bytes = recv(client_fd_, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+            received.append(buffer, bytes);
+        }
+        if (bytes == 0 && !closed) {
+            // After a lingering close the server still reads, once closed the send fails with EPIPE
+            open_after_eof = ::send(client_fd_, "more", 4, MSG_DONTWAIT | MSG_NOSIGNAL) == 4;
+        }
+        closed = closed || bytes == 0;
+        while (backlog_fd_ != -1 &&
+               (bytes = recv(backlog_fd_, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+            backlog_received.append(buffer, bytes);
+        }
+        backlog_closed = backlog_closed || (backlog_fd_ != -1 && bytes == 0);
+        bool done = closed || statuses().size() >= responses_;
+        if (backlog_fd_ != -1) {
+            // The second client is served once the first one is gone
+            done = closed && backlog_closed;
+        }
+        if (done || rounds_ > 1000) {
+            events.push_back(Event(SIGTERM, SIGNAL_EVENT));
+            return events.size();
+        }
+
+        std::vector<struct pollfd> fds;
+        for (std::map<int, InternalEvent>::iterator it = interests_.begin(); it != interests_.end();
+             ++it) {
+            struct pollfd fd = {it->first, 0, 0};
+            fd.events |= it->second & READABLE ? POLLIN : 0;
+            fd.events |= it->second & WRITABLE ? POLLOUT : 0;
+            if (fd.events && it->first != pair_listen_fd) {
+                fds.push_back(fd);
+            }
+        }
+        poll(fds.empty() ? NULL : &fds[0], fds.size(), 10);
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                events.push_back(Event(fds[i].fd, READABLE));
+            }
+            if (fds[i].revents & POLLOUT) {
+                events.push_back(Event(fds[i].fd, WRITABLE));
+            }
+        }
+        return events.size();
+    }
+
+    bool registerEvent(int fd, InternalEvent events) {
+        if (events != SIGNAL_EVENT) {
+            interests_[fd] |= events;
+        }
+        return true;
+    }
+
+    void unregisterEvent(int fd, InternalEvent events) {
+        if (fd == pair_listen_fd && interests_[fd] & events & READABLE) {
+            ++pauses;
+            pending_ = pair_server_fd != -1 || pair_backlog_fd != -1;
+        }
+        interests_[fd] &= ~events;
+    }
+
+    void removeEvent(int fd) {
+        interests_.erase(fd);
+    }
+
+    // Status codes of the complete responses, framed by their Content-Length
+    std::vector<int> statuses(std::vector<string>* bodies = NULL) const {
+        std::vector<int> statuses;
+        size_t           pos = 0;
+        size_t           end;
+        while ((end = received.find("\r\n\r\n", pos)) != string::npos) {
+            string head   = received.substr(pos, end - pos);
+            size_t length = head.find("Content-Length: ");
+            size_t size   = length == string::npos ? 0 : atol(head.c_str() + length + 16);
+            if (end + 4 + size > received.size()) {
+                break;
+            }
+            statuses.push_back(atoi(head.c_str() + 9));
+            if (bodies) {
+                bodies->push_back(received.substr(end + 4, size));
+            }
+            pos = end + 4 + size;
+        }
+        return statuses;
+    }
+
+    string received;         /**< Everything the server sent */
+    string backlog_received; /**< Everything the server sent to the second client */
+    bool   closed;           /**< The server closed the connection */
+    bool   backlog_closed;   /**< The server closed the second connection */
+    bool   open_after_eof;   /**< The server still read once it shut down its side */
+    int    pauses;           /**< Times the listening socket was unregistered */
+
+   private:
+    std::map<int, InternalEvent> interests_; // events registered per fd
+    int                          client_fd_;
+    int                          backlog_fd_; // client end of the second pair, or -1
+    size_t                       responses_; // responses to wait for before stopping
+    int                          rounds_;    // listen() calls, a stuck test still ends
+    bool                         pending_;   // the listening socket has a connection to report
+};
+
+class PipelineTest : public ::testing::Test {
+   protected:
+    void SetUp() {
+        char path[] = "/tmp/webserv-test-XXXXXX";
+        ASSERT_TRUE(mkdtemp(path) != NULL);
+        root_ = path;
+
+        ServerConfig server;
+        server.listen = std::make_pair(string("127.0.0.1"), 8080);
+        server.root   = root_;
+        LocationConfig location;
+        location.root        = root_;
+        location.tcp_nodelay = false;
+        location.limit_except.push_back(GET);
+        location.limit_except.push_back(POST);
+        server.locations["/"] = location;
+        config_.servers.push_back(server);
+    }
+
+    void TearDown() {
+        for (size_t i = 0; i < files_.size(); ++i) {
+            unlink((root_ + files_[i]).c_str());
+        }
+        rmdir(root_.c_str());
+    }
+
+    // A file under the root, returns its uri
+    string addFile(const string& name, const string& content) {
+        std::ofstream file((root_ + "/" + name).c_str());
+        file << content;
+        files_.push_back("/" + name);
+        return files_.back();
+    }
+
+    static string get(const string& uri, const string& headers = "") {
+        return "GET " + uri + " HTTP/1.1\r\nHost: localhost:8080\r\n" + headers + "\r\n";
+    }
+
+    // Write the requests at once and run the server until the client saw enough
+    void serve(ClientListener& client, int client_fd, int server_fd, const string& requests) {
+        fcntl(server_fd, F_SETFL, O_NONBLOCK);
+        ASSERT_EQ(write(client_fd, requests.data(), requests.size()), ssize_t(requests.size()));
+        pair_server_fd = server_fd;
+        HttpServer server(config_, &client, pair_socket_generator);
+        server.start(true);
+    }
+
+    HttpConfig          config_;
+    string              root_;
+    std::vector<string> files_;
+};
+
+// More requests than PIPELINE_MAX, served by the pool in whatever order the files are read: the
+// responses still come back in request order, the error ones included, then the connection closes
+TEST_F(PipelineTest, RespondsInRequestOrder) {
+    std::vector<string> expected;
+    string              requests;
+    for (int i = 0; i < PIPELINE_MAX + 8; ++i) {
+        // The first file is large so the ones after it are read first
+        string content(i == 0 ? 4 * 1024 * 1024 : 100 + i * 37, char('a' + i % 26));
+        requests += get(addFile("f" + std::to_string(i), content));
+        expected.push_back(content);
+    }
+    requests += get("/missing");
+    requests += "BROKEN\r\n\r\n";
+
+    int pair[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    ClientListener client(pair[1], size_t(-1));
+    serve(client, pair[1], pair[0], requests);
+
+    std::vector<string> bodies;
+    std::vector<int>    statuses = client.statuses(&bodies);
+    ASSERT_EQ(statuses.size(), expected.size() + 2);
+    for (size_t i = 0; i < expected.size(); ++i) {
+        EXPECT_EQ(statuses[i], 200) << "response " << i;
+        EXPECT_TRUE(bodies[i] == expected[i]) << "response " << i;
+    }
+    EXPECT_EQ(statuses[expected.size()], 404);
+    EXPECT_EQ(statuses.back(), 400);
+    EXPECT_TRUE(client.closed);
+
+    close(pair[0]);
+    close(pair[1]);
+}
+
+// The response to a request asking to close is the last one, the requests behind it are dropped
+TEST_F(PipelineTest, ClosesAfterConnectionClose) {
+    string uri = addFile("a", "first");
+    addFile("b", "second");
+
+    int pair[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    ClientListener client(pair[1], size_t(-1));
+    serve(client, pair[1], pair[0], get(uri) + get("/b", "Connection: close\r\n") + get(uri));
+
+    std::vector<string> bodies;
+    EXPECT_EQ(client.statuses(&bodies).size(), 2u);
+    ASSERT_EQ(bodies.size(), 2u);
+    EXPECT_EQ(bodies[1], "second");
+    EXPECT_NE(client.received.find("Connection: close"), string::npos);
+    EXPECT_TRUE(client.closed);
+
+    close(pair[0]);
+    close(pair[1]);
+}
+
+TEST_F(PipelineTest, ClosesAfterKeepaliveRequests) {
+    config_.keepalive_requests = 2;
+    string uri                 = addFile("a", "content");
+
+    int pair[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    ClientListener client(pair[1], size_t(-1));
+    serve(client, pair[1], pair[0], get(uri) + get(uri) + get(uri));
+
+    EXPECT_EQ(client.statuses().size(), 2u);
+    EXPECT_TRUE(client.closed);
+
+    close(pair[0]);
+    close(pair[1]);
+}
+
+TEST_F(PipelineTest, KeepaliveTimeoutZeroCloses) {
+    config_.keepalive_timeout = 0;
+    string uri                = addFile("a", "content");
+
+    int pair[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    ClientListener client(pair[1], size_t(-1));
+    serve(client, pair[1], pair[0], get(uri) + get(uri));
+
+    EXPECT_EQ(client.statuses().size(), 1u);
+    EXPECT_TRUE(client.closed);
+
+    close(pair[0]);
+    close(pair[1]);
+}
+
+// A persistent connection stays open once its responses are out
+TEST_F(PipelineTest, KeepsPersistentConnectionsOpen) {
+    string uri = addFile("a", "content");
+
+    int pair[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    ClientListener client(pair[1], 3);
+    serve(client, pair[1], pair[0], get(uri) + get(uri) + get(uri));
+
+    EXPECT_EQ(client.statuses().size(), 3u);
+    EXPECT_EQ(client.received.find("Connection: close"), string::npos);
+    EXPECT_FALSE(client.closed);
+
+    close(pair[0]);
+    close(pair[1]);
+}
+
+// Out of descriptors, the connection stays in the backlog: accepting pauses instead of spinning on
+// the readable listening socket, and resumes after ACCEPT_RETRY_MS
+TEST_F(PipelineTest, PausesAcceptWhenOutOfDescriptors) {
+    string uri = addFile("a", "first");
+
+    int pair[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    ClientListener client(pair[1], 1);
+    pair_exhausted      = 1;
+    unsigned long start = monotonicMillis();
+    serve(client, pair[1], pair[0], get(uri));
+
+    EXPECT_EQ(pair_exhausted, 0);
+    EXPECT_EQ(client.pauses, 1);
+    EXPECT_GE(monotonicMillis() - start, static_cast<unsigned long>(ACCEPT_RETRY_MS));
+    std::vector<int> statuses = client.statuses();
+    ASSERT_EQ(statuses.size(), 1u);
+    EXPECT_EQ(statuses[0], 200);
+
+    close(pair[0]);
+    close(pair[1]);
+}
+
+// A body past client_body_buffer_size is spooled, the script reads it from that file on stdin
+TEST_F(PipelineTest, PassesSpooledBodyToCgi) {
+    config_.client_body_buffer_size               = 64;
+    config_.servers[0].locations["/"].cgi_enabled = true;
+    config_.servers[0].locations["/"].cgi_ext.push_back(".sh");
+    // Says whether stdin is a pipe or the file, then echoes it
+    string script = addFile("echo.sh",
+                            "#!/bin/sh\nprintf 'Content-Type: text/plain\\n\\n'\n"
+                            "if [ -p /dev/stdin ]; then echo pipe; else echo file; fi\ncat\n");
+    ASSERT_EQ(chmod((root_ + script).c_str(), 0700), 0);
+
+    string body;
+    for (int i = 0; i < 5000; ++i) {
+        body += char('a' + i % 26);
+    }
+    int pair[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    ClientListener client(pair[1], 1);
+    serve(client, pair[1], pair[0],
+          "POST " + script + " HTTP/1.1\r\nHost: localhost:8080\r\nContent-Length: " +
+              std::to_string(body.size()) + "\r\n\r\n" + body);
+
+    std::vector<string> bodies;
+    std::vector<int>    statuses = client.statuses(&bodies);
+    ASSERT_EQ(statuses.size(), 1u);
+    EXPECT_EQ(statuses[0], 200);
+    string expected = "file\n" + body;
+    ASSERT_GE(bodies[0].size(), expected.size());
+    EXPECT_TRUE(bodies[0].compare(bodies[0].size() - expected.size(), expected.size(), expected) ==
+                0);
+
+    close(pair[0]);
+    close(pair[1]);
+}
+
+// With worker_connections 1 the second connection stays in the backlog, it is accepted once the
+// first one is closed
+TEST_F(PipelineTest, QueuesConnectionsPastWorkerConnections) {
+    config_.worker_connections = 1;
+    string uri                 = addFile("a", "content");
+
+    int first[2];
+    int second[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, first), 0);
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, second), 0);
+    string close_request = get(uri, "Connection: close\r\n");
+    ASSERT_EQ(write(second[1], close_request.data(), close_request.size()),
+              ssize_t(close_request.size()));
+    fcntl(second[0], F_SETFL, O_NONBLOCK);
+    pair_backlog_fd     = second[0];
+    pair_backlog_waited = false;
+    ClientListener client(first[1], size_t(-1), second[1]);
+    serve(client, first[1], first[0], close_request);
+
+    EXPECT_EQ(pair_backlog_fd, -1);
+    EXPECT_TRUE(pair_backlog_waited);
+    EXPECT_EQ(client.pauses, 2);
+    EXPECT_EQ(client.statuses().size(), 1u);
+    EXPECT_TRUE(client.closed);
+    EXPECT_TRUE(client.backlog_closed);
+    EXPECT_EQ(client.backlog_received.compare(0, 15, "HTTP/1.1 200 OK"), 0);
+
+    close(first[1]);
+    close(second[1]);
+}
+
+// Past worker_connections the fd table grows to fit the new descriptor
+TEST_F(PipelineTest, GrowsFdTableForHighDescriptors) {
+    config_.worker_connections = 1;
+    string uri                 = addFile("a", "content");
+
+    int pair[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    int high = fcntl(pair[0], F_DUPFD, 300);
+    ASSERT_GE(high, 300);
+    close(pair[0]);
+    ClientListener client(pair[1], 2);
+    serve(client, pair[1], high, get(uri) + get(uri));
+
+    std::vector<string> bodies;
+    std::vector<int>    statuses = client.statuses(&bodies);
+    ASSERT_EQ(statuses.size(), 2u);
+    EXPECT_EQ(statuses[1], 200);
+    EXPECT_EQ(bodies[1], "content");
+
+    close(high);
+    close(pair[1]);
+}
+
+// A session times out while its response is read from a FIFO on the pool. Its fd is reused by the
+// next connection before the task completes: the generation tells them apart and the late response
+// is dropped instead of going to the new client
+TEST_F(PipelineTest, DropsResponseOfReusedFd) {
+    config_.worker_connections = 1;
+    config_.send_timeout       = 50;
+    string uri                 = addFile("a", "content");
+    ASSERT_EQ(mkfifo((root_ + "/fifo").c_str(), 0600), 0);
+    files_.push_back("/fifo");
+    pair_fifo = root_ + "/fifo";
+
+    int first[2];
+    int second[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, first), 0);
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, second), 0);
+    string request = get(uri, "Connection: close\r\n");
+    ASSERT_EQ(write(second[1], request.data(), request.size()), ssize_t(request.size()));
+    fcntl(second[0], F_SETFL, O_NONBLOCK);
+    pair_backlog_fd     = second[0];
+    pair_backlog_waited = false;
+    ClientListener client(first[1], size_t(-1), second[1]);
+    serve(client, first[1], first[0], get("/fifo"));
+
+    EXPECT_TRUE(pair_fifo.empty());
+    EXPECT_TRUE(pair_backlog_waited);
+    EXPECT_EQ(client.statuses().size(), 0u);
+    EXPECT_TRUE(client.closed);
+    EXPECT_TRUE(client.backlog_closed);
+    EXPECT_EQ(client.backlog_received.compare(0, 15, "HTTP/1.1 200 OK"), 0);
+    EXPECT_EQ(client.backlog_received.find("stale"), string::npos);
+    EXPECT_NE(client.backlog_received.find("content"), string::npos);
+
+    close(first[1]);
+    close(second[1]);
+}
+
+// A body over client_max_body_size is answered before it is read. The server shuts down its side
+// and drains the rest instead of closing with unread input, which would reset the connection
+TEST_F(PipelineTest, LingersAfterEarlyReject) {
+    config_.client_max_body_size = 100;
+
+    int pair[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    ClientListener client(pair[1], size_t(-1));
+    serve(client, pair[1], pair[0],
+          "POST /a HTTP/1.1\r\nHost: localhost:8080\r\nContent-Length: 100000\r\n\r\n" +
+              string(1000, 'b'));
+
+    std::vector<int> statuses = client.statuses();
+    ASSERT_EQ(statuses.size(), 1u);
+    EXPECT_EQ(statuses[0], 413);
+    EXPECT_NE(client.received.find("Connection: close"), string::npos);
+    EXPECT_TRUE(client.closed);
+    EXPECT_TRUE(client.open_after_eof);
+
+    close(pair[1]);
+}
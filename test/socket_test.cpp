@@ -1,8 +1,368 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
 
-#include "webserv.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "socket.hpp"
 
 TEST(socketTest, BasicAssertions) {
     EXPECT_TRUE(true);
 }
+
+// Unlinked temporary file holding content, owned by the returned descriptor
+static int tempFile(const std::string &content) {
+    char path[] = "/tmp/webserv-test-XXXXXX";
+    int  fd     = mkstemp(path);
+    unlink(path);
+    if (fd != -1 && write(fd, content.data(), content.size()) != ssize_t(content.size())) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static std::string iovString(const struct iovec &iov) {
+    return std::string(static_cast<const char *>(iov.iov_base), iov.iov_len);
+}
+
+TEST(sendQueueTest, GathersUpToTheFirstFile) {
+    std::string first("abc");
+    std::string second("defgh");
+    std::string last("ij");
+    std::string empty;
+    int         fd = tempFile("0123456789");
+    ASSERT_NE(fd, -1);
+
+    SendQueue queue;
+    queue.push(SendSegment(first));
+    queue.push(SendSegment(empty));
+    queue.push(SendSegment(second));
+    queue.push(SendSegment(fd, 2, 5));
+    queue.push(SendSegment(last));
+    EXPECT_TRUE(first.empty());
+    EXPECT_EQ(queue.size(), 3u + 5 + 5 + 2);
+
+    struct iovec iov[SEND_IOV_MAX];
+    int          count;
+    EXPECT_EQ(queue.gather(iov, SEND_IOV_MAX, count), 8u);
+    ASSERT_EQ(count, 2);
+    EXPECT_EQ(iovString(iov[0]), "abc");
+    EXPECT_EQ(iovString(iov[1]), "defgh");
+    EXPECT_EQ(queue.gather(iov, 1, count), 3u);
+    EXPECT_EQ(count, 1);
+}
+
+TEST(sendQueueTest, ConsumesAcrossSegmentBoundaries) {
+    std::string first("abc");
+    std::string second("defgh");
+    std::string last("ij");
+    int         fd = tempFile("0123456789");
+    ASSERT_NE(fd, -1);
+
+    SendQueue queue;
+    queue.push(SendSegment(first));
+    queue.push(SendSegment(second));
+    queue.push(SendSegment(fd, 2, 5));
+    queue.push(SendSegment(last));
+
+    // A partial send stops inside the first segment
+    struct iovec iov[SEND_IOV_MAX];
+    int          count;
+    queue.consume(2);
+    EXPECT_EQ(queue.sent(), 2u);
+    EXPECT_EQ(queue.gather(iov, SEND_IOV_MAX, count), 6u);
+    EXPECT_EQ(iovString(iov[0]), "c");
+    EXPECT_EQ(iovString(iov[1]), "defgh");
+
+    // Then one crosses into the second
+    queue.consume(3);
+    EXPECT_EQ(queue.front().data()[queue.sent()], 'f');
+    EXPECT_EQ(queue.gather(iov, SEND_IOV_MAX, count), 3u);
+    EXPECT_EQ(iovString(iov[0]), "fgh");
+
+    // The file segment is reached by offset, not gathered
+    queue.consume(3);
+    ASSERT_TRUE(queue.front().isFile());
+    EXPECT_EQ(queue.sent(), 0u);
+    EXPECT_EQ(queue.gather(iov, SEND_IOV_MAX, count), 0u);
+    EXPECT_EQ(count, 0);
+    queue.consume(4);
+    EXPECT_EQ(queue.front().offset() + off_t(queue.sent()), 6);
+
+    queue.consume(1);
+    EXPECT_EQ(queue.gather(iov, SEND_IOV_MAX, count), 2u);
+    EXPECT_EQ(iovString(iov[0]), "ij");
+
+    // Consuming past the end empties the queue
+    queue.consume(100);
+    EXPECT_TRUE(queue.empty());
+    EXPECT_EQ(queue.size(), 0u);
+}
+
+static void *copySegment(void *segment) {
+    for (int i = 0; i < 100000; ++i) {
+        SendSegment copy(*static_cast<SendSegment *>(segment));
+        SendSegment other;
+        other = copy;
+    }
+    return NULL;
+}
+
+// Copies go away on the event loop and on the pool threads at once, the file is closed exactly
+// when the last one does
+TEST(sendSegmentTest, SharesAcrossThreads) {
+    int fd = tempFile("content");
+    ASSERT_NE(fd, -1);
+    SendSegment *segment = new SendSegment(fd, 0, 7);
+
+    pthread_t threads[4];
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_EQ(pthread_create(&threads[i], NULL, copySegment, segment), 0);
+    }
+    for (int i = 0; i < 4; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    EXPECT_NE(fcntl(fd, F_GETFD), -1);
+    EXPECT_EQ(segment->size(), 7u);
+
+    delete segment;
+    EXPECT_EQ(fcntl(fd, F_GETFD), -1);
+    EXPECT_EQ(errno, EBADF);
+}
+
+// A send buffer much smaller than the response forces partial sends, the peer still gets every
+// byte in order, the file range included
+TEST(tcpSessionTest, ResumesPartialSends) {
+    int pair[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    fcntl(pair[0], F_SETFL, O_NONBLOCK);
+    int size = 4096;
+    setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    std::string head("HEAD\r\n");
+    std::string body;
+    for (int i = 0; i < 200000; ++i) {
+        body += static_cast<char>('a' + i % 26);
+    }
+    std::string file_content(100000, 'f');
+    std::string tail("TAIL");
+    std::string expected = head + body + file_content.substr(10) + tail;
+    int         fd       = tempFile(file_content);
+    ASSERT_NE(fd, -1);
+
+    TcpSession *session = new TcpSession(pair[0], NULL, 0);
+    session->addSendQueue(head);
+    session->addSendQueue(body);
+    session->addSendQueue(SendSegment(fd, 10, file_content.size() - 10));
+    session->addSendQueue(tail);
+
+    std::string received;
+    int         partial = 0;
+    bool        done    = false;
+    while (!done) {
+        done = session->send();
+        if (!done) {
+            ++partial;
+        }
+        char    buffer[8192];
+        ssize_t bytes;
+        while ((bytes = recv(pair[1], buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+            received.append(buffer, bytes);
+        }
+    }
+    EXPECT_GT(partial, 0);
+    EXPECT_EQ(session->sendQueueSize(), 0u);
+    EXPECT_EQ(received.size(), expected.size());
+    EXPECT_TRUE(received == expected);
+
+    delete session;
+    close(pair[0]);
+    close(pair[1]);
+}
+
+TEST(slabPoolTest, ReusesReleasedObjects) {
+    SlabPool pool(24, 4);
+    EXPECT_EQ(pool.objectSize() % sizeof(long double), 0u);
+    EXPECT_GE(pool.objectSize(), 24u);
+    EXPECT_EQ(pool.available(), 0u);
+
+    // The first allocation carves a whole slab
+    void *first  = pool.allocate();
+    void *second = pool.allocate();
+    EXPECT_EQ(pool.available(), 2u);
+    EXPECT_EQ(static_cast<char *>(second) - static_cast<char *>(first),
+              static_cast<ptrdiff_t>(pool.objectSize()));
+
+    // Released objects come back first, most recent first
+    pool.deallocate(first);
+    pool.deallocate(second);
+    EXPECT_EQ(pool.allocate(), second);
+    EXPECT_EQ(pool.allocate(), first);
+
+    // A full slab grows the pool by another one
+    void *objects[3];
+    for (int i = 0; i < 3; ++i) {
+        objects[i] = pool.allocate();
+    }
+    EXPECT_EQ(pool.available(), 3u);
+    for (int i = 0; i < 3; ++i) {
+        pool.deallocate(objects[i]);
+    }
+    pool.deallocate(first);
+    pool.deallocate(second);
+    EXPECT_EQ(pool.available(), 8u);
+}
+
+TEST(slabPoolTest, ReserveFillsWithoutGrowingLater) {
+    SlabPool pool(8, 4);
+    pool.reserve(10);
+    EXPECT_EQ(pool.available(), 12u);
+    pool.reserve(12);
+    EXPECT_EQ(pool.available(), 12u);
+
+    std::vector<void *> objects;
+    for (int i = 0; i < 12; ++i) {
+        objects.push_back(pool.allocate());
+    }
+    EXPECT_EQ(pool.available(), 0u);
+    for (size_t i = 0; i < objects.size(); ++i) {
+        pool.deallocate(objects[i]);
+    }
+    EXPECT_EQ(pool.available(), 12u);
+}
+
+// Sessions come from the pool and go back to it, the next accept reuses the same memory
+TEST(slabPoolTest, RecyclesSessions) {
+    TcpSession::reserve(4);
+    TcpSession *session = new TcpSession(-1, NULL, 0);
+    void       *memory  = session;
+    delete session;
+    session = new TcpSession(-1, NULL, 0);
+    EXPECT_EQ(static_cast<void *>(session), memory);
+    delete session;
+}
+
+static int intOption(int fd, int level, int name) {
+    int       value  = -1;
+    socklen_t length = sizeof(value);
+    if (getsockopt(fd, level, name, &value, &length) == -1) {
+        return -1;
+    }
+    return value;
+}
+
+// Listening socket on a free loopback port, fd is set to its descriptor
+static TcpSocket *listenOnLoopback(const SocketOptions &options, int &fd) {
+    TcpSocket *socket = new TcpSocket();
+    socket->setOptions(options);
+    fd = socket->bind("127.0.0.1", 0);
+    socket->listen();
+    return socket;
+}
+
+// A client connected to the listening socket fd, blocking
+static int connectTo(int fd) {
+    struct sockaddr_in addr;
+    socklen_t          length = sizeof(addr);
+    getsockname(fd, reinterpret_cast<struct sockaddr *>(&addr), &length);
+    int client = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(client, reinterpret_cast<struct sockaddr *>(&addr), length) == -1) {
+        close(client);
+        return -1;
+    }
+    return client;
+}
+
+TEST(tcpSocketTest, AppliesListenOptions) {
+    SocketOptions options;
+    options.reuseport    = true;
+    options.defer_accept = 5;
+    options.fastopen     = 16;
+    options.rcvbuf       = 65536;
+    options.sndbuf       = 32768;
+    int        fd;
+    int        defaults_fd;
+    TcpSocket *socket   = listenOnLoopback(options, fd);
+    TcpSocket *defaults = listenOnLoopback(SocketOptions(), defaults_fd);
+
+    EXPECT_EQ(intOption(fd, SOL_SOCKET, SO_ACCEPTCONN), 1);
+    EXPECT_EQ(intOption(fd, SOL_SOCKET, SO_REUSEADDR), 1);
+    EXPECT_EQ(intOption(fd, SOL_SOCKET, SO_REUSEPORT), 1);
+    EXPECT_EQ(intOption(defaults_fd, SOL_SOCKET, SO_REUSEPORT), 0);
+    // The kernel doubles the buffer sizes for its own bookkeeping
+    EXPECT_GE(intOption(fd, SOL_SOCKET, SO_RCVBUF), 65536);
+    EXPECT_GE(intOption(fd, SOL_SOCKET, SO_SNDBUF), 32768);
+#ifdef TCP_DEFER_ACCEPT
+    // Rounded up to whole SYN-ACK retransmissions
+    EXPECT_GE(intOption(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT), 5);
+    EXPECT_EQ(intOption(defaults_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT), 0);
+#endif
+#ifdef TCP_FASTOPEN
+    EXPECT_EQ(intOption(fd, IPPROTO_TCP, TCP_FASTOPEN), 16);
+    EXPECT_EQ(intOption(defaults_fd, IPPROTO_TCP, TCP_FASTOPEN), 0);
+#endif
+
+    socket->close();
+    defaults->close();
+    delete socket;
+    delete defaults;
+}
+
+// tcp_nodelay sets TCP_NODELAY right away, tcp_nopush corks the socket while a response is sent
+TEST(tcpSessionTest, TogglesNoDelayAndNoPush) {
+    int        listen_fd;
+    TcpSocket *socket = listenOnLoopback(SocketOptions(), listen_fd);
+    int        client = connectTo(listen_fd);
+    ASSERT_NE(client, -1);
+    Session *session = socket->accept();
+    ASSERT_TRUE(session != NULL);
+    int fd = session->getSockFd();
+
+    EXPECT_EQ(intOption(fd, IPPROTO_TCP, TCP_NODELAY), 0);
+    session->setNoDelay(true);
+    EXPECT_NE(intOption(fd, IPPROTO_TCP, TCP_NODELAY), 0);
+    session->setNoDelay(false);
+    EXPECT_EQ(intOption(fd, IPPROTO_TCP, TCP_NODELAY), 0);
+
+#ifdef TCP_CORK
+    // A response larger than the socket buffers stays corked until its last byte is sent
+    std::string body(16 * 1024 * 1024, 'b');
+    session->setNoPush(true);
+    session->addSendQueue(body);
+    EXPECT_FALSE(session->send());
+    EXPECT_NE(intOption(fd, IPPROTO_TCP, TCP_CORK), 0);
+    size_t received = 0;
+    for (bool done = false; !done;) {
+        struct pollfd readable = {client, POLLIN, 0};
+        poll(&readable, 1, 100);
+        char    buffer[65536];
+        ssize_t bytes;
+        while ((bytes = recv(client, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+            received += bytes;
+        }
+        done = session->send();
+    }
+    EXPECT_EQ(intOption(fd, IPPROTO_TCP, TCP_CORK), 0);
+    EXPECT_GT(received, 0u);
+
+    // Off again, the next response is not corked
+    std::string small("small");
+    session->setNoPush(false);
+    session->addSendQueue(small);
+    EXPECT_TRUE(session->send());
+    EXPECT_EQ(intOption(fd, IPPROTO_TCP, TCP_CORK), 0);
+#endif
+
+    delete session;
+    close(fd);
+    close(client);
+    socket->close();
+    delete socket;
+}
@@ -0,0 +1,193 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <map>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+static int runs      = 0; // tasks run, changed atomically
+static int destroyed = 0; // tasks deleted, changed atomically
+
+// Records the pool thread it ran on and its place among the tasks of that thread
+class CountingTask : public ThreadTask {
+   public:
+    explicit CountingTask(int id = 0, int delay_us = 0)
+        : id(id), thread(0), order(0), delay_us_(delay_us) {}
+
+    ~CountingTask() {
+        __atomic_add_fetch(&destroyed, 1, __ATOMIC_RELAXED);
+    }
+
+    void run() {
+        // Every thread counts its own tasks, they are completed in that order
+        static __thread int ran = 0;
+        if (delay_us_ > 0) {
+            usleep(delay_us_);
+        }
+        thread = pthread_self();
+        order  = ran++;
+        __atomic_add_fetch(&runs, 1, __ATOMIC_RELAXED);
+    }
+
+    int       id;
+    pthread_t thread;
+    int       order;
+
+   private:
+    int delay_us_;
+};
+
+// Blocks its thread until open() is called, so the next tasks stay queued
+class GateTask : public CountingTask {
+   public:
+    GateTask() : started_(false), open_(false) {
+        pthread_mutex_init(&mutex_, NULL);
+        pthread_cond_init(&cond_, NULL);
+    }
+
+    ~GateTask() {
+        pthread_cond_destroy(&cond_);
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    void run() {
+        pthread_mutex_lock(&mutex_);
+        started_ = true;
+        pthread_cond_broadcast(&cond_);
+        while (!open_) {
+            pthread_cond_wait(&cond_, &mutex_);
+        }
+        pthread_mutex_unlock(&mutex_);
+        CountingTask::run();
+    }
+
+    void waitStarted() {
+        pthread_mutex_lock(&mutex_);
+        while (!started_) {
+            pthread_cond_wait(&cond_, &mutex_);
+        }
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    void open() {
+        pthread_mutex_lock(&mutex_);
+        open_ = true;
+        pthread_cond_broadcast(&cond_);
+        pthread_mutex_unlock(&mutex_);
+    }
+
+   private:
+    pthread_mutex_t mutex_;
+    pthread_cond_t  cond_;
+    bool            started_;
+    bool            open_;
+};
+
+// Wait on the pipe like the event loop and collect until count tasks came back
+static bool collectAll(ThreadPool &pool, size_t count, std::vector<ThreadTask *> &collected) {
+    std::vector<ThreadTask *> batch;
+    while (collected.size() < count) {
+        struct pollfd fd = {pool.notifyFd(), POLLIN, 0};
+        if (poll(&fd, 1, 2000) != 1) {
+            return false; // a completion did not wake the loop up
+        }
+        pool.collect(batch);
+        collected.insert(collected.end(), batch.begin(), batch.end());
+    }
+    return true;
+}
+
+static void deleteAll(std::vector<ThreadTask *> &tasks) {
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        delete tasks[i];
+    }
+    tasks.clear();
+}
+
+TEST(threadPoolTest, RefusesPostWhenQueueIsFull) {
+    ThreadPool pool(1, 1);
+    GateTask  *gate = new GateTask();
+    ASSERT_TRUE(pool.post(gate));
+    gate->waitStarted();
+
+    // The thread is busy, one task fits in the queue
+    ASSERT_TRUE(pool.post(new CountingTask(1)));
+    CountingTask refused(2);
+    EXPECT_FALSE(pool.post(&refused));
+
+    gate->open();
+    std::vector<ThreadTask *> collected;
+    ASSERT_TRUE(collectAll(pool, 2, collected));
+    EXPECT_EQ(collected[0], gate);
+    EXPECT_EQ(static_cast<CountingTask *>(collected[1])->id, 1);
+    deleteAll(collected);
+}
+
+TEST(threadPoolTest, CollectsInCompletionOrder) {
+    ThreadPool pool(1, 64);
+    for (int i = 0; i < 20; ++i) {
+        ASSERT_TRUE(pool.post(new CountingTask(i, i % 3 * 1000)));
+    }
+
+    // A single thread completes them in posting order, whatever the batches were
+    std::vector<ThreadTask *> collected;
+    ASSERT_TRUE(collectAll(pool, 20, collected));
+    ASSERT_EQ(collected.size(), 20u);
+    for (int i = 0; i < 20; ++i) {
+        EXPECT_EQ(static_cast<CountingTask *>(collected[i])->id, i);
+    }
+
+    // Everything was taken, the pipe is drained
+    struct pollfd fd = {pool.notifyFd(), POLLIN, 0};
+    EXPECT_EQ(poll(&fd, 1, 0), 0);
+    deleteAll(collected);
+}
+
+TEST(threadPoolTest, ReleaseDropsQueuedTasks) {
+    runs      = 0;
+    destroyed = 0;
+    {
+        ThreadPool pool(1, 16);
+        ASSERT_TRUE(pool.post(new CountingTask(0, 100 * 1000)));
+        for (int i = 1; i < 6; ++i) {
+            ASSERT_TRUE(pool.post(new CountingTask(i)));
+        }
+        // Destroyed while the first task runs, with the others still queued
+        usleep(10 * 1000);
+    }
+    EXPECT_EQ(runs, 1);
+    EXPECT_EQ(destroyed, 6);
+}
+
+// Pool threads push onto the completion stack while the loop drains the pipe and takes it: no
+// wakeup is lost, every task comes back once, and each thread's tasks in the order it ran them
+TEST(threadPoolTest, CollectsFromManyThreads) {
+    const int  tasks = 20000;
+    ThreadPool pool(8, tasks);
+    for (int i = 0; i < tasks; ++i) {
+        ASSERT_TRUE(pool.post(new CountingTask(i)));
+    }
+
+    std::vector<ThreadTask *> collected;
+    ASSERT_TRUE(collectAll(pool, tasks, collected));
+    ASSERT_EQ(collected.size(), static_cast<size_t>(tasks));
+
+    std::vector<bool>        seen(tasks, false);
+    std::map<pthread_t, int> next;
+    for (size_t i = 0; i < collected.size(); ++i) {
+        CountingTask *task = static_cast<CountingTask *>(collected[i]);
+        ASSERT_FALSE(seen[task->id]) << "task " << task->id << " collected twice";
+        seen[task->id] = true;
+
+        std::map<pthread_t, int>::iterator thread = next.find(task->thread);
+        if (thread != next.end()) {
+            ASSERT_EQ(task->order, thread->second) << "task " << task->id << " out of order";
+        }
+        next[task->thread] = task->order + 1;
+    }
+    deleteAll(collected);
+}